@@ -0,0 +1,29 @@
+#include <string.h>
+
+#include "accounts.h"
+#include "config.h"
+
+// support the old single-account config.h
+#if !defined(ACCOUNTS) && defined(USERNAME)
+#define ACCOUNTS(ACCOUNT) ACCOUNT("", USERNAME, PASSWORD, REALM)
+#endif
+
+#define ACCOUNT_ENTRY(l, u, p, r) \
+    { .label = l, .username = u, .password = p, .realm = r },
+
+const voip_account_t voip_accounts[] = { ACCOUNTS(ACCOUNT_ENTRY) };
+const size_t voip_naccounts = sizeof(voip_accounts) / sizeof(*voip_accounts);
+
+int voip_account_find(const char* label){
+    for(size_t i = 0; i < voip_naccounts; i++){
+        if(strcmp(voip_accounts[i].label, label) == 0) return (int)i;
+    }
+    return -1;
+}
+
+int voip_accounts_duplicate(void){
+    for(size_t i = 1; i < voip_naccounts; i++){
+        if(voip_account_find(voip_accounts[i].label) != (int)i) return (int)i;
+    }
+    return -1;
+}
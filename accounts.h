@@ -0,0 +1,25 @@
+#ifndef ACCOUNTS_H
+#define ACCOUNTS_H
+
+#include <stddef.h>
+
+// one voip.ms (sub)account, as configured by ACCOUNTS() in config.h
+typedef struct {
+    // short name, used for the history shard and buffer name prefix
+    const char* label;
+    const char* username;
+    const char* password;
+    const char* realm;
+} voip_account_t;
+
+extern const voip_account_t voip_accounts[];
+extern const size_t voip_naccounts;
+
+// returns the index of the account with a matching label, or -1
+int voip_account_find(const char* label);
+
+/* labels have to be unique (they name the history shard and the buffers);
+   returns the index of the first account reusing an earlier label, or -1 */
+int voip_accounts_duplicate(void);
+
+#endif // ACCOUNTS_H
@@ -0,0 +1,181 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "history.h"
+
+/* benchmark the history parser over a large synthetic archive:
+       ./bench [megabytes] [directory]
+   the archive is written to directory/voipms/history (default /tmp/voipms-bench)
+   and parsed once per supported header parser.  Then (part of) it is copied
+   into each storage backend, to compare writes, full reads and range queries */
+
+static double now(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// write a history file of about mb megabytes; returns the exact size
+static size_t make_archive(const char* dir, size_t mb){
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/voipms", dir);
+    mkdir(dir, 0777);
+    mkdir(path, 0777);
+    snprintf(path, sizeof(path), "%s/voipms/history", dir);
+    mkdir(path, 0777);
+    snprintf(path, sizeof(path), "%s/voipms/history/.manifest", dir);
+    unlink(path);
+    snprintf(path, sizeof(path), "%s/voipms/history/<sip:5551234567@bench>"
+             "5551234567", dir);
+
+    FILE* f = fopen(path, "w");
+    if(!f){
+        perror(path);
+        exit(1);
+    }
+    char msg[512];
+    for(size_t i = 0; i < sizeof(msg); i++) msg[i] = 'a' + i % 26;
+    size_t total = 0;
+    long t = 1545000000;
+    srand(1);
+    while(total < mb * 1024 * 1024){
+        // typical sms lengths, with the occasional long one
+        size_t len = 1 + rand() % 160;
+        if(rand() % 50 == 0) len = 161 + rand() % 350;
+        t += rand() % 600;
+        int n = fprintf(f, "%ld:%d:%zu:%.*s\n", t, rand() % 2, len,
+                        (int)len, msg);
+        if(n < 0){
+            perror("fprintf");
+            exit(1);
+        }
+        total += n;
+    }
+    fclose(f);
+    return total;
+}
+
+// most messages to copy into each backend
+#define BACKEND_MSGS 100000
+
+// remove what an earlier run left in a backend's shard
+static void clean_shard(const char* dir, const char* shard){
+    const char* files[] = {".manifest", "history.db", "history.db-wal",
+                           "history.db-shm", "<sip:5551234567@bench>5551234567"};
+    char path[4096];
+    for(size_t i = 0; i < sizeof(files) / sizeof(*files); i++){
+        snprintf(path, sizeof(path), "%s/voipms/history/%s/%s", dir, shard,
+                 files[i]);
+        unlink(path);
+    }
+}
+
+// copy msgs into a backend (in one batch), then read them back
+static int bench_backend(const char* dir, const char* backend,
+                         hist_msg_t* msgs){
+    if(hist_use_backend(backend)) return 1;
+    clean_shard(dir, backend);
+
+    size_t n = 0, bytes = 0;
+    double t0 = now();
+    if(hist_begin(dir, backend)) return 1;
+    for(hist_msg_t* m = msgs; m && n < BACKEND_MSGS; m = m->next, n++){
+        if(hist_add_msg_at(dir, backend, "<sip:5551234567@bench>5551234567",
+                           m->msg, m->len, m->me, m->time, NULL)) return 1;
+        bytes += m->len;
+    }
+    if(hist_commit(dir, backend)) return 1;
+    double t1 = now();
+
+    hist_buf_t* hist = NULL;
+    if(list_hist_bufs(dir, backend, &hist) || !hist) return 1;
+    double t2 = now();
+
+    hist_msg_t* all = NULL;
+    if(get_hist_msg(dir, backend, hist->filename, &all)) return 1;
+    double t3 = now();
+
+    // the last hour of the conversation, as a timeline would want
+    hist_msg_t* recent = NULL;
+    if(hist_range_msg(dir, backend, hist->filename, hist->last - 3600,
+                      hist->last + 1, &recent)) return 1;
+    double t4 = now();
+    size_t nrecent = 0;
+    for(hist_msg_t* m = recent; m; m = m->next) nrecent++;
+
+    printf("%-6s: %zu messages: write %8.0f msg/s, list %7.2f ms, "
+           "full read %8.1f MB/s, last hour %7.2f ms (%zu messages)\n",
+           backend, n, n / (t1 - t0), (t2 - t1) * 1e3,
+           bytes / (t3 - t2) / 1e6, (t4 - t3) * 1e3, nrecent);
+    free_hist_msg(recent);
+    free_hist_msg(all);
+    free_hist_buf(hist);
+    hist_close();
+    return 0;
+}
+
+int main(int argc, char** argv){
+    size_t mb = argc > 1 ? strtoul(argv[1], NULL, 10) : 64;
+    const char* dir = argc > 2 ? argv[2] : "/tmp/voipms-bench";
+    const char* parsers[] = {"scalar", "sse2", "avx2"};
+
+    printf("writing %zuMB archive to %s\n", mb, dir);
+    size_t size = make_archive(dir, mb);
+    char manifest[4096];
+    snprintf(manifest, sizeof(manifest), "%s/voipms/history/.manifest", dir);
+
+    printf("default parser: %s\n", hist_parser());
+    for(size_t i = 0; i < sizeof(parsers) / sizeof(*parsers); i++){
+        if(hist_use_parser(parsers[i])){
+            printf("%-6s: not supported\n", parsers[i]);
+            continue;
+        }
+
+        // reindex: rebuilding the manifest scans every record header
+        unlink(manifest);
+        hist_buf_t* hist = NULL;
+        double t0 = now();
+        if(list_hist_bufs(dir, NULL, &hist) || !hist){
+            printf("list_hist_bufs failed\n");
+            return 1;
+        }
+        double t1 = now();
+
+        // full parse, as done when restoring a conversation
+        hist_msg_t* msg = NULL;
+        if(get_hist_msg(dir, NULL, hist->filename, &msg)){
+            printf("get_hist_msg failed\n");
+            return 1;
+        }
+        double t2 = now();
+
+        printf("%-6s: reindex %8.1f MB/s, full parse %8.1f MB/s "
+               "(%zu messages)\n", parsers[i],
+               size / (t1 - t0) / 1e6, size / (t2 - t1) / 1e6, hist->count);
+        free_hist_msg(msg);
+        free_hist_buf(hist);
+    }
+
+    // the same messages in every storage backend
+    hist_msg_t* msgs = NULL;
+    char fname[] = "<sip:5551234567@bench>5551234567";
+    if(get_hist_msg(dir, NULL, fname, &msgs)){
+        printf("get_hist_msg failed\n");
+        return 1;
+    }
+    const char* backends[] = {"files", "sqlite"};
+    for(size_t i = 0; i < sizeof(backends) / sizeof(*backends); i++){
+        if(bench_backend(dir, backends[i], msgs)){
+            printf("%s: failed\n", backends[i]);
+            return 1;
+        }
+    }
+    free_hist_msg(msgs);
+    return 0;
+}
@@ -1,29 +1,48 @@
 #include <stdlib.h>
+#include <stdio.h>
 #include <string.h>
 #include <stdbool.h>
-#include <regex.h>
+#include <stdint.h>
+#include <sys/types.h>
 
 #include "buffers.h"
 #include "voipms.h"
+#include "accounts.h"
+#include "complete.h"
+#include "recent.h"
 
 struct buffers {
-    // number of elements in each list:
+    // number of elements in the list:
     size_t len;
     // maximum number of elements:
     size_t maxlen;
-    // buffers
-    struct t_gui_buffer** buffers;
-    // sip uri associated with each buffer
-    char** sip_uris;
+    /* every conversation; the ones we know about (from the history) but
+       which haven't been opened yet have no buffer */
+    sip_contact_t** contacts;
+    /* the same conversations hashed by address (for checking pointers from
+       scripts), by account and uri, and by buffer.  The first two are open
+       addressing, as conversations are only removed all at once; by_buffer
+       is chained through buffer_next, as buffers come and go */
+    sip_contact_t** by_ptr;
+    sip_contact_t** by_uri;
+    sip_contact_t** by_buffer;
+    size_t index_cap;
 };
 
 
 // global variables
 struct buffers sip_buffers;
+sip_contact_t* sip_contacts;
+sip_contact_t* last_sip_contact;
 
 void sip_buffers_init(void){
-    sip_buffers.buffers = NULL;
-    sip_buffers.sip_uris = NULL;
+    sip_buffers.contacts = NULL;
+    sip_buffers.by_ptr = NULL;
+    sip_buffers.by_uri = NULL;
+    sip_buffers.by_buffer = NULL;
+    sip_buffers.index_cap = 0;
+    sip_contacts = NULL;
+    last_sip_contact = NULL;
     sip_buffers.len = 0;
     sip_buffers.maxlen = 0;
     return;
@@ -31,187 +50,308 @@ void sip_buffers_init(void){
 
 int sip_buffers_allocate(void){
     const size_t ini_max = 32;
-    // init
-    struct t_gui_buffer** buffers = NULL;
-    char** sip_uris = NULL;
-    // allocate
-    buffers = malloc(ini_max * sizeof(*buffers));
-    if(!buffers) goto fail;
-    sip_uris = malloc(ini_max * sizeof(*sip_uris));
-    if(!sip_uris) goto fail;
-    // done allocating
-    sip_buffers.buffers = buffers;
-    sip_buffers.sip_uris = sip_uris;
+    sip_contact_t** contacts = malloc(ini_max * sizeof(*contacts));
+    if(!contacts) return 1;
+    sip_buffers.contacts = contacts;
     sip_buffers.maxlen = ini_max;
     return 0;
-fail:
-    if(buffers) free(buffers);
-    if(sip_uris) free(sip_uris);
-    return 1;
+}
+
+static void free_contact(sip_contact_t* contact){
+    recent_clear(contact);
+    if(contact->filename) free(contact->filename);
+    if(contact->name) free(contact->name);
+    free(contact);
 }
 
 void sip_buffers_free(void){
-    // close all of the buffers
+    /* close all of the buffers.  Closing a buffer calls sip_buffer_close_cb,
+       which only marks the conversation as closed */
     for(size_t i = 0; i < sip_buffers.len; i++){
-        // free the buffer
-        weechat_buffer_close(sip_buffers.buffers[i]);
-        // free the "contact" string
-        free(sip_buffers.sip_uris[i]);
+        struct t_gui_buffer* buffer = sip_buffers.contacts[i]->buffer;
+        if(buffer) weechat_buffer_close(buffer);
     }
-    // free the buffer list
-    if(sip_buffers.buffers){
-        free(sip_buffers.buffers);
+    // free the contacts
+    for(size_t i = 0; i < sip_buffers.len; i++){
+        free_contact(sip_buffers.contacts[i]);
     }
-    // free the string list
-    if(sip_buffers.sip_uris){
-        free(sip_buffers.sip_uris);
+    // free the contact list
+    if(sip_buffers.contacts){
+        free(sip_buffers.contacts);
     }
+    if(sip_buffers.by_ptr) free(sip_buffers.by_ptr);
+    if(sip_buffers.by_uri) free(sip_buffers.by_uri);
+    if(sip_buffers.by_buffer) free(sip_buffers.by_buffer);
+    // nothing refers to the interned uris or the recent messages any more
+    sip_uri_free_all();
+    recent_stop();
+    sip_buffers.contacts = NULL;
     sip_buffers.len = 0;
     sip_buffers.maxlen = 0;
+    sip_buffers.by_ptr = NULL;
+    sip_buffers.by_uri = NULL;
+    sip_buffers.by_buffer = NULL;
+    sip_buffers.index_cap = 0;
+    sip_contacts = NULL;
+    last_sip_contact = NULL;
 }
 
-char* dup_only_sip_uri(const char* from, size_t len){
-    regex_t reg;
-    bool regex_allocated = false;
-    char* out = NULL;
-
-    // regex needs a null-terminated string, so we will put it in out
-    out = malloc(len + 1);
-    if(!out) goto fail;
-    memcpy(out, from, len);
-    out[len] = '\0';
-
-    // try and get just the sip uri
-    int ret = regcomp(&reg, "sip:[^\\s@]*@[-a-zA-Z0-9.]*", REG_EXTENDED);
-    if(ret) goto fail; else regex_allocated = true;
-    regmatch_t match;
-    ret = regexec(&reg, out, 1, &match, 0);
-    if(ret == 0){
-        int siplen = match.rm_eo - match.rm_so;
-        memmove(out, out + match.rm_so, siplen);
-        out[siplen] = '\0';
-    }else{
-        char ebuf[256];
-        size_t len = regerror(ret, &reg, ebuf, sizeof(ebuf));
-        weechat_printf(NULL, "regex says: %.*s", (int)len, ebuf);
+static size_t hash_ptr(const void* p){
+    // fibonacci hashing, without the bits malloc alignment leaves at 0
+    return (size_t)(((uintptr_t)p >> 4) * 11400714819323198485ULL);
+}
+
+static size_t hash_conv(size_t acct, const sip_uri_t* uri){
+    // interned uris carry a hash of their text
+    return uri->hash ^ (size_t)(acct * 11400714819323198485ULL);
+}
+
+static void index_insert(sip_contact_t** slots, size_t hash,
+                         sip_contact_t* contact){
+    size_t mask = sip_buffers.index_cap - 1;
+    size_t i = hash & mask;
+    while(slots[i]) i = (i + 1) & mask;
+    slots[i] = contact;
+}
+
+static void by_buffer_link(sip_contact_t* contact){
+    size_t i = hash_ptr(contact->buffer) & (sip_buffers.index_cap - 1);
+    contact->buffer_next = sip_buffers.by_buffer[i];
+    sip_buffers.by_buffer[i] = contact;
+}
+
+static void by_buffer_unlink(sip_contact_t* contact){
+    size_t i = hash_ptr(contact->buffer) & (sip_buffers.index_cap - 1);
+    for(sip_contact_t** p = &sip_buffers.by_buffer[i]; *p;
+            p = &(*p)->buffer_next){
+        if(*p == contact){
+            *p = contact->buffer_next;
+            break;
+        }
     }
-    regfree(&reg);
-    // if it can't do it, try and just create a new buffer
-    return out;
-fail:
-    if(out) free(out);
-    if(regex_allocated) regfree(&reg);
-    return NULL;
+    contact->buffer_next = NULL;
 }
 
+// make room in the indexes for one more conversation
+static int index_reserve(void){
+    if(2 * (sip_buffers.len + 1) <= sip_buffers.index_cap) return 0;
+    size_t cap = sip_buffers.index_cap ? 2 * sip_buffers.index_cap : 64;
+    sip_contact_t** by_ptr = calloc(cap, sizeof(*by_ptr));
+    sip_contact_t** by_uri = calloc(cap, sizeof(*by_uri));
+    sip_contact_t** by_buffer = calloc(cap, sizeof(*by_buffer));
+    if(!by_ptr || !by_uri || !by_buffer){
+        if(by_ptr) free(by_ptr);
+        if(by_uri) free(by_uri);
+        if(by_buffer) free(by_buffer);
+        return 1;
+    }
+    if(sip_buffers.by_ptr) free(sip_buffers.by_ptr);
+    if(sip_buffers.by_uri) free(sip_buffers.by_uri);
+    if(sip_buffers.by_buffer) free(sip_buffers.by_buffer);
+    sip_buffers.by_ptr = by_ptr;
+    sip_buffers.by_uri = by_uri;
+    sip_buffers.by_buffer = by_buffer;
+    sip_buffers.index_cap = cap;
+    for(size_t i = 0; i < sip_buffers.len; i++){
+        sip_contact_t* contact = sip_buffers.contacts[i];
+        index_insert(by_ptr, hash_ptr(contact), contact);
+        index_insert(by_uri, hash_conv(contact->acct, contact->uri), contact);
+        if(contact->buffer) by_buffer_link(contact);
+    }
+    return 0;
+}
 
-char* dup_only_phone_number(const char* sip_uri){
-    regex_t reg;
-    bool regex_allocated = false;
-    char* out = NULL;
-    size_t len = strlen(sip_uri);
-
-    // we put the original string in out. If there's no match, return original
-    out = malloc(len + 1);
-    if(!out) goto fail;
-    memcpy(out, sip_uri, len);
-    out[len] = '\0';
-
-    // try and get just the sip uri
-    int ret = regcomp(&reg, "sip:([0-9]{10})@[-a-zA-Z0-9]", REG_EXTENDED);
-    if(ret) goto fail; else regex_allocated = true;
-    regmatch_t matches[2];
-    ret = regexec(&reg, out, 2, matches, 0);
-    if(ret == 0){
-        // regex match! set *out to be the 10-digit substring
-        memmove(out, out + matches[1].rm_so, 10);
-        out[10] = '\0';
+// the conversation at p, if p is one; only compares the pointer
+static sip_contact_t* by_ptr_find(const void* p){
+    if(!sip_buffers.index_cap) return NULL;
+    size_t mask = sip_buffers.index_cap - 1;
+    for(size_t i = hash_ptr(p) & mask; sip_buffers.by_ptr[i];
+            i = (i + 1) & mask){
+        if(sip_buffers.by_ptr[i] == p) return sip_buffers.by_ptr[i];
     }
-    regfree(&reg);
-    return out;
-fail:
-    if(out) free(out);
-    if(regex_allocated) regfree(&reg);
     return NULL;
 }
 
-// add a sip uri (and corresponding weechat buffer) to sip_buffers
-/* *contact should be an allocated string, and this function will free it if
-   there is an error */
-struct t_gui_buffer* sip_buffers_new(char* sip_uri){
+bool sip_buffers_valid(const sip_contact_t* contact){
+    // safe with any value at all
+    return by_ptr_find(contact) != NULL;
+}
+
+// add a conversation (without a weechat buffer) to sip_buffers
+// Returns the new entry, or NULL
+static sip_contact_t* sip_buffers_new(size_t acct, sip_uri_t* uri){
     // check if we need to grow our list first
     if(sip_buffers.len == sip_buffers.maxlen){
-        // double the size of the buffers
+        // double the size of the list
         size_t new_max = 2 * sip_buffers.maxlen;
-        // realloc buffers
-        struct t_gui_buffer** buffers;
-        buffers = realloc(sip_buffers.buffers, new_max * sizeof(*buffers));
-        if(!buffers) return NULL;
-        sip_buffers.buffers = buffers;
-        // realloc sip_uris
-        char** sip_uris;
-        sip_uris = realloc(sip_buffers.sip_uris, new_max * sizeof(*sip_uris));
-        if(!sip_uris) return NULL;
-        sip_buffers.sip_uris = sip_uris;
+        sip_contact_t** contacts;
+        contacts = realloc(sip_buffers.contacts, new_max * sizeof(*contacts));
+        if(!contacts) return NULL;
+        sip_buffers.contacts = contacts;
         sip_buffers.maxlen = new_max;
     }
+    if(index_reserve()) return NULL;
+
+    sip_contact_t* contact = malloc(sizeof(*contact));
+    if(!contact) return NULL;
+    *contact = (sip_contact_t){ .acct = acct,
+                                .label = voip_accounts[acct].label,
+                                .uri = uri, .prev = last_sip_contact };
+    // without it the conversation still works, it just won't tab complete
+    complete_add_number(contact);
+
+    if(last_sip_contact) last_sip_contact->next = contact;
+    else sip_contacts = contact;
+    last_sip_contact = contact;
+    sip_buffers.contacts[sip_buffers.len++] = contact;
+    index_insert(sip_buffers.by_ptr, hash_ptr(contact), contact);
+    index_insert(sip_buffers.by_uri, hash_conv(acct, uri), contact);
+    return contact;
+}
+
+// find a conversation; returns NULL if there isn't one
+static sip_contact_t* sip_buffers_find(size_t acct, const sip_uri_t* uri){
+    if(!sip_buffers.index_cap) return NULL;
+    size_t mask = sip_buffers.index_cap - 1;
+    for(size_t i = hash_conv(acct, uri) & mask; sip_buffers.by_uri[i];
+            i = (i + 1) & mask){
+        sip_contact_t* contact = sip_buffers.by_uri[i];
+        // interned uris are equal when their pointers are
+        if(contact->acct == acct && contact->uri == uri) return contact;
+    }
+    return NULL;
+}
+
+/* create the weechat buffer for a conversation, and print its history if
+   history is true */
+static struct t_gui_buffer* open_at(sip_contact_t* contact, bool history){
     struct t_gui_buffer* buffer = NULL;
     char* buffername = NULL;
 
-    buffername = dup_only_phone_number(sip_uri);
-    if(!buffername) goto fail;
-    buffer = weechat_buffer_new(buffername,
-                                sip_buffer_input_cb, sip_uri, NULL,
-                                sip_buffer_close_cb, sip_uri, NULL);
+    /* with several accounts the same number may show up on more than one of
+       them, so prefix the buffer name with the account label */
+    const char* number = contact->uri->number;
+    const char* label = voip_accounts[contact->acct].label;
+    if(voip_naccounts > 1 && *label){
+        buffername = malloc(strlen(label) + strlen(number) + 2);
+        if(!buffername) goto fail;
+        sprintf(buffername, "%s.%s", label, number);
+    }
+
+    buffer = weechat_buffer_new(buffername ? buffername : number,
+                                sip_buffer_input_cb, contact, NULL,
+                                sip_buffer_close_cb, contact, NULL);
     if(!buffer) goto fail;
+    contact->buffer = buffer;
+    by_buffer_link(contact);
+
+    // restore the name the conversation had last time
+    if(contact->name) weechat_buffer_set(buffer, "name", contact->name);
 
-    sip_buffers.sip_uris[sip_buffers.len] = sip_uri;
-    sip_buffers.buffers[sip_buffers.len] = buffer;
-    sip_buffers.len += 1;
+    if(history && contact->messages){
+        // the end of the history is still in memory
+        voip_plugin_print_recent(buffer, contact);
+        recent_touch(contact);
+    }else{
+        // what gets printed from here on is what's recent
+        recent_clear(contact);
+        // show the history for conversations we've had before
+        if(history && contact->filename){
+            voip_plugin_load_history(contact->acct, buffer, contact->uri,
+                                     contact->filename);
+        }
+    }
 
-    free(buffername);
+    if(buffername) free(buffername);
     return buffer;
 fail:
     if(buffername) free(buffername);
-    if(buffer) weechat_buffer_close(buffer);
-    free(sip_uri);
     return NULL;
 }
 
+/* returns the buffer for a conversation, creating the conversation and/or the
+   buffer as needed */
+struct t_gui_buffer* sip_buffers_open(size_t acct, sip_uri_t* uri,
+                                      bool history){
+    if(!uri) return NULL;
+    // check if we already have a matching conversation
+    sip_contact_t* contact = sip_buffers_find(acct, uri);
+    if(contact){
+        if(contact->buffer) return contact->buffer;
+    }else{
+        // if we didn't find anything, allocated it now
+        contact = sip_buffers_new(acct, uri);
+        if(!contact) return NULL;
+    }
+    // the first message (or an explicit open) makes it a real buffer
+    return open_at(contact, history);
+}
+
 // for when you recv a msg: returns an existing buffer or allocates a new one
-struct t_gui_buffer* sip_buffers_get(const char* from, size_t flen){
-    /* this is where we will allocate the memory that gets stored into
-       sip_buffers.sip_uris.  If we already have the buffer we need to free it.
-       Otherwise sip_buffers_new() will handle freeing it on errors. */
-    char* sip_uri = dup_only_sip_uri(from, flen);
-    if(!sip_uri) return NULL;
-    // check if we already have a matching buffer
-    for(size_t i = 0; i < sip_buffers.len; i++){
-        if(strcmp(sip_uri, sip_buffers.sip_uris[i]) == 0){
-            // found matching buffer
-            free(sip_uri);
-            return sip_buffers.buffers[i];
-        }
+struct t_gui_buffer* sip_buffers_get(size_t acct, const char* from,
+                                     size_t flen){
+    return sip_buffers_open(acct, sip_uri_from_header(from, flen), true);
+}
+
+// the buffer of a conversation, or NULL if it isn't open
+struct t_gui_buffer* sip_buffers_lookup(size_t acct, const sip_uri_t* uri){
+    sip_contact_t* contact = sip_buffers_find(acct, uri);
+    return contact ? contact->buffer : NULL;
+}
+
+const sip_contact_t* sip_buffers_conversation(size_t acct,
+                                              const sip_uri_t* uri){
+    return sip_buffers_find(acct, uri);
+}
+
+/* remember a conversation from the history without opening a buffer for it;
+   it gets opened by sip_buffers_get() */
+int sip_buffers_add_closed(size_t acct, sip_uri_t* uri, const char* name,
+                           const char* filename){
+    if(!uri) return 1;
+    if(sip_buffers_find(acct, uri)) return 0;
+    sip_contact_t* contact = sip_buffers_new(acct, uri);
+    if(!contact) return 1;
+    contact->name = name ? strdup(name) : NULL;
+    contact->filename = filename ? strdup(filename) : NULL;
+    if(name) complete_set_name(contact, name);
+    return 0;
+}
+
+// which conversation does a buffer belong to?  NULL if it is not ours
+const sip_contact_t* sip_buffers_contact(struct t_gui_buffer* buffer){
+    if(!buffer || !sip_buffers.index_cap) return NULL;
+    size_t i = hash_ptr(buffer) & (sip_buffers.index_cap - 1);
+    for(sip_contact_t* c = sip_buffers.by_buffer[i]; c; c = c->buffer_next){
+        if(c->buffer == buffer) return c;
     }
-    // if we didn't find anything, allocated it now
-    return sip_buffers_new(sip_uri);
+    return NULL;
 }
 
-// for when a buffer is closed: remove it from sip_buffers
-void sip_buffers_delete(const char* sip_uri){
-    for(size_t i = 0; i < sip_buffers.len; i++){
-        if(strcmp(sip_uri, sip_buffers.sip_uris[i]) == 0){
-            /* found matching buffer; weechat will free the buffer we
-               allocated, but we need to free the string we allocated. Then we
-               need to leftshift both arrays. */
-            free(sip_buffers.sip_uris[i]);
-            memmove(&sip_buffers.sip_uris[i],
-                    &sip_buffers.sip_uris[i+1],
-                    (sip_buffers.len - i - 1) * sizeof(*sip_buffers.sip_uris));
-            memmove(&sip_buffers.buffers[i],
-                    &sip_buffers.buffers[i+1],
-                    (sip_buffers.len - i - 1) * sizeof(*sip_buffers.buffers));
-            return;
+/* for when a buffer is closed: forget the buffer, but remember the
+   conversation so that it can be reopened with its history */
+void sip_buffers_closed(const sip_contact_t* contact,
+                        struct t_gui_buffer* buffer){
+    sip_contact_t* c = by_ptr_find(contact);
+    if(c){
+        // weechat will free the buffer we allocated
+        by_buffer_unlink(c);
+        c->buffer = NULL;
+        // history is kept in "<sip_uri>name", named after the buffer
+        const char* name = weechat_buffer_get_string(buffer, "name");
+        const char* fname = name ? sip_uri_filename(c->uri, name) : NULL;
+        if(fname){
+            char* filename = strdup(fname);
+            char* name_dup = strdup(name);
+            if(filename && name_dup){
+                if(c->filename) free(c->filename);
+                if(c->name) free(c->name);
+                c->filename = filename;
+                c->name = name_dup;
+            }else{
+                if(filename) free(filename);
+                if(name_dup) free(name_dup);
+            }
         }
     }
 }
@@ -1,14 +1,75 @@
 #ifndef BUFFERS_H
 #define BUFFERS_H
 
+#include <stddef.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include "uri.h"
+
+struct t_gui_buffer;
+
+// a message recently printed to a conversation's buffer (see recent.h)
+typedef struct sip_recent_t {
+    time_t time;
+    int me;
+    // its slab size class
+    unsigned char cls;
+    char* msg;
+    // (the text may have a NUL in it)
+    size_t len;
+    struct sip_recent_t *prev, *next;
+} sip_recent_t;
+
+// a conversation: a remote sip uri, as seen from one of our accounts
+typedef struct sip_contact_t {
+    // index into voip_accounts, and that account's label
+    size_t acct;
+    const char* label;
+    sip_uri_t* uri;
+    /* the history file and buffer name, for reopening a conversation which
+       has no buffer right now; NULL if there is no history yet */
+    char* filename;
+    char* name;
+    // its name in the tab completion index (owned by complete.c), or NULL
+    const char* complete_name;
+    // its weechat buffer; NULL for conversations which aren't open
+    struct t_gui_buffer* buffer;
+    // the next conversation in its chain of the index by buffer (buffers.c)
+    struct sip_contact_t* buffer_next;
+    /* the last RECENT_MESSAGES messages printed to the buffer, oldest
+       first, so it can be reopened (and scripts can read it) without going
+       back to the history */
+    sip_recent_t* messages;
+    sip_recent_t* last_message;
+    int message_count;
+    // conversations with messages, by when they were last used
+    struct sip_contact_t *lru_prev, *lru_next;
+    // every conversation, in the order we learned of it
+    struct sip_contact_t *prev, *next;
+} sip_contact_t;
+
+// the list of conversations (for hdata)
+extern sip_contact_t* sip_contacts;
+extern sip_contact_t* last_sip_contact;
+
 void sip_buffers_init(void);
 int sip_buffers_allocate(void);
 void sip_buffers_free(void);
 
-char* dup_only_sip_uri(const char* contact, size_t len);
-char* dup_only_phone_number(const char* contact);
-
-struct t_gui_buffer* sip_buffers_get(const char* contact_in, size_t len);
-void sip_buffers_delete(const char* contact);
-
+struct t_gui_buffer* sip_buffers_get(size_t acct, const char* contact_in,
+                                     size_t len);
+struct t_gui_buffer* sip_buffers_open(size_t acct, sip_uri_t* uri,
+                                      bool history);
+struct t_gui_buffer* sip_buffers_lookup(size_t acct, const sip_uri_t* uri);
+// the conversation with uri on account acct, or NULL
+const sip_contact_t* sip_buffers_conversation(size_t acct,
+                                              const sip_uri_t* uri);
+// whether a pointer (e.g. from a script) is one of the conversations
+bool sip_buffers_valid(const sip_contact_t* contact);
+int sip_buffers_add_closed(size_t acct, sip_uri_t* uri, const char* name,
+                           const char* filename);
+const sip_contact_t* sip_buffers_contact(struct t_gui_buffer* buffer);
+void sip_buffers_closed(const sip_contact_t* contact,
+                        struct t_gui_buffer* buffer);
 #endif // BUFFERS_H
@@ -0,0 +1,188 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include "burst.h"
+#include "voipms.h"
+#include "buffers.h"
+#include "restore.h"
+#include "recent.h"
+
+// defaults for the settings in config.h
+#ifndef BURST_MS
+#define BURST_MS 250
+#endif
+#ifndef BURST_MAX_MS
+#define BURST_MAX_MS 2000
+#endif
+
+typedef struct burst_msg_t {
+    // when it arrived
+    time_t time;
+    size_t len;
+    struct burst_msg_t* next;
+    char msg[];
+} burst_msg_t;
+
+// the messages one buffer is holding back
+typedef struct burst_t {
+    struct t_gui_buffer* buffer;
+    // (monotonic) milliseconds of its first and last message
+    long long first_ms;
+    long long last_ms;
+    burst_msg_t* msgs;
+    burst_msg_t** tail;
+    size_t count;
+    struct burst_t* next;
+} burst_t;
+
+struct bursts {
+    burst_t* list;
+    struct t_hook* timer;
+};
+
+struct bursts bursts;
+
+static long long now_ms(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void print_msg(struct t_gui_buffer* buffer, time_t t,
+                      const char* tags, const char* msg, size_t len){
+    weechat_printf_date_tags(buffer, t, tags, "%s%.*s",
+                             weechat_color("green"), (int)len, msg);
+    recent_add(sip_buffers_contact(buffer), t, false, msg, len);
+}
+
+// print a burst, and free it
+static void burst_print(burst_t* b){
+    // the history goes above anything new
+    restore_flush(b->buffer);
+    // one message is just a message
+    const char* tags = b->count > 1 ? "notify_none" : "notify_highlight";
+    time_t last = 0;
+    burst_msg_t *m, *next = b->msgs;
+    while( (m = next) ){
+        next = m->next;
+        print_msg(b->buffer, m->time, tags, m->msg, m->len);
+        last = m->time;
+        free(m);
+    }
+    if(b->count > 1){
+        weechat_printf_date_tags(b->buffer, last, "notify_highlight,no_log",
+                                 "%s--\t%s%zu new messages",
+                                 weechat_color("green"),
+                                 weechat_color("green"), b->count);
+    }
+    free(b);
+}
+
+// take a buffer's burst out of the list; NULL if it has none
+static burst_t* burst_take(struct t_gui_buffer* buffer){
+    for(burst_t** p = &bursts.list; *p; p = &(*p)->next){
+        burst_t* b = *p;
+        if(b->buffer != buffer) continue;
+        *p = b->next;
+        return b;
+    }
+    return NULL;
+}
+
+static void burst_unhook(void){
+    if(bursts.list || !bursts.timer) return;
+    weechat_unhook(bursts.timer);
+    bursts.timer = NULL;
+}
+
+// print the bursts which have gone quiet (or have waited long enough)
+static int burst_timer_cb(const void* ptr, void* data, int remaining){
+    (void)ptr;
+    (void)data;
+    (void)remaining;
+    long long now = now_ms();
+    burst_t** p = &bursts.list;
+    while(*p){
+        burst_t* b = *p;
+        if(now - b->last_ms < BURST_MS && now - b->first_ms < BURST_MAX_MS){
+            p = &b->next;
+            continue;
+        }
+        *p = b->next;
+        burst_print(b);
+    }
+    burst_unhook();
+    return WEECHAT_RC_OK;
+}
+
+void burst_add(struct t_gui_buffer* buffer, const char* msg, size_t len){
+    time_t t = time(NULL);
+    if(BURST_MS <= 0){
+        restore_flush(buffer);
+        print_msg(buffer, t, "notify_highlight", msg, len);
+        return;
+    }
+
+    burst_msg_t* m = malloc(sizeof(*m) + len);
+    burst_t* b = NULL;
+    if(!m) goto fail;
+    *m = (burst_msg_t){ .time = t, .len = len };
+    memcpy(m->msg, msg, len);
+
+    for(b = bursts.list; b && b->buffer != buffer; b = b->next);
+    if(!b){
+        b = malloc(sizeof(*b));
+        if(!b) goto fail;
+        *b = (burst_t){ .buffer = buffer, .first_ms = now_ms(),
+                        .tail = &b->msgs, .next = bursts.list };
+        bursts.list = b;
+    }
+    if(!bursts.timer){
+        long tick = BURST_MS / 2 > 10 ? BURST_MS / 2 : 10;
+        bursts.timer = weechat_hook_timer(tick, 0, 0, burst_timer_cb,
+                                          NULL, NULL);
+        if(!bursts.timer){
+            // print it all now rather than hold it back forever
+            burst_flush(buffer);
+            goto fail;
+        }
+    }
+    *b->tail = m;
+    b->tail = &m->next;
+    b->count++;
+    b->last_ms = now_ms();
+    return;
+
+fail:
+    if(m) free(m);
+    restore_flush(buffer);
+    print_msg(buffer, t, "notify_highlight", msg, len);
+}
+
+void burst_flush(struct t_gui_buffer* buffer){
+    if(!bursts.list) return;
+    burst_t* b = burst_take(buffer);
+    if(!b) return;
+    burst_print(b);
+    burst_unhook();
+}
+
+void burst_closed(struct t_gui_buffer* buffer){
+    if(!bursts.list) return;
+    burst_t* b = burst_take(buffer);
+    if(!b) return;
+    // they're in the history already
+    burst_msg_t *m, *next = b->msgs;
+    while( (m = next) ){
+        next = m->next;
+        free(m);
+    }
+    free(b);
+    burst_unhook();
+}
+
+void burst_stop(void){
+    while(bursts.list) burst_closed(bursts.list->buffer);
+}
@@ -0,0 +1,26 @@
+#ifndef BURST_H
+#define BURST_H
+
+#include <stddef.h>
+
+#include <weechat/weechat-plugin.h>
+
+/* Received messages are printed in bursts: the messages a buffer gets within
+   BURST_MS of each other are held back and printed together, each with its
+   own time, and the burst gets one highlight (with a count) instead of one
+   per message. */
+
+// print a received message to buffer, now or with the rest of its burst
+void burst_add(struct t_gui_buffer* buffer, const char* msg, size_t len);
+
+/* print what buffer is holding back right now (before printing anything
+   else to it, to keep the order) */
+void burst_flush(struct t_gui_buffer* buffer);
+
+// for when a buffer is closed: forget what it's holding back
+void burst_closed(struct t_gui_buffer* buffer);
+
+// forget everything held back (on plugin unload)
+void burst_stop(void);
+
+#endif // BURST_H
@@ -0,0 +1,199 @@
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdbool.h>
+#include <ctype.h>
+
+#include "complete.h"
+#include "voipms.h"
+
+/* the most candidates offered at once; an empty or very short word would
+   otherwise list every contact */
+#define COMPLETE_MAX 256
+
+typedef struct {
+    // a phone number (owned by the interned uri) or a name (owned by us)
+    const char* key;
+    const sip_contact_t* contact;
+    bool is_name;
+} complete_entry_t;
+
+static struct {
+    // sorted by key, ignoring case
+    complete_entry_t* entries;
+    size_t len;
+    size_t max;
+    // entries are appended, unsorted, until complete_sort()
+    bool deferred;
+    struct t_hook* completion;
+    struct t_hook* renamed;
+} complete;
+
+// index of the first entry whose key is not less than word
+static size_t lower_bound(const char* word){
+    size_t lo = 0, hi = complete.len;
+    while(lo < hi){
+        size_t mid = lo + (hi - lo) / 2;
+        if(strcasecmp(complete.entries[mid].key, word) < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+static int complete_insert(const char* key, const sip_contact_t* contact,
+                           bool is_name){
+    if(complete.len == complete.max){
+        size_t new_max = complete.max ? 2 * complete.max : 64;
+        complete_entry_t* entries = realloc(complete.entries,
+                                            new_max * sizeof(*entries));
+        if(!entries) return 1;
+        complete.entries = entries;
+        complete.max = new_max;
+    }
+    size_t i = complete.deferred ? complete.len : lower_bound(key);
+    memmove(&complete.entries[i + 1], &complete.entries[i],
+            (complete.len - i) * sizeof(*complete.entries));
+    complete.entries[i] = (complete_entry_t){ .key = key, .contact = contact,
+                                              .is_name = is_name };
+    complete.len++;
+    return 0;
+}
+
+int complete_add_number(const sip_contact_t* contact){
+    return complete_insert(contact->uri->number, contact, false);
+}
+
+// a name worth completing: one word, and not the default "[label.]number"
+static bool useful_name(const sip_contact_t* contact, const char* name){
+    if(!*name || strstr(name, contact->uri->number)) return false;
+    for(const char* c = name; *c; c++){
+        if(isspace((unsigned char)*c)) return false;
+    }
+    return true;
+}
+
+int complete_set_name(const sip_contact_t* contact, const char* name){
+    // (the contact is ours; callers only get to see it as const)
+    sip_contact_t* c = (sip_contact_t*)contact;
+    if(c->complete_name){
+        if(strcmp(c->complete_name, name) == 0) return 0;
+        // renames are rare enough that sorting first is fine
+        complete_sort();
+        for(size_t i = lower_bound(c->complete_name); i < complete.len; i++){
+            complete_entry_t* e = &complete.entries[i];
+            if(!e->is_name || e->contact != contact) continue;
+            free((char*)e->key);
+            complete.len--;
+            memmove(e, e + 1, (complete.len - i) * sizeof(*e));
+            break;
+        }
+        c->complete_name = NULL;
+    }
+    if(!useful_name(contact, name)) return 0;
+    char* key = strdup(name);
+    if(!key) return 1;
+    if(complete_insert(key, contact, true)){
+        free(key);
+        return 1;
+    }
+    c->complete_name = key;
+    return 0;
+}
+
+void complete_defer(void){
+    complete.deferred = true;
+}
+
+static int entry_cmp(const void* a, const void* b){
+    const complete_entry_t* ea = a;
+    const complete_entry_t* eb = b;
+    int cmp = strcasecmp(ea->key, eb->key);
+    // the same key from several accounts stays together
+    return cmp ? cmp : strcmp(ea->key, eb->key);
+}
+
+void complete_sort(void){
+    if(!complete.deferred) return;
+    complete.deferred = false;
+    if(complete.len > 1){
+        qsort(complete.entries, complete.len, sizeof(*complete.entries),
+              entry_cmp);
+    }
+}
+
+const sip_contact_t* complete_find(const char* name){
+    complete_sort();
+    for(size_t i = lower_bound(name); i < complete.len; i++){
+        complete_entry_t* e = &complete.entries[i];
+        if(strcasecmp(e->key, name) != 0) break;
+        if(e->is_name) return e->contact;
+    }
+    return NULL;
+}
+
+static int complete_cb(const void* ptr, void* data, const char* item,
+                       struct t_gui_buffer* buffer,
+                       struct t_gui_completion* completion){
+    (void)ptr;
+    (void)data;
+    (void)item;
+    (void)buffer;
+    const char* word = weechat_completion_get_string(completion, "base_word");
+    if(!word) word = "";
+    size_t len = strlen(word);
+    complete_sort();
+
+    // every key starting with word is in one run after the lower bound
+    const char* prev = NULL;
+    size_t n = 0;
+    for(size_t i = lower_bound(word); i < complete.len && n < COMPLETE_MAX;
+            i++){
+        const char* key = complete.entries[i].key;
+        if(strncasecmp(key, word, len) != 0) break;
+        // the same number may be in several accounts
+        if(prev && strcmp(prev, key) == 0) continue;
+        weechat_completion_list_add(completion, key, 0, WEECHAT_LIST_POS_END);
+        prev = key;
+        n++;
+    }
+    return WEECHAT_RC_OK;
+}
+
+static int complete_renamed_cb(const void* ptr, void* data,
+                               const char* signal, const char* type_data,
+                               void* signal_data){
+    (void)ptr;
+    (void)data;
+    (void)signal;
+    (void)type_data;
+    struct t_gui_buffer* buffer = signal_data;
+    const sip_contact_t* contact = sip_buffers_contact(buffer);
+    const char* name = weechat_buffer_get_string(buffer, "name");
+    if(contact && name) complete_set_name(contact, name);
+    return WEECHAT_RC_OK;
+}
+
+int complete_start(void){
+    complete.completion = weechat_hook_completion("voipms_contacts",
+        "numbers and names of sms conversations", complete_cb, NULL, NULL);
+    if(!complete.completion) return 1;
+    complete.renamed = weechat_hook_signal("buffer_renamed",
+                                           complete_renamed_cb, NULL, NULL);
+    if(!complete.renamed) return 1;
+    return 0;
+}
+
+void complete_stop(void){
+    if(complete.completion) weechat_unhook(complete.completion);
+    if(complete.renamed) weechat_unhook(complete.renamed);
+    for(size_t i = 0; i < complete.len; i++){
+        if(complete.entries[i].is_name) free((char*)complete.entries[i].key);
+    }
+    if(complete.entries) free(complete.entries);
+    complete.entries = NULL;
+    complete.len = 0;
+    complete.max = 0;
+    complete.deferred = false;
+    complete.completion = NULL;
+    complete.renamed = NULL;
+}
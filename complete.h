@@ -0,0 +1,37 @@
+#ifndef COMPLETE_H
+#define COMPLETE_H
+
+#include "buffers.h"
+
+/* Tab completion of the numbers and names of every conversation we know
+   about, for /sms.  The index is a sorted array which is kept up to date as
+   conversations are added and buffers are renamed, so completing is a
+   binary search no matter how many contacts there are.  When many
+   conversations are added at once, complete_defer() lets them be appended
+   and sorted in one go instead. */
+
+// hook the "voipms_contacts" completion; returns 0 on success
+int complete_start(void);
+
+// index the phone number of a new conversation; returns 0 on success
+int complete_add_number(const sip_contact_t* contact);
+
+/* index the name of a conversation, replacing the name it had before;
+   names which are just the default buffer name aren't indexed */
+int complete_set_name(const sip_contact_t* contact, const char* name);
+
+/* append to the index without keeping it sorted, until complete_sort();
+   for registering every conversation from the history at startup */
+void complete_defer(void);
+
+// sort whatever was appended since complete_defer()
+void complete_sort(void);
+
+// the conversation with a name (ignoring case), or NULL
+const sip_contact_t* complete_find(const char* name);
+
+/* unhook and free the index.  It doesn't look at the contacts, so it can be
+   called after they've been freed */
+void complete_stop(void);
+
+#endif // COMPLETE_H
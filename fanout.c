@@ -0,0 +1,235 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include "fanout.h"
+#include "voipms.h"
+#include "buffers.h"
+#include "history.h"
+#include "accounts.h"
+
+typedef struct fanout_t fanout_t;
+
+// one recipient of a fan-out
+typedef struct {
+    fanout_t* job;
+    sip_uri_t* uri;
+    // SIP status code; 0 while waiting for it, -1 if it was never sent
+    int code;
+    char* reason;
+} fanout_rcpt_t;
+
+struct fanout_t {
+    // where to print the summary (by name, in case it was closed meanwhile)
+    char* cmd_buffer;
+    /* each recipient is allocated on its own: it's the token of its MESSAGE,
+       so it mustn't move when the array grows */
+    fanout_rcpt_t** rcpts;
+    size_t n;
+    size_t max;
+    /* recipients we're still waiting on, plus one for fanout_send() itself
+       while it is still sending */
+    size_t pending;
+    struct timespec start;
+    fanout_t* next;
+};
+
+// fan-outs still waiting for answers
+static fanout_t* jobs = NULL;
+
+static void fanout_free(fanout_t* job){
+    for(size_t i = 0; i < job->n; i++){
+        if(job->rcpts[i]->reason) free(job->rcpts[i]->reason);
+        free(job->rcpts[i]);
+    }
+    if(job->rcpts) free(job->rcpts);
+    if(job->cmd_buffer) free(job->cmd_buffer);
+    free(job);
+}
+
+// add a recipient, unless we already have it; returns nonzero on error
+static int fanout_add(fanout_t* job, sip_uri_t* uri){
+    for(size_t i = 0; i < job->n; i++){
+        if(job->rcpts[i]->uri == uri) return 0;
+    }
+    if(job->n == job->max){
+        size_t new_max = job->max ? 2 * job->max : 16;
+        fanout_rcpt_t** rcpts = realloc(job->rcpts, new_max * sizeof(*rcpts));
+        if(!rcpts) return 1;
+        job->rcpts = rcpts;
+        job->max = new_max;
+    }
+    fanout_rcpt_t* r = malloc(sizeof(*r));
+    if(!r) return 1;
+    *r = (fanout_rcpt_t){ .job = job, .uri = uri };
+    job->rcpts[job->n++] = r;
+    return 0;
+}
+
+/* split numbers on commas and whitespace; a # starts a comment which runs to
+   the end of the line */
+static int fanout_parse(fanout_t* job, size_t acct, const char* numbers){
+    const char* c = numbers;
+    while(*c){
+        if(*c == '#'){
+            while(*c && *c != '\n') c++;
+            continue;
+        }
+        size_t len = strcspn(c, ", \t\r\n#");
+        if(len){
+            // tokens without any digits (e.g. a header line) are skipped
+            sip_uri_t* uri = sip_uri_from_number(c, len,
+                                                 voip_accounts[acct].realm);
+            if(uri && fanout_add(job, uri)) return 1;
+            c += len;
+        }else{
+            c++;
+        }
+    }
+    return 0;
+}
+
+static void fanout_summary(fanout_t* job){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double secs = (now.tv_sec - job->start.tv_sec)
+                  + (now.tv_nsec - job->start.tv_nsec) / 1e9;
+
+    size_t ok = 0;
+    for(size_t i = 0; i < job->n; i++){
+        if(job->rcpts[i]->code >= 200 && job->rcpts[i]->code < 300) ok++;
+    }
+
+    struct t_gui_buffer* buffer = weechat_buffer_search("==", job->cmd_buffer);
+    weechat_printf(buffer, "sms to %zu recipients: %zu accepted, %zu failed "
+                   "(%.2fs)", job->n, ok, job->n - ok, secs);
+    for(size_t i = 0; i < job->n; i++){
+        fanout_rcpt_t* r = job->rcpts[i];
+        if(r->code < 0){
+            weechat_printf(buffer, "  %s: not sent", r->uri->number);
+        }else{
+            weechat_printf(buffer, "  %s: %d %s", r->uri->number, r->code,
+                           r->reason ? r->reason : "");
+        }
+    }
+}
+
+// one less answer to wait for; the last one prints the summary
+static void fanout_done(fanout_t* job){
+    if(--job->pending) return;
+    fanout_summary(job);
+    // unlink and free the job
+    for(fanout_t** p = &jobs; *p; p = &(*p)->next){
+        if(*p == job){
+            *p = job->next;
+            break;
+        }
+    }
+    fanout_free(job);
+}
+
+static int fanout_run(fanout_t* job, size_t acct, const char* msg){
+    if(job->n == 0){
+        weechat_printf(weechat_buffer_search("==", job->cmd_buffer),
+                       "/sms: no recipients");
+        fanout_free(job);
+        return 1;
+    }
+    job->pending = job->n + 1;
+    clock_gettime(CLOCK_MONOTONIC, &job->start);
+    job->next = jobs;
+    jobs = job;
+
+    // every recipient's history goes in one batch
+    const char* shard = voip_accounts[acct].label;
+    bool batch = hist_begin(wc_dir, shard) == 0;
+    for(size_t i = 0; i < job->n; i++){
+        fanout_rcpt_t* r = job->rcpts[i];
+        /* like the restore, don't load the history of every recipient just
+           to send one message (a fan-out may open hundreds of buffers) */
+        struct t_gui_buffer* buffer = sip_buffers_open(acct, r->uri, false);
+        const sip_contact_t* contact = buffer
+                ? sip_buffers_conversation(acct, r->uri) : NULL;
+        // don't wait for the answer to a MESSAGE before sending the next one
+        int ret = contact ? voip_plugin_send_sms(buffer, contact, msg, r)
+                          : WEECHAT_RC_ERROR;
+        // (unless the failure was already reported through fanout_status)
+        if(ret != WEECHAT_RC_OK && r->code == 0){
+            r->code = -1;
+            fanout_done(job);
+        }
+    }
+    if(batch) hist_commit(wc_dir, shard);
+
+    // done sending
+    fanout_done(job);
+    return 0;
+}
+
+static fanout_t* fanout_new(struct t_gui_buffer* cmd_buffer){
+    fanout_t* job = calloc(1, sizeof(*job));
+    if(!job) return NULL;
+    const char* name = weechat_buffer_get_string(cmd_buffer, "full_name");
+    job->cmd_buffer = strdup(name ? name : "");
+    if(!job->cmd_buffer){
+        free(job);
+        return NULL;
+    }
+    return job;
+}
+
+int fanout_send(struct t_gui_buffer* cmd_buffer, size_t acct,
+                const char* numbers, const char* msg){
+    fanout_t* job = fanout_new(cmd_buffer);
+    if(!job) return 1;
+    if(fanout_parse(job, acct, numbers)){
+        fanout_free(job);
+        return 1;
+    }
+    return fanout_run(job, acct, msg);
+}
+
+int fanout_send_file(struct t_gui_buffer* cmd_buffer, size_t acct,
+                     const char* path, const char* msg){
+    FILE* f = fopen(path, "r");
+    if(!f){
+        weechat_printf(cmd_buffer, "/sms: unable to open %s", path);
+        return 1;
+    }
+    fanout_t* job = fanout_new(cmd_buffer);
+    char* line = NULL;
+    size_t cap = 0;
+    int retval = 1;
+    if(!job) goto done;
+    while(getline(&line, &cap, f) >= 0){
+        if(fanout_parse(job, acct, line)){
+            fanout_free(job);
+            goto done;
+        }
+    }
+    retval = fanout_run(job, acct, msg);
+done:
+    if(line) free(line);
+    fclose(f);
+    return retval;
+}
+
+void fanout_status(void* token, int code, const char* reason, size_t rlen){
+    fanout_rcpt_t* r = token;
+    // only the final answer counts
+    if(r->code != 0) return;
+    r->code = code;
+    r->reason = strndup(reason, rlen);
+    fanout_done(r->job);
+}
+
+void fanout_stop(void){
+    fanout_t *job, *next = jobs;
+    while( (job = next) ){
+        next = job->next;
+        fanout_free(job);
+    }
+    jobs = NULL;
+}
@@ -0,0 +1,28 @@
+#ifndef FANOUT_H
+#define FANOUT_H
+
+#include <stddef.h>
+
+#include <weechat/weechat-plugin.h>
+
+/* One message to many recipients.  Every MESSAGE is sent straight away, so
+   the transactions are in flight together, and a summary is printed to the
+   buffer the command came from once every recipient has answered. */
+
+/* send msg to each of the numbers, which are separated by commas, spaces or
+   newlines; returns nonzero if nothing was sent */
+int fanout_send(struct t_gui_buffer* cmd_buffer, size_t acct,
+                const char* numbers, const char* msg);
+
+// the same, with numbers from a file (one per line, # for comments)
+int fanout_send_file(struct t_gui_buffer* cmd_buffer, size_t acct,
+                     const char* path, const char* msg);
+
+// the final status of one recipient's MESSAGE (token came from fanout_send);
+// only ever called on the main loop
+void fanout_status(void* token, int code, const char* reason, size_t rlen);
+
+// forget every fan-out still waiting for answers (on plugin unload)
+void fanout_stop(void);
+
+#endif // FANOUT_H
@@ -0,0 +1,571 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <ctype.h>
+#include <time.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "history.h"
+#include "uri.h"
+
+/* check and repair the history (files backend) while the plugin isn't
+   running:
+       ./fsck [-d weechat_dir] [-s shard] [-r realm] [-j threads] [-n]
+   Every history file is read, on as many threads as there are cores.  The
+   files of one number (e.g. "<1234567890>name" from an old version, and
+   "<sip:1234567890@realm>name") are merged into one, in time order, and
+   exact duplicates (same time, direction and text) are dropped.  A file
+   which is out of order, has duplicates, or has unreadable records is
+   rewritten the same way; whatever couldn't be read is saved in
+   voipms/lost+found.  Rewrites replace the old file atomically, and the
+   manifest is rebuilt at the end.
+
+   With -r, numbers which aren't in a sip uri ("<1234567890>") get the one
+   live messages from them would have ("<sip:1234567890@realm>").  With -n,
+   nothing is changed; what would be done is only reported. */
+
+#define FAIL(n) { retval = n; goto fail; }
+
+static const char* wc_dir;
+static const char* shard;
+static const char* realm;
+static bool dry_run;
+static int hdir_fd = -1;
+
+// one history file
+typedef struct {
+    char* fname;
+    size_t uri_len;
+    off_t size;
+    // whether its uri is the kind live messages have
+    bool sip;
+    // the time of its last readable message
+    time_t last;
+} member_t;
+
+// the files of one number
+typedef struct {
+    // the number, or the whole uri if it has none
+    char* key;
+    member_t* members;
+    size_t n;
+    off_t size;
+} group_t;
+
+static member_t* members;
+static size_t nmembers;
+static group_t* groups;
+static size_t ngroups;
+
+// the next group for a worker to take
+static size_t next_group;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct {
+    size_t records;
+    size_t bytes;
+    size_t corrupt;
+    size_t lost_bytes;
+    size_t unsorted;
+    size_t dups;
+    size_t merged;
+    size_t merged_into;
+    size_t renamed;
+    size_t rewritten;
+    size_t failed;
+} stats;
+
+
+// a message, its text in the group's text buffer
+typedef struct {
+    time_t t;
+    size_t seq;
+    size_t off;
+    size_t len;
+    bool me;
+} rec_t;
+
+// what a worker keeps between groups
+typedef struct {
+    rec_t* recs;
+    size_t n;
+    size_t max;
+    char* text;
+    size_t used;
+    size_t cap;
+} work_t;
+
+static int work_add(work_t* w, const hist_msg_t* m){
+    if(w->n == w->max){
+        size_t max = w->max ? 2 * w->max : 1024;
+        rec_t* recs = realloc(w->recs, max * sizeof(*recs));
+        if(!recs) return 1;
+        w->recs = recs;
+        w->max = max;
+    }
+    if(w->used + m->len > w->cap){
+        size_t cap = w->cap ? 2 * w->cap : 65536;
+        while(cap < w->used + m->len) cap *= 2;
+        char* text = realloc(w->text, cap);
+        if(!text) return 1;
+        w->text = text;
+        w->cap = cap;
+    }
+    memcpy(w->text + w->used, m->msg, m->len);
+    w->recs[w->n] = (rec_t){ .t = m->time, .seq = w->n, .off = w->used,
+                             .len = m->len, .me = m->me };
+    w->n++;
+    w->used += m->len;
+    return 0;
+}
+
+static int rec_cmp(const void* a, const void* b){
+    const rec_t *x = a, *y = b;
+    if(x->t != y->t) return x->t < y->t ? -1 : 1;
+    return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+static bool rec_same(const work_t* w, const rec_t* a, const rec_t* b){
+    return a->t == b->t && a->me == b->me && a->len == b->len
+           && memcmp(w->text + a->off, w->text + b->off, a->len) == 0;
+}
+
+// save the bytes of a file from off on, which couldn't be read
+static int save_lost(const member_t* mb, size_t off, size_t* saved){
+    char* buf = NULL;
+    int in = -1, out = -1;
+    int retval = -1;
+    *saved = 0;
+
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/voipms/lost+found", wc_dir);
+    mkdir(path, 0777);
+    snprintf(path, sizeof(path), "%s/voipms/lost+found/%s", wc_dir,
+             mb->fname);
+    in = openat(hdir_fd, mb->fname, O_RDONLY | O_CLOEXEC);
+    if(in < 0) FAIL(1);
+    out = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
+    if(out < 0) FAIL(2);
+    buf = malloc(65536);
+    if(!buf) FAIL(3);
+    ssize_t n;
+    while( (n = pread(in, buf, 65536, (off_t)off)) > 0 ){
+        if(write(out, buf, (size_t)n) != n) FAIL(4);
+        off += (size_t)n;
+        *saved += (size_t)n;
+    }
+    if(n < 0) FAIL(5);
+    retval = 0;
+
+fail:
+    if(buf) free(buf);
+    if(in >= 0) close(in);
+    if(out >= 0) close(out);
+    return retval;
+}
+
+// the filename the group is kept in from now on; NULL if out of memory
+static char* group_target(const group_t* g){
+    // the newest file with a sip uri, or else just the newest
+    const member_t* newest = &g->members[0];
+    const member_t* sip = NULL;
+    for(size_t i = 0; i < g->n; i++){
+        const member_t* mb = &g->members[i];
+        if(mb->last > newest->last) newest = mb;
+        if(mb->sip && (!sip || mb->last > sip->last)) sip = mb;
+    }
+    // and the name the user gave it (live messages go to the sip one)
+    const member_t* named = sip ? sip : newest;
+    const char* name = named->fname + named->uri_len + 2;
+    size_t len = strlen(name) + newest->uri_len + strlen(g->key) + 16;
+    if(sip) len += sip->uri_len;
+    if(realm) len += strlen(realm);
+    char* target = malloc(len);
+    if(!target) return NULL;
+    if(sip){
+        snprintf(target, len, "%.*s%s", (int)sip->uri_len + 2, sip->fname,
+                 name);
+    }else if(realm && isdigit((unsigned char)g->key[0])){
+        snprintf(target, len, "<sip:%s@%s>%s", g->key, realm, name);
+    }else{
+        snprintf(target, len, "%.*s%s", (int)newest->uri_len + 2,
+                 newest->fname, name);
+    }
+    return target;
+}
+
+// check (and fix) one group; returns nonzero if it couldn't be
+static int fsck_group(work_t* w, group_t* g){
+    char* target = NULL;
+    hist_reader_t* r = NULL;
+    hist_writer_t* hw = NULL;
+    size_t records = 0, corrupt = 0, lost = 0, unsorted = 0, dups = 0;
+    int retval = -1;
+    w->n = 0;
+    w->used = 0;
+
+    // read every file, up to anything unreadable
+    for(size_t i = 0; i < g->n; i++){
+        member_t* mb = &g->members[i];
+        if(hist_reader_open(wc_dir, shard, mb->fname, 0, &r)) FAIL(1);
+        hist_msg_t* m;
+        int ret;
+        time_t prev = 0;
+        bool in_order = true;
+        while( (ret = hist_reader_next(r, &m)) == 0 ){
+            if(m->time < prev) in_order = false;
+            prev = m->time;
+            if(m->time > mb->last) mb->last = m->time;
+            if(work_add(w, m)) FAIL(2);
+            records++;
+        }
+        size_t good = hist_reader_offset(r);
+        hist_reader_close(r);
+        r = NULL;
+        if(!in_order) unsorted++;
+        if(good < (size_t)mb->size){
+            printf("%s: unreadable from byte %zu of %lld\n", mb->fname, good,
+                   (long long)mb->size);
+            corrupt++;
+            size_t saved;
+            if(!dry_run && save_lost(mb, good, &saved)) FAIL(3);
+            lost += dry_run ? (size_t)mb->size - good : saved;
+        }
+    }
+
+    // in time order (ties in the order read), without exact repeats
+    qsort(w->recs, w->n, sizeof(*w->recs), rec_cmp);
+    size_t kept = 0, run = 0;
+    for(size_t i = 0; i < w->n; i++){
+        rec_t* rec = &w->recs[i];
+        if(kept && w->recs[kept - 1].t != rec->t) run = kept;
+        bool dup = false;
+        for(size_t j = run; j < kept && !dup; j++){
+            dup = rec_same(w, &w->recs[j], rec);
+        }
+        if(dup){
+            dups++;
+            continue;
+        }
+        w->recs[kept++] = *rec;
+    }
+
+    target = group_target(g);
+    if(!target) FAIL(4);
+    bool renamed = g->n == 1 && strcmp(target, g->members[0].fname) != 0;
+    if(g->n == 1 && !corrupt && !unsorted && !dups && !renamed){
+        retval = 0;
+        goto fail;
+    }
+    if(g->n > 1){
+        printf("%s: merging %zu files\n", target, g->n);
+    }else if(renamed){
+        printf("%s: renaming to %s\n", g->members[0].fname, target);
+    }
+    if(unsorted) printf("%s: out of order\n", target);
+    if(dups) printf("%s: %zu duplicates\n", target, dups);
+
+    if(!dry_run){
+        // the new file takes the old one's place all at once
+        if(hist_writer_open(wc_dir, shard, target, true, &hw)) FAIL(5);
+        for(size_t i = 0; i < kept; i++){
+            rec_t* rec = &w->recs[i];
+            if(hist_writer_add(hw, w->text + rec->off, rec->len, rec->me,
+                               rec->t)) FAIL(6);
+        }
+        int ret = hist_writer_close(hw);
+        hw = NULL;
+        if(ret) FAIL(7);
+        // then the rest go
+        for(size_t i = 0; i < g->n; i++){
+            if(strcmp(g->members[i].fname, target) == 0) continue;
+            if(unlinkat(hdir_fd, g->members[i].fname, 0) && errno != ENOENT){
+                FAIL(8);
+            }
+        }
+    }
+
+    pthread_mutex_lock(&lock);
+    if(g->n > 1){
+        stats.merged += g->n;
+        stats.merged_into++;
+    }
+    if(renamed) stats.renamed++;
+    stats.rewritten++;
+    pthread_mutex_unlock(&lock);
+    retval = 0;
+
+fail:
+    if(retval) printf("%s: unable to check or fix (%d)\n", g->members[0].fname,
+                      retval);
+    if(r) hist_reader_close(r);
+    if(hw) hist_writer_close(hw);
+    if(target) free(target);
+    pthread_mutex_lock(&lock);
+    stats.records += records;
+    stats.bytes += (size_t)g->size;
+    stats.corrupt += corrupt;
+    stats.lost_bytes += lost;
+    stats.unsorted += unsorted;
+    stats.dups += dups;
+    if(retval) stats.failed++;
+    pthread_mutex_unlock(&lock);
+    return retval;
+}
+
+static void* worker(void* arg){
+    (void)arg;
+    work_t w = {0};
+    while(true){
+        pthread_mutex_lock(&lock);
+        size_t i = next_group++;
+        pthread_mutex_unlock(&lock);
+        if(i >= ngroups) break;
+        fsck_group(&w, &groups[i]);
+    }
+    if(w.recs) free(w.recs);
+    if(w.text) free(w.text);
+    return NULL;
+}
+
+
+/* the number a uri is for: the 10 digits of a sip uri, or the digits of a
+   uri which is just a number (without the 1 of an 11-digit North American
+   one); otherwise the whole uri */
+static char* number_key(const char* uri, size_t len, bool* sip){
+    sip_uri_t* u = sip_uri_intern(uri, len);
+    if(!u) return NULL;
+    // (number is the whole uri if it isn't a sip uri with a number)
+    *sip = strcmp(u->number, u->str) != 0;
+    if(*sip) return strdup(u->number);
+    char digits[64];
+    size_t n = 0;
+    bool plain = len > 0;
+    for(size_t i = 0; i < len && plain; i++){
+        char c = uri[i];
+        if(isdigit((unsigned char)c)){
+            if(n < sizeof(digits) - 1) digits[n++] = c;
+        }else if(!strchr("+-(). ", c)){
+            plain = false;
+        }
+    }
+    if(!plain || !n) return strdup(u->str);
+    digits[n] = '\0';
+    if(n == 11 && digits[0] == '1') return strdup(digits + 1);
+    return strdup(digits);
+}
+
+static int member_cmp(const void* a, const void* b){
+    const member_t *x = a, *y = b;
+    return strcmp(x->fname, y->fname);
+}
+
+static int group_cmp(const void* a, const void* b){
+    // biggest first, so no thread is left with a big one at the end
+    const group_t *x = a, *y = b;
+    return (x->size < y->size) - (x->size > y->size);
+}
+
+// key of each member, in the same order as members
+static char** keys;
+
+static int key_cmp(const void* a, const void* b){
+    size_t x = *(const size_t*)a, y = *(const size_t*)b;
+    int c = strcmp(keys[x], keys[y]);
+    return c ? c : (x > y) - (x < y);
+}
+
+// list the history files, and group them by number
+static int load_groups(void){
+    DIR* dir = NULL;
+    size_t* order = NULL;
+    size_t max = 0;
+    int retval = -1;
+
+    int fd = dup(hdir_fd);
+    if(fd < 0) FAIL(1);
+    dir = fdopendir(fd);
+    if(!dir){
+        close(fd);
+        FAIL(1);
+    }
+    struct dirent* entry;
+    while( (entry = readdir(dir)) ){
+        size_t uri_len;
+        if(!hist_split_fname(entry->d_name, &uri_len)) continue;
+        struct stat st;
+        if(fstatat(hdir_fd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW)
+                || !S_ISREG(st.st_mode)) continue;
+        if(nmembers == max){
+            max = max ? 2 * max : 256;
+            member_t* m = realloc(members, max * sizeof(*m));
+            if(!m) FAIL(2);
+            members = m;
+        }
+        member_t* mb = &members[nmembers];
+        *mb = (member_t){ .fname = strdup(entry->d_name), .uri_len = uri_len,
+                          .size = st.st_size };
+        if(!mb->fname) FAIL(2);
+        nmembers++;
+    }
+    // (readdir order isn't the same from one run to the next)
+    qsort(members, nmembers, sizeof(*members), member_cmp);
+
+    keys = calloc(nmembers + 1, sizeof(*keys));
+    order = malloc((nmembers + 1) * sizeof(*order));
+    groups = calloc(nmembers + 1, sizeof(*groups));
+    if(!keys || !order || !groups) FAIL(2);
+    for(size_t i = 0; i < nmembers; i++){
+        keys[i] = number_key(members[i].fname + 1, members[i].uri_len,
+                             &members[i].sip);
+        if(!keys[i]) FAIL(2);
+        order[i] = i;
+    }
+    qsort(order, nmembers, sizeof(*order), key_cmp);
+
+    // members are copied into their groups, one after the other
+    member_t* sorted = malloc((nmembers + 1) * sizeof(*sorted));
+    if(!sorted) FAIL(2);
+    for(size_t i = 0; i < nmembers; i++){
+        sorted[i] = members[order[i]];
+        const char* key = keys[order[i]];
+        group_t* g = ngroups ? &groups[ngroups - 1] : NULL;
+        if(!g || strcmp(g->key, key) != 0){
+            g = &groups[ngroups++];
+            g->key = strdup(key);
+            if(!g->key){
+                free(sorted);
+                FAIL(2);
+            }
+            g->members = &sorted[i];
+        }
+        g->n++;
+        g->size += sorted[i].size;
+    }
+    free(members);
+    members = sorted;
+    // (groups point into members, which stays put from here on)
+    qsort(groups, ngroups, sizeof(*groups), group_cmp);
+    retval = 0;
+
+fail:
+    if(dir) closedir(dir);
+    if(order) free(order);
+    if(keys){
+        for(size_t i = 0; i < nmembers; i++) if(keys[i]) free(keys[i]);
+        free(keys);
+        keys = NULL;
+    }
+    return retval;
+}
+
+static void free_groups(void){
+    for(size_t i = 0; i < nmembers; i++) free(members[i].fname);
+    if(members) free(members);
+    for(size_t i = 0; i < ngroups; i++) free(groups[i].key);
+    if(groups) free(groups);
+}
+
+
+static void usage(void){
+    fprintf(stderr, "usage: fsck [-d weechat_dir] [-s shard] [-r realm] "
+            "[-j threads] [-n]\n");
+    exit(1);
+}
+
+int main(int argc, char** argv){
+    int retval = 1;
+    long nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    static char default_dir[4096];
+    snprintf(default_dir, sizeof(default_dir), "%s/.weechat",
+             getenv("HOME") ? getenv("HOME") : ".");
+    wc_dir = default_dir;
+
+    int opt;
+    while( (opt = getopt(argc, argv, "d:s:r:j:n")) != -1 ){
+        switch(opt){
+        case 'd': wc_dir = optarg; break;
+        case 's': shard = optarg; break;
+        case 'r': realm = optarg; break;
+        case 'j':
+            nthreads = strtol(optarg, NULL, 10);
+            if(nthreads < 1) usage();
+            break;
+        case 'n': dry_run = true; break;
+        default: usage();
+        }
+    }
+    if(optind != argc) usage();
+    if(nthreads < 1) nthreads = 1;
+    // (the sqlite backend keeps its own integrity)
+    hist_use_backend("files");
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/voipms/history%s%s", wc_dir,
+             shard && *shard ? "/" : "", shard && *shard ? shard : "");
+    hdir_fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(hdir_fd < 0){
+        perror(path);
+        return 1;
+    }
+    if(load_groups()){
+        fprintf(stderr, "fsck: unable to list the history in %s\n", path);
+        goto done;
+    }
+
+    if((size_t)nthreads > ngroups) nthreads = ngroups ? (long)ngroups : 1;
+    pthread_t* threads = calloc(nthreads, sizeof(*threads));
+    if(!threads){
+        perror("calloc");
+        goto done;
+    }
+    long started = 0;
+    for(; started < nthreads; started++){
+        if(pthread_create(&threads[started], NULL, worker, NULL)) break;
+    }
+    // at worst, do it all here
+    if(!started) worker(NULL);
+    for(long i = 0; i < started; i++) pthread_join(threads[i], NULL);
+    free(threads);
+
+    // the manifest is out of date now; rebuild it, so restores are quick
+    if(!dry_run && stats.rewritten){
+        unlinkat(hdir_fd, ".manifest", 0);
+        hist_buf_t* hist = NULL;
+        if(list_hist_bufs(wc_dir, shard, &hist) == 0) free_hist_buf(hist);
+        else fprintf(stderr, "fsck: unable to rebuild the manifest\n");
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    if(secs <= 0) secs = 1e-9;
+    printf("%zu files (%zu numbers), %zu records in %.1f MB: %zu with "
+           "unreadable records (%zu bytes %s lost+found), %zu out of order, "
+           "%zu duplicates; %zu merged into %zu, %zu renamed, %zu %s, "
+           "%zu failed\n", nmembers, ngroups, stats.records,
+           stats.bytes / 1e6, stats.corrupt, stats.lost_bytes,
+           dry_run ? "would go to" : "saved to", stats.unsorted, stats.dups,
+           stats.merged, stats.merged_into, stats.renamed, stats.rewritten,
+           dry_run ? "to rewrite" : "rewritten", stats.failed);
+    printf("%ld threads, %.2fs: %.1f MB/s, %.0f files/s\n", started ? started
+           : 1, secs, stats.bytes / 1e6 / secs, nmembers / secs);
+    retval = stats.failed ? 2 : 0;
+
+done:
+    free_groups();
+    if(hdir_fd >= 0) close(hdir_fd);
+    sip_uri_free_all();
+    hist_close();
+    return retval;
+}
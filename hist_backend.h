@@ -0,0 +1,49 @@
+#ifndef HIST_BACKEND_H
+#define HIST_BACKEND_H
+
+#include "history.h"
+
+/* a history storage engine.  history.c forwards the public hist_* functions
+   to whichever one is in use; see history.h for what each of them does.
+   Offsets (hist_msg_t.end, hist_pos_t, reader offsets) mean whatever the
+   backend likes, as long as they grow as messages are appended */
+typedef struct {
+    const char* name;
+    int (*list)(const char* wc_dir, const char* shard, hist_buf_t **out);
+    int (*get)(const char* wc_dir, const char* shard, const char* fname,
+               hist_msg_t **out);
+    int (*range)(const char* wc_dir, const char* shard, const char* fname,
+                 time_t since, time_t until, hist_msg_t **out);
+    int (*add)(const char* wc_dir, const char* shard, const char* fname,
+               const char* msg, size_t msg_len, bool me, time_t t,
+               hist_pos_t *pos);
+    int (*rename)(const char* wc_dir, const char* shard, const char* fname);
+    int (*begin)(const char* wc_dir, const char* shard);
+    int (*commit)(const char* wc_dir, const char* shard);
+    /* an offset to read fname from so that its first message is the first
+       one at or after since (the history is in time order); 0 will do */
+    int (*seek)(const char* wc_dir, const char* shard, const char* fname,
+                time_t since, size_t *offset);
+    int (*reader_open)(const char* wc_dir, const char* shard,
+                       const char* fname, size_t offset, void **out);
+    int (*reader_next)(void *r, hist_msg_t **out);
+    size_t (*reader_offset)(const void *r);
+    void (*reader_close)(void *r);
+    int (*writer_open)(const char* wc_dir, const char* shard,
+                       const char* fname, bool replace, void **out);
+    int (*writer_add)(void *w, const char* msg, size_t msg_len, bool me,
+                      time_t t);
+    int (*writer_close)(void *w);
+    // release anything kept open between calls
+    void (*close)(void);
+} hist_backend_t;
+
+// a hist_buf_t for "<sip_uri>name" (see hist_split_fname()), or NULL
+hist_buf_t *hist_buf_new(const char *fname, size_t uri_len);
+
+// one file per conversation (history.c)
+extern const hist_backend_t hist_files_backend;
+// one SQLite database per shard (hist_sqlite.c)
+extern const hist_backend_t hist_sqlite_backend;
+
+#endif // HIST_BACKEND_H
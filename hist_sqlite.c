@@ -0,0 +1,622 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <sqlite3.h>
+
+#include "history.h"
+#include "hist_backend.h"
+
+/* the SQLite backend keeps each shard in one database,
+   .weechat/voipms/history[/<shard>]/history.db, with a row per conversation
+   and a row per message.  Messages are indexed by (conversation, time), and
+   a message's offset is its rowid */
+
+#define DB_NAME "history.db"
+
+#define FAIL(n) { retval = n; goto fail; }
+
+static const char schema[] =
+    "PRAGMA journal_mode=WAL;"
+    "PRAGMA synchronous=NORMAL;"
+    "CREATE TABLE IF NOT EXISTS conv("
+    "    id INTEGER PRIMARY KEY,"
+    "    sip_uri TEXT NOT NULL UNIQUE,"
+    "    name TEXT NOT NULL,"
+    "    count INTEGER NOT NULL DEFAULT 0,"
+    "    last INTEGER NOT NULL DEFAULT 0,"
+    "    offset INTEGER NOT NULL DEFAULT 0);"
+    "CREATE TABLE IF NOT EXISTS msg("
+    "    id INTEGER PRIMARY KEY,"
+    "    conv INTEGER NOT NULL REFERENCES conv(id),"
+    "    time INTEGER NOT NULL,"
+    "    me INTEGER NOT NULL,"
+    "    body BLOB NOT NULL);"
+    "CREATE INDEX IF NOT EXISTS msg_conv_time ON msg(conv, time);";
+
+// the statements every call uses are prepared once per database
+enum {
+    ST_UPSERT,
+    ST_INSERT,
+    ST_BUMP,
+    ST_LIST,
+    ST_FIND,
+    ST_RANGE,
+    ST_SEEK,
+    ST_RENAME,
+    NSTMTS
+};
+
+static const char* stmt_sql[NSTMTS] = {
+    [ST_UPSERT] = "INSERT INTO conv(sip_uri, name) VALUES(?1, ?2) "
+                  "ON CONFLICT(sip_uri) DO UPDATE SET name = excluded.name "
+                  "RETURNING id",
+    [ST_INSERT] = "INSERT INTO msg(conv, time, me, body) VALUES(?1, ?2, ?3, ?4)",
+    [ST_BUMP] = "UPDATE conv SET count = count + 1, last = max(last, ?2), "
+                "offset = ?3 WHERE id = ?1",
+    [ST_LIST] = "SELECT '<' || sip_uri || '>' || name, length(sip_uri), "
+                "count, last, offset FROM conv ORDER BY last DESC",
+    [ST_FIND] = "SELECT id, offset FROM conv WHERE sip_uri = ?1 AND name = ?2",
+    [ST_RANGE] = "SELECT time, me, body, id FROM msg "
+                 "WHERE conv = ?1 AND time >= ?2 AND time < ?3 "
+                 "ORDER BY time, id",
+    [ST_SEEK] = "SELECT min(id) FROM msg WHERE conv = ?1 AND time >= ?2",
+    [ST_RENAME] = "UPDATE conv SET name = ?2 WHERE sip_uri = ?1",
+};
+
+// an open database, for one wc_dir and shard
+typedef struct hist_db_t {
+    char* path;
+    sqlite3* db;
+    sqlite3_stmt* stmts[NSTMTS];
+    struct hist_db_t* next;
+} hist_db_t;
+
+static hist_db_t* dbs = NULL;
+
+static void db_free(hist_db_t* d){
+    for(size_t i = 0; i < NSTMTS; i++){
+        if(d->stmts[i]) sqlite3_finalize(d->stmts[i]);
+    }
+    if(d->db) sqlite3_close(d->db);
+    if(d->path) free(d->path);
+    free(d);
+}
+
+// the path of the database, making its directories as needed
+static char* db_path(const char* wc_dir, const char* shard){
+    // the shard must be a single path component
+    if(shard && *shard){
+        if(strchr(shard, '/') || strcmp(shard, ".") == 0
+                || strcmp(shard, "..") == 0){
+            errno = EINVAL;
+            return NULL;
+        }
+    }else{
+        shard = NULL;
+    }
+    size_t len = strlen(wc_dir) + (shard ? strlen(shard) : 0) + 64;
+    char* path = malloc(len);
+    if(!path) return NULL;
+    // attempt to make each directory, ignoring errors
+    snprintf(path, len, "%s/voipms", wc_dir);
+    mkdir(path, 0777);
+    snprintf(path, len, "%s/voipms/history", wc_dir);
+    mkdir(path, 0777);
+    if(shard){
+        snprintf(path, len, "%s/voipms/history/%s", wc_dir, shard);
+        mkdir(path, 0777);
+        snprintf(path, len, "%s/voipms/history/%s/" DB_NAME, wc_dir, shard);
+    }else{
+        snprintf(path, len, "%s/voipms/history/" DB_NAME, wc_dir);
+    }
+    errno = 0;
+    return path;
+}
+
+// get the (cached) database for a shard, opening it the first time
+static hist_db_t* db_get(const char* wc_dir, const char* shard){
+    char* path = db_path(wc_dir, shard);
+    if(!path) return NULL;
+    for(hist_db_t* d = dbs; d; d = d->next){
+        if(strcmp(d->path, path) == 0){
+            free(path);
+            return d;
+        }
+    }
+
+    hist_db_t* d = calloc(1, sizeof(*d));
+    if(!d){
+        free(path);
+        return NULL;
+    }
+    d->path = path;
+    if(sqlite3_open_v2(path, &d->db, SQLITE_OPEN_READWRITE
+                       | SQLITE_OPEN_CREATE, NULL) != SQLITE_OK) goto fail;
+    // other programs may be reading the archive
+    sqlite3_busy_timeout(d->db, 1000);
+    if(sqlite3_exec(d->db, schema, NULL, NULL, NULL) != SQLITE_OK) goto fail;
+    for(size_t i = 0; i < NSTMTS; i++){
+        if(sqlite3_prepare_v3(d->db, stmt_sql[i], -1, SQLITE_PREPARE_PERSISTENT,
+                              &d->stmts[i], NULL) != SQLITE_OK) goto fail;
+    }
+    d->next = dbs;
+    dbs = d;
+    return d;
+
+fail:
+    db_free(d);
+    return NULL;
+}
+
+// get a statement, ready to be bound and stepped
+static sqlite3_stmt* db_stmt(hist_db_t* d, int which){
+    sqlite3_stmt* st = d->stmts[which];
+    sqlite3_reset(st);
+    sqlite3_clear_bindings(st);
+    return st;
+}
+
+// split "<sip_uri>name" and find the conversation; returns 0 if found
+static int find_conv(hist_db_t* d, const char* fname, sqlite3_int64 *id,
+                     sqlite3_int64 *offset){
+    size_t uri_len;
+    if(!hist_split_fname(fname, &uri_len)) return 1;
+    sqlite3_stmt* st = db_stmt(d, ST_FIND);
+    sqlite3_bind_text(st, 1, fname + 1, (int)uri_len, SQLITE_STATIC);
+    sqlite3_bind_text(st, 2, fname + uri_len + 2, -1, SQLITE_STATIC);
+    int ret = sqlite3_step(st);
+    if(ret == SQLITE_ROW){
+        *id = sqlite3_column_int64(st, 0);
+        if(offset) *offset = sqlite3_column_int64(st, 1);
+    }
+    sqlite3_reset(st);
+    return ret == SQLITE_ROW ? 0 : 1;
+}
+
+// copy a (time, me, body, id) row into a new hist_msg_t
+static hist_msg_t* row_to_msg(sqlite3_stmt* st){
+    hist_msg_t* msg = malloc(sizeof(*msg));
+    if(!msg) return NULL;
+    size_t len = (size_t)sqlite3_column_bytes(st, 2);
+    *msg = (hist_msg_t){
+        .time = (time_t)sqlite3_column_int64(st, 0),
+        .me = sqlite3_column_int(st, 1) != 0,
+        .len = len,
+        .end = (size_t)sqlite3_column_int64(st, 3),
+    };
+    msg->msg = malloc(len + 1);
+    if(!msg->msg){
+        free(msg);
+        return NULL;
+    }
+    if(len) memcpy(msg->msg, sqlite3_column_blob(st, 2), len);
+    msg->msg[len] = '\0';
+    return msg;
+}
+
+static int sqlite_list(const char* wc_dir, const char* shard, hist_buf_t **out){
+    hist_buf_t *hist = NULL;
+    hist_buf_t **out_end = out;
+    int retval = -1;
+    *out = NULL;
+
+    hist_db_t* d = db_get(wc_dir, shard);
+    if(!d) FAIL(4);
+
+    sqlite3_stmt* st = db_stmt(d, ST_LIST);
+    int ret;
+    while( (ret = sqlite3_step(st)) == SQLITE_ROW ){
+        const char* fname = (const char*)sqlite3_column_text(st, 0);
+        hist = hist_buf_new(fname, (size_t)sqlite3_column_int64(st, 1));
+        if(!hist) FAIL(6);
+        hist->count = (size_t)sqlite3_column_int64(st, 2);
+        hist->last = (time_t)sqlite3_column_int64(st, 3);
+        hist->offset = (size_t)sqlite3_column_int64(st, 4);
+
+        *out_end = hist;
+        out_end = &hist->next;
+        hist = NULL;
+    }
+    if(ret != SQLITE_DONE) FAIL(5);
+
+    retval = 0;
+
+fail:
+    if(d) sqlite3_reset(d->stmts[ST_LIST]);
+    free_hist_buf(hist);
+    if(retval){
+        free_hist_buf(*out);
+        *out = NULL;
+    }
+    return retval;
+}
+
+static int sqlite_range(const char* wc_dir, const char* shard,
+                        const char* fname, time_t since, time_t until,
+                        hist_msg_t **out){
+    hist_msg_t **out_end = out;
+    int retval = -1;
+    *out = NULL;
+
+    hist_db_t* d = db_get(wc_dir, shard);
+    if(!d) FAIL(3);
+
+    sqlite3_int64 id;
+    if(find_conv(d, fname, &id, NULL)) FAIL(4);
+
+    sqlite3_stmt* st = db_stmt(d, ST_RANGE);
+    sqlite3_bind_int64(st, 1, id);
+    sqlite3_bind_int64(st, 2, since);
+    sqlite3_bind_int64(st, 3, until);
+    int ret;
+    while( (ret = sqlite3_step(st)) == SQLITE_ROW ){
+        hist_msg_t* msg = row_to_msg(st);
+        if(!msg) FAIL(13);
+        *out_end = msg;
+        out_end = &msg->next;
+    }
+    if(ret != SQLITE_DONE) FAIL(6);
+
+    retval = 0;
+
+fail:
+    if(d) sqlite3_reset(d->stmts[ST_RANGE]);
+    if(retval){
+        free_hist_msg(*out);
+        *out = NULL;
+    }
+    return retval;
+}
+
+static int sqlite_get(const char* wc_dir, const char* shard, const char* fname,
+                      hist_msg_t **out){
+    // time_t is 64 bits, but sqlite's integers are signed
+    return sqlite_range(wc_dir, shard, fname, 0, (time_t)INT64_MAX, out);
+}
+
+// (msg_conv_time finds the first message since, however long the history)
+static int sqlite_seek(const char* wc_dir, const char* shard,
+                       const char* fname, time_t since, size_t *offset){
+    int retval = -1;
+    *offset = 0;
+
+    hist_db_t* d = db_get(wc_dir, shard);
+    if(!d) FAIL(3);
+
+    sqlite3_int64 id, limit;
+    if(find_conv(d, fname, &id, &limit)) FAIL(4);
+
+    sqlite3_stmt* st = db_stmt(d, ST_SEEK);
+    sqlite3_bind_int64(st, 1, id);
+    sqlite3_bind_int64(st, 2, since);
+    if(sqlite3_step(st) != SQLITE_ROW) FAIL(6);
+    // readers start after the offset; nothing since means nothing to read
+    if(sqlite3_column_type(st, 0) == SQLITE_NULL) *offset = (size_t)limit;
+    else *offset = (size_t)(sqlite3_column_int64(st, 0) - 1);
+
+    retval = 0;
+
+fail:
+    if(d) sqlite3_reset(d->stmts[ST_SEEK]);
+    return retval;
+}
+
+static int sqlite_begin(const char* wc_dir, const char* shard){
+    hist_db_t* d = db_get(wc_dir, shard);
+    if(!d) return 1;
+    return sqlite3_exec(d->db, "BEGIN IMMEDIATE", NULL, NULL, NULL) != SQLITE_OK;
+}
+
+static int sqlite_commit(const char* wc_dir, const char* shard){
+    hist_db_t* d = db_get(wc_dir, shard);
+    if(!d) return 1;
+    return sqlite3_exec(d->db, "COMMIT", NULL, NULL, NULL) != SQLITE_OK;
+}
+
+static int sqlite_add(const char* wc_dir, const char* shard,
+                      const char* fname, const char* msg, size_t msg_len,
+                      bool me, time_t t, hist_pos_t *pos){
+    bool own_txn = false;
+    int retval = -1;
+
+    hist_db_t* d = db_get(wc_dir, shard);
+    if(!d) FAIL(2);
+
+    // outside of hist_begin(), each message is its own transaction
+    if(sqlite3_get_autocommit(d->db)){
+        if(sqlite3_exec(d->db, "BEGIN IMMEDIATE", NULL, NULL, NULL)
+                != SQLITE_OK) FAIL(3);
+        own_txn = true;
+    }
+
+    // find (or create, or rename) the conversation
+    size_t uri_len;
+    if(!hist_split_fname(fname, &uri_len)) FAIL(1);
+    sqlite3_stmt* st = db_stmt(d, ST_UPSERT);
+    sqlite3_bind_text(st, 1, fname + 1, (int)uri_len, SQLITE_STATIC);
+    sqlite3_bind_text(st, 2, fname + uri_len + 2, -1, SQLITE_STATIC);
+    if(sqlite3_step(st) != SQLITE_ROW) FAIL(4);
+    sqlite3_int64 id = sqlite3_column_int64(st, 0);
+    // finish the statement, so the upsert takes effect
+    if(sqlite3_step(st) != SQLITE_DONE) FAIL(4);
+
+    st = db_stmt(d, ST_INSERT);
+    sqlite3_bind_int64(st, 1, id);
+    sqlite3_bind_int64(st, 2, t);
+    sqlite3_bind_int(st, 3, me);
+    sqlite3_bind_blob(st, 4, msg, (int)msg_len, SQLITE_STATIC);
+    if(sqlite3_step(st) != SQLITE_DONE) FAIL(6);
+    sqlite3_int64 rowid = sqlite3_last_insert_rowid(d->db);
+
+    st = db_stmt(d, ST_BUMP);
+    sqlite3_bind_int64(st, 1, id);
+    sqlite3_bind_int64(st, 2, t);
+    sqlite3_bind_int64(st, 3, rowid);
+    if(sqlite3_step(st) != SQLITE_DONE) FAIL(7);
+
+    if(own_txn){
+        own_txn = false;
+        if(sqlite3_exec(d->db, "COMMIT", NULL, NULL, NULL) != SQLITE_OK){
+            FAIL(8);
+        }
+    }
+
+    if(pos){
+        pos->end = (size_t)rowid;
+        pos->start = pos->end - 1;
+    }
+
+    retval = 0;
+
+fail:
+    if(d){
+        for(size_t i = 0; i < NSTMTS; i++) sqlite3_reset(d->stmts[i]);
+        if(own_txn) sqlite3_exec(d->db, "ROLLBACK", NULL, NULL, NULL);
+    }
+    return retval;
+}
+
+static int sqlite_rename(const char* wc_dir, const char* shard,
+                         const char* fname){
+    size_t uri_len;
+    if(!hist_split_fname(fname, &uri_len)) return 1;
+    hist_db_t* d = db_get(wc_dir, shard);
+    if(!d) return 2;
+    sqlite3_stmt* st = db_stmt(d, ST_RENAME);
+    sqlite3_bind_text(st, 1, fname + 1, (int)uri_len, SQLITE_STATIC);
+    sqlite3_bind_text(st, 2, fname + uri_len + 2, -1, SQLITE_STATIC);
+    int ret = sqlite3_step(st);
+    sqlite3_reset(st);
+    return ret == SQLITE_DONE ? 0 : 3;
+}
+
+
+// a reader walks one conversation in rowid (append) order
+typedef struct {
+    sqlite3_stmt* st;
+    size_t offset;
+    // the last message returned
+    hist_msg_t msg;
+} sqlite_reader_t;
+
+static void sqlite_reader_close(void *rp){
+    sqlite_reader_t *r = rp;
+    if(!r) return;
+    if(r->st) sqlite3_finalize(r->st);
+    free(r);
+}
+
+static int sqlite_reader_open(const char* wc_dir, const char* shard,
+                              const char* fname, size_t offset, void **out){
+    sqlite_reader_t *r = NULL;
+    int retval = -1;
+    *out = NULL;
+
+    hist_db_t* d = db_get(wc_dir, shard);
+    if(!d) FAIL(3);
+
+    // only read what is there now, like the files backend
+    sqlite3_int64 id, limit;
+    if(find_conv(d, fname, &id, &limit)) FAIL(4);
+
+    r = calloc(1, sizeof(*r));
+    if(!r) FAIL(5);
+    r->offset = offset;
+    // readers live alongside each other, so each gets its own statement
+    if(sqlite3_prepare_v2(d->db, "SELECT time, me, body, id FROM msg "
+                          "WHERE conv = ?1 AND id > ?2 AND id <= ?3 "
+                          "ORDER BY id", -1, &r->st, NULL) != SQLITE_OK){
+        FAIL(6);
+    }
+    sqlite3_bind_int64(r->st, 1, id);
+    sqlite3_bind_int64(r->st, 2, (sqlite3_int64)offset);
+    sqlite3_bind_int64(r->st, 3, limit);
+
+    *out = r;
+    r = NULL;
+    retval = 0;
+
+fail:
+    sqlite_reader_close(r);
+    return retval;
+}
+
+static int sqlite_reader_next(void *rp, hist_msg_t **out){
+    sqlite_reader_t *r = rp;
+    *out = NULL;
+    int ret = sqlite3_step(r->st);
+    if(ret == SQLITE_DONE) return 1;
+    if(ret != SQLITE_ROW) return 6;
+    /* the text belongs to the statement until the next step; asking for it
+       as text null-terminates it, and has to come before its length */
+    char* text = (char*)sqlite3_column_text(r->st, 2);
+    r->msg = (hist_msg_t){
+        .time = (time_t)sqlite3_column_int64(r->st, 0),
+        .me = sqlite3_column_int(r->st, 1) != 0,
+        .msg = text ? text : "",
+        .len = (size_t)sqlite3_column_bytes(r->st, 2),
+        .end = (size_t)sqlite3_column_int64(r->st, 3),
+    };
+    r->offset = r->msg.end;
+    *out = &r->msg;
+    return 0;
+}
+
+static size_t sqlite_reader_offset(const void *rp){
+    const sqlite_reader_t *r = rp;
+    return r->offset;
+}
+
+/* a writer inserts rows as they come.  A replacement deletes the rows that
+   were there before when it is closed, so the conversation's rowids end up
+   in the order they were written in */
+typedef struct {
+    hist_db_t* d;
+    sqlite3_int64 conv;
+    // the last rowid from before a replacement, or -1 when appending
+    sqlite3_int64 old_limit;
+    bool own_txn;
+    bool failed;
+} sqlite_writer_t;
+
+static int sqlite_writer_open(const char* wc_dir, const char* shard,
+                              const char* fname, bool replace, void **out){
+    sqlite_writer_t *w = NULL;
+    int retval = -1;
+    *out = NULL;
+
+    size_t uri_len;
+    if(!hist_split_fname(fname, &uri_len)) FAIL(1);
+    w = calloc(1, sizeof(*w));
+    if(!w) FAIL(2);
+    w->d = db_get(wc_dir, shard);
+    if(!w->d) FAIL(3);
+
+    // without a hist_begin(), the writer is one transaction
+    if(sqlite3_get_autocommit(w->d->db)){
+        if(sqlite3_exec(w->d->db, "BEGIN IMMEDIATE", NULL, NULL, NULL)
+                != SQLITE_OK) FAIL(4);
+        w->own_txn = true;
+    }
+
+    // find (or create, or rename) the conversation
+    sqlite3_stmt* st = db_stmt(w->d, ST_UPSERT);
+    sqlite3_bind_text(st, 1, fname + 1, (int)uri_len, SQLITE_STATIC);
+    sqlite3_bind_text(st, 2, fname + uri_len + 2, -1, SQLITE_STATIC);
+    if(sqlite3_step(st) != SQLITE_ROW) FAIL(5);
+    w->conv = sqlite3_column_int64(st, 0);
+    if(sqlite3_step(st) != SQLITE_DONE) FAIL(5);
+    sqlite3_reset(st);
+
+    w->old_limit = -1;
+    if(replace && find_conv(w->d, fname, &w->conv, &w->old_limit)) FAIL(6);
+
+    *out = w;
+    w = NULL;
+    retval = 0;
+
+fail:
+    if(w){
+        if(w->d) sqlite3_reset(w->d->stmts[ST_UPSERT]);
+        if(w->own_txn) sqlite3_exec(w->d->db, "ROLLBACK", NULL, NULL, NULL);
+        free(w);
+    }
+    return retval;
+}
+
+static int sqlite_writer_add(void *wp, const char* msg, size_t msg_len,
+                             bool me, time_t t){
+    sqlite_writer_t *w = wp;
+    int retval = -1;
+
+    sqlite3_stmt* st = db_stmt(w->d, ST_INSERT);
+    sqlite3_bind_int64(st, 1, w->conv);
+    sqlite3_bind_int64(st, 2, t);
+    sqlite3_bind_int(st, 3, me);
+    sqlite3_bind_blob(st, 4, msg, (int)msg_len, SQLITE_STATIC);
+    if(sqlite3_step(st) != SQLITE_DONE) FAIL(6);
+
+    st = db_stmt(w->d, ST_BUMP);
+    sqlite3_bind_int64(st, 1, w->conv);
+    sqlite3_bind_int64(st, 2, t);
+    sqlite3_bind_int64(st, 3, sqlite3_last_insert_rowid(w->d->db));
+    if(sqlite3_step(st) != SQLITE_DONE) FAIL(7);
+
+    retval = 0;
+
+fail:
+    sqlite3_reset(w->d->stmts[ST_INSERT]);
+    sqlite3_reset(w->d->stmts[ST_BUMP]);
+    if(retval) w->failed = true;
+    return retval;
+}
+
+static int sqlite_writer_close(void *wp){
+    sqlite_writer_t *w = wp;
+    int retval = -1;
+
+    if(w->old_limit >= 0){
+        // on failure drop what was written, otherwise what was there before
+        char sql[512];
+        snprintf(sql, sizeof(sql),
+                 "DELETE FROM msg WHERE conv = %lld AND id %s %lld;"
+                 "UPDATE conv SET "
+                 "count = (SELECT count(*) FROM msg WHERE conv = %lld), "
+                 "last = (SELECT coalesce(max(time), 0) FROM msg "
+                 "WHERE conv = %lld) WHERE id = %lld",
+                 (long long)w->conv, w->failed ? ">" : "<=",
+                 (long long)w->old_limit, (long long)w->conv,
+                 (long long)w->conv, (long long)w->conv);
+        if(sqlite3_exec(w->d->db, sql, NULL, NULL, NULL) != SQLITE_OK){
+            FAIL(8);
+        }
+    }
+    if(w->failed) FAIL(9);
+    if(w->own_txn){
+        w->own_txn = false;
+        if(sqlite3_exec(w->d->db, "COMMIT", NULL, NULL, NULL) != SQLITE_OK){
+            FAIL(10);
+        }
+    }
+
+    retval = 0;
+
+fail:
+    if(w->own_txn) sqlite3_exec(w->d->db, "ROLLBACK", NULL, NULL, NULL);
+    free(w);
+    return retval;
+}
+
+static void sqlite_close(void){
+    hist_db_t *d, *next = dbs;
+    while( (d = next) ){
+        next = d->next;
+        db_free(d);
+    }
+    dbs = NULL;
+}
+
+const hist_backend_t hist_sqlite_backend = {
+    .name = "sqlite",
+    .list = sqlite_list,
+    .get = sqlite_get,
+    .range = sqlite_range,
+    .add = sqlite_add,
+    .rename = sqlite_rename,
+    .begin = sqlite_begin,
+    .commit = sqlite_commit,
+    .seek = sqlite_seek,
+    .reader_open = sqlite_reader_open,
+    .reader_next = sqlite_reader_next,
+    .reader_offset = sqlite_reader_offset,
+    .reader_close = sqlite_reader_close,
+    .writer_open = sqlite_writer_open,
+    .writer_add = sqlite_writer_add,
+    .writer_close = sqlite_writer_close,
+    .close = sqlite_close,
+};
@@ -3,14 +3,15 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <dirent.h>
-#include <regex.h>
 #include <string.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <errno.h>
 #include <time.h>
+#include <stdint.h>
 
 #include "history.h"
+#include "hist_backend.h"
 
 #define OPENDIR_FLAGS O_RDONLY | O_DIRECTORY | O_CLOEXEC
 #define OPEN_RD_FLAGS O_RDONLY | O_CLOEXEC
@@ -21,9 +22,8 @@
 void free_hist_buf(hist_buf_t *hist){
     hist_buf_t *p, *next = hist;
     while( (p = next) ){
+        // sip_uri and name live in the same allocation as filename
         if(p->filename) free(p->filename);
-        if(p->sip_uri) free(p->sip_uri);
-        if(p->name) free(p->name);
         next = p->next;
         free(p);
     }
@@ -42,8 +42,10 @@ void free_hist_msg(hist_msg_t *msg){
 
 
 /* returns a file descriptor at hdir_fd if hdir_fd is not NULL,
-   otherwise returns a DIR* at hdir */
-static int open_hist_dir(const char* wc_dir, int *hdir_fd, DIR **hdir){
+   otherwise returns a DIR* at hdir.  If shard is not NULL or empty, the
+   history directory is .weechat/voipms/history/<shard> instead */
+static int open_hist_dir(const char* wc_dir, const char* shard,
+                         int *hdir_fd, DIR **hdir){
     // .weechat directory (file descriptor)
     int wdir_fd = -1;
     // .weechat/voipms directory (file descriptor)
@@ -73,14 +75,32 @@ static int open_hist_dir(const char* wc_dir, int *hdir_fd, DIR **hdir){
 
     // open the history directory
     hdir_fd_temp = openat(vdir_fd, "history", OPENDIR_FLAGS);
-    if(hdir_fd < 0) FAIL(3);
+    if(hdir_fd_temp < 0) FAIL(3);
+
+    // descend into the per-account shard
+    if(shard && *shard){
+        // the shard must be a single path component
+        if(strchr(shard, '/') || strcmp(shard, ".") == 0
+                || strcmp(shard, "..") == 0){
+            errno = EINVAL;
+            FAIL(4);
+        }
+        // attempt to make the directory, ignoring errors
+        mkdirat(hdir_fd_temp, shard, 0777);
+        errno = 0;
+
+        int sdir_fd = openat(hdir_fd_temp, shard, OPENDIR_FLAGS);
+        if(sdir_fd < 0) FAIL(5);
+        close(hdir_fd_temp);
+        hdir_fd_temp = sdir_fd;
+    }
 
     // if hdir is not NULL, make a DIR* out of the hdir_fd
     if(hdir_fd){
         *hdir_fd = hdir_fd_temp;
     }else{
         *hdir = fdopendir(hdir_fd_temp);
-        if(!*hdir) FAIL(4);
+        if(!*hdir) FAIL(6);
         // don't use hdir_fd_temp anymore
         hdir_fd_temp = -1;
     }
@@ -96,295 +116,1793 @@ fail:
 }
 
 
-// get a linked list of all the available buffer history files
-int list_hist_bufs(const char* wc_dir, hist_buf_t **out){
-    // history directory
-    DIR* hdir = NULL;
-    // a temporary history entry
-    hist_buf_t *hist = NULL;
-    // regex for pattern matching
-    regex_t reg;
-    bool regex_allocated = false;
-    // return values
-    int retval = -1; // indicate error if we return early
-    *out = NULL;
+// read an entire file into memory; *mem must be freed by the caller
+static int read_whole_fd(int fd, char **mem_out, size_t *mlen_out){
+    char *mem = NULL;
+    int retval = -1;
 
-    int ret = open_hist_dir(wc_dir, NULL, &hdir);
-    if(ret) FAIL(4);
+    // read the entire file into memory, sized for the whole file up front
+    size_t msize = 8192;
+    struct stat st;
+    if(fstat(fd, &st) == 0 && (size_t)st.st_size + 4096 > msize){
+        msize = (size_t)st.st_size + 4096;
+    }
+    mem = malloc(msize);
+    size_t mlen = 0;
+    if(!mem) FAIL(5);
 
-    // prepare the regex for pattern matching
-    ret = regcomp(&reg, "^<(.+)>(.+)", REG_EXTENDED);
-    if(ret) FAIL(5);
-    regex_allocated = true;
+    // read until end of file
+    ssize_t amnt_read;
+    while( (amnt_read = read(fd, mem + mlen, msize - mlen)) ){
+        // check for error
+        if(amnt_read < 0) FAIL(6);
+        // add to length
+        mlen += (size_t)amnt_read;
+        // check if we need to reallocate before next read
+        if(msize - mlen < 4096){
+            msize *= 2;
+            char *new = realloc(mem, msize);
+            if(!new) FAIL(7);
+            mem = new;
+        }
+    }
 
-    struct dirent* entry;
-    // end of the *out linked list
-    hist_buf_t **out_end = out;
+    *mem_out = mem;
+    *mlen_out = mlen;
+    mem = NULL;
+    retval = 0;
 
-    while( (entry = readdir(hdir)) ){
-        // skip directories
-        if(entry->d_type == DT_DIR) continue;
+fail:
+    if(mem) free(mem);
+    return retval;
+}
 
-        // skip invalid filenames
-        regmatch_t match[3];
-        size_t nmatch = sizeof(match) / sizeof(*match);
-        ret = regexec(&reg, entry->d_name, nmatch, match, 0);
-        if(ret == REG_NOMATCH) continue;
 
-        // allocate a new hist_buf_t entry
-        hist_buf_t *hist = malloc(sizeof(*hist));
-        if(!hist) FAIL(6);
+/* Record headers are parsed in two steps: first find the three colons (making
+   sure there is nothing but digits before them), then convert the digits
+   between them.  The scan has SSE2 and AVX2 versions, one of which is picked
+   at load time based on what the cpu supports. */
 
-        // init the hist_buf_t
-        *hist = (hist_buf_t){0};
+// find the header's colons; returns 0, 8 (bad character) or 9 (no 3 colons)
+typedef int (*hdr_scan_fn)(const char *c, size_t avail, size_t colons[3]);
 
-        // duplicate the filename
-        hist->filename = strdup(entry->d_name);
-        if(!hist->filename) FAIL(7);
+// scan byte-by-byte from i, with semis colons found already
+static int scan_hdr_tail(const char *c, size_t avail, size_t i, int semis,
+                         size_t colons[3]){
+    for(; i < avail; i++){
+        if(c[i] >= '0' && c[i] <= '9') continue;
+        if(c[i] == ':'){
+            colons[semis] = i;
+            if(++semis == 3) return 0;
+            continue;
+        }
+        // syntax error if we got here
+        return 8;
+    }
+    // if we got here without 3 semicolons, it's an error
+    return 9;
+}
 
-        // duplicate the sip_uri
-        // TODO: do all libc implementations add a null byte to this?
-        hist->sip_uri = strndup(entry->d_name + match[1].rm_so,
-                                match[1].rm_eo - match[1].rm_so);
-        if(!hist->sip_uri) FAIL(8);
+static int scan_hdr_scalar(const char *c, size_t avail, size_t colons[3]){
+    return scan_hdr_tail(c, avail, 0, 0, colons);
+}
 
-        // duplicate the buffer name
-        hist->name = strdup(entry->d_name + match[2].rm_so);
-        if(!hist->name) FAIL(9);
+/* consume the colons in one vector's worth of masks; returns 0 when all three
+   are found, 8 on a bad character, or -1 to keep going */
+static inline int scan_hdr_masks(size_t i, uint64_t colon, uint64_t bad,
+                                 int *semis, size_t colons[3]){
+    while(colon){
+        unsigned pos = __builtin_ctzll(colon);
+        // anything but a digit before this colon is an error
+        if(bad & ((1ULL << pos) - 1)) return 8;
+        colons[(*semis)++] = i + pos;
+        if(*semis == 3) return 0;
+        colon &= colon - 1;
+    }
+    return bad ? 8 : -1;
+}
 
-        // store it at the end of the linked list
-        *out_end = hist;
-        out_end = &hist->next;
-        hist = NULL;
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD
+
+__attribute__((target("sse2")))
+static int scan_hdr_sse2(const char *c, size_t avail, size_t colons[3]){
+    // shift '0'..'9' to the bottom of the signed range, for one comparison
+    const __m128i bias = _mm_set1_epi8((char)(0x80 - '0'));
+    const __m128i ten = _mm_set1_epi8((char)(0x80 + 10));
+    const __m128i colon_v = _mm_set1_epi8(':');
+    int semis = 0;
+    size_t i = 0;
+    for(; i + 16 <= avail; i += 16){
+        __m128i v = _mm_loadu_si128((const __m128i*)(c + i));
+        __m128i digit = _mm_cmplt_epi8(_mm_add_epi8(v, bias), ten);
+        __m128i colon = _mm_cmpeq_epi8(v, colon_v);
+        uint32_t dm = (uint32_t)_mm_movemask_epi8(digit);
+        uint32_t cm = (uint32_t)_mm_movemask_epi8(colon);
+        int ret = scan_hdr_masks(i, cm, ~(dm | cm) & 0xffff, &semis, colons);
+        if(ret >= 0) return ret;
     }
+    return scan_hdr_tail(c, avail, i, semis, colons);
+}
 
-    // success!
-    retval = 0;
+__attribute__((target("avx2")))
+static int scan_hdr_avx2(const char *c, size_t avail, size_t colons[3]){
+    const __m256i bias = _mm256_set1_epi8((char)(0x80 - '0'));
+    const __m256i ten = _mm256_set1_epi8((char)(0x80 + 10));
+    const __m256i colon_v = _mm256_set1_epi8(':');
+    int semis = 0;
+    size_t i = 0;
+    for(; i + 32 <= avail; i += 32){
+        __m256i v = _mm256_loadu_si256((const __m256i*)(c + i));
+        // avx2 only has a greater-than compare
+        __m256i digit = _mm256_cmpgt_epi8(ten, _mm256_add_epi8(v, bias));
+        __m256i colon = _mm256_cmpeq_epi8(v, colon_v);
+        uint32_t dm = (uint32_t)_mm256_movemask_epi8(digit);
+        uint32_t cm = (uint32_t)_mm256_movemask_epi8(colon);
+        int ret = scan_hdr_masks(i, cm, (uint32_t)~(dm | cm), &semis, colons);
+        if(ret >= 0) return ret;
+    }
+    return scan_hdr_tail(c, avail, i, semis, colons);
+}
+#endif
+
+static hdr_scan_fn scan_hdr = scan_hdr_scalar;
+static const char *scan_hdr_name = "scalar";
+
+// pick the fastest header scan this cpu supports
+__attribute__((constructor))
+static void pick_scan_hdr(void){
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2")){
+        hist_use_parser("avx2");
+    }else if(__builtin_cpu_supports("sse2")){
+        hist_use_parser("sse2");
+    }
+#endif
+}
 
-fail:
-    if(hdir) closedir(hdir);
-    if(regex_allocated) regfree(&reg);
-    free_hist_buf(hist);
-    // free *out, but only if we are about to return an error
-    if(retval != 0 && *out) free_hist_buf(*out);
-    return retval;
+const char* hist_parser(void){
+    return scan_hdr_name;
 }
 
+int hist_use_parser(const char* name){
+    if(strcmp(name, "scalar") == 0){
+        scan_hdr = scan_hdr_scalar;
+        scan_hdr_name = "scalar";
+        return 0;
+    }
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if(strcmp(name, "sse2") == 0 && __builtin_cpu_supports("sse2")){
+        scan_hdr = scan_hdr_sse2;
+        scan_hdr_name = "sse2";
+        return 0;
+    }
+    if(strcmp(name, "avx2") == 0 && __builtin_cpu_supports("avx2")){
+        scan_hdr = scan_hdr_avx2;
+        scan_hdr_name = "avx2";
+        return 0;
+    }
+#endif
+    return 1;
+}
 
-// get a message history from a buffer history
-int get_hist_msg(const char* wc_dir, const char* fname, hist_msg_t **out){
-    // .weechat/voipms/history directory (file descriptor)
-    int hdir_fd = -1;
-    // message file
-    int msg_fd = -1;
-    // a temporary msg entry
-    hist_msg_t *hist = NULL;
-    // memory for storing the entire file in memory
-    char *mem = NULL;
-    // return values
-    int retval = -1;
+/* convert n digits (already known to be digits) to a number, 8 at a time
+   where possible; returns false on overflow */
+static bool digits_to_ul(const char *c, size_t n, unsigned long *out){
+    unsigned long v = 0;
+    size_t i = 0;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    for(; i + 8 <= n; i += 8){
+        // combine 8 ascii digits pairwise: 1 -> 2 -> 4 -> 8 digits
+        uint64_t x;
+        memcpy(&x, c + i, 8);
+        x -= 0x3030303030303030ULL;
+        x = (x * 10 + (x >> 8)) & 0x00ff00ff00ff00ffULL;
+        x = (x * 100 + (x >> 16)) & 0x0000ffff0000ffffULL;
+        x = (x * 10000 + (x >> 32)) & 0x00000000ffffffffULL;
+        if(__builtin_mul_overflow(v, 100000000UL, &v)) return false;
+        if(__builtin_add_overflow(v, (unsigned long)x, &v)) return false;
+    }
+#endif
+    for(; i < n; i++){
+        if(__builtin_mul_overflow(v, 10UL, &v)) return false;
+        if(__builtin_add_overflow(v, (unsigned long)(c[i] - '0'), &v)){
+            return false;
+        }
+    }
+    *out = v;
+    return true;
+}
+
+/* parse the "epochtime:[0|1]:msg_len:" header of the record at c, with avail
+   bytes left in the file.  On success, *hdr_len is the length of the header;
+   the message bytes and the ending newline follow it */
+static int parse_hist_hdr(const char *c, size_t avail, time_t *time,
+                          bool *me, size_t *msg_len, size_t *hdr_len){
+    // find the three colons
+    size_t colons[3];
+    int ret = scan_hdr(c, avail, colons);
+    if(ret) return ret;
+
+    // interpret the three values we got
+    unsigned long time_val, me_val, bytes_len;
+    if(!digits_to_ul(c, colons[0], &time_val)) return 10;
+    if(!digits_to_ul(c + colons[0] + 1, colons[1] - colons[0] - 1, &me_val)){
+        return 10;
+    }
+    if(!digits_to_ul(c + colons[1] + 1, colons[2] - colons[1] - 1,
+                     &bytes_len)){
+        return 10;
+    }
+
+    // me_val should be 0 (the other person) or 1 (me)
+    if(me_val > 1) return 11;
+
+    // the header ends after the last semicolon
+    size_t len = colons[2] + 1;
+
+    // make sure we have the whole message loaded, plus the ending newline
+    if(bytes_len >= avail || len + bytes_len + 1 > avail) return 12;
+
+    *time = (time_t)time_val;
+    *me = me_val;
+    *msg_len = bytes_len;
+    *hdr_len = len;
+    return 0;
+}
+
+
+/* this matches the way "^<(.+)>(.+)" would split a filename: at the last '>'
+   that still has a name after it */
+bool hist_split_fname(const char *fname, size_t *uri_len){
+    if(fname[0] != '<') return false;
+    size_t len = strlen(fname);
+    // the last '>' with at least one character after it
+    for(size_t i = len - 1; i >= 2; i--){
+        if(fname[i] == '>' && i + 1 < len){
+            *uri_len = i - 1;
+            return true;
+        }
+    }
+    return false;
+}
+
+/* allocate a hist_buf_t for a valid history filename.  The filename, sip_uri
+   and name are copied into a single allocation */
+hist_buf_t *hist_buf_new(const char *fname, size_t uri_len){
+    hist_buf_t *hist = malloc(sizeof(*hist));
+    if(!hist) return NULL;
+    *hist = (hist_buf_t){0};
+    size_t flen = strlen(fname);
+    size_t name_len = flen - uri_len - 2;
+    char *mem = malloc(flen + 1 + uri_len + 1 + name_len + 1);
+    if(!mem){
+        free(hist);
+        return NULL;
+    }
+    hist->filename = mem;
+    memcpy(hist->filename, fname, flen + 1);
+    hist->sip_uri = hist->filename + flen + 1;
+    memcpy(hist->sip_uri, fname + 1, uri_len);
+    hist->sip_uri[uri_len] = '\0';
+    hist->name = hist->sip_uri + uri_len + 1;
+    memcpy(hist->name, fname + uri_len + 2, name_len + 1);
+    return hist;
+}
+
+
+/* The manifest is a small append-only log in each history directory, so
+   that listing the history is one sequential read instead of a readdir and
+   a parse of every file.  Its records are:
+
+       voipms-manifest:1               (header, first line of a full manifest)
+       F:count:last:offset:len:fname   (state of one file)
+       A:time:offset:dsec:dnsec:len:fname
+                                       (one message appended to fname, and
+                                        the directory mtime afterwards)
+       D:dsec:dnsec                    (the directory mtime)
+
+   Later records win.  If the last recorded directory mtime doesn't match the
+   directory, something else changed the directory and it gets rebuilt.
+   Appending to a file in place leaves the directory alone, so each file's
+   size is checked against its offset too: anything past it is counted (and
+   recorded with an F record), and a file which shrank means a rebuild. */
+#define MANIFEST ".manifest"
+#define MANIFEST_TMP ".manifest.tmp"
+#define MANIFEST_HEADER "voipms-manifest:1\n"
+
+// a hash index of hist_buf_t's by filename, for loading the manifest
+typedef struct {
+    hist_buf_t **slots;
+    size_t cap;
+    size_t len;
+} hist_index_t;
+
+static size_t hash_str(const char *s, size_t len){
+    // FNV-1a
+    size_t h = 14695981039346656037ULL;
+    for(size_t i = 0; i < len; i++){
+        h ^= (unsigned char)s[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static hist_buf_t **index_slot(hist_index_t *idx, const char *fname,
+                               size_t len){
+    size_t i = hash_str(fname, len) & (idx->cap - 1);
+    while(idx->slots[i]){
+        const char *f = idx->slots[i]->filename;
+        if(strncmp(f, fname, len) == 0 && f[len] == '\0') break;
+        i = (i + 1) & (idx->cap - 1);
+    }
+    return &idx->slots[i];
+}
+
+static int index_grow(hist_index_t *idx){
+    size_t cap = idx->cap ? idx->cap * 2 : 64;
+    hist_buf_t **old = idx->slots;
+    size_t old_cap = idx->cap;
+    idx->slots = calloc(cap, sizeof(*idx->slots));
+    if(!idx->slots){
+        idx->slots = old;
+        return 1;
+    }
+    idx->cap = cap;
+    for(size_t i = 0; i < old_cap; i++){
+        if(!old[i]) continue;
+        const char *f = old[i]->filename;
+        *index_slot(idx, f, strlen(f)) = old[i];
+    }
+    free(old);
+    return 0;
+}
+
+// find or add the entry for fname (which is not null-terminated)
+static hist_buf_t *index_get(hist_index_t *idx, const char *fname,
+                             size_t len){
+    // keep the table at most half full
+    if(2 * (idx->len + 1) > idx->cap && index_grow(idx)) return NULL;
+    hist_buf_t **slot = index_slot(idx, fname, len);
+    if(*slot) return *slot;
+
+    char *tmp = strndup(fname, len);
+    if(!tmp) return NULL;
+    size_t uri_len;
+    hist_buf_t *hist = NULL;
+    if(hist_split_fname(tmp, &uri_len)) hist = hist_buf_new(tmp, uri_len);
+    free(tmp);
+    if(!hist) return NULL;
+    *slot = hist;
+    idx->len++;
+    return hist;
+}
+
+// free every entry in the index, and the index
+static void index_free(hist_index_t *idx){
+    for(size_t i = 0; i < idx->cap; i++){
+        if(idx->slots[i]) free_hist_buf(idx->slots[i]);
+    }
+    free(idx->slots);
+    *idx = (hist_index_t){0};
+}
+
+// most recently active first
+static int cmp_recency(const void *a, const void *b){
+    const hist_buf_t *ha = *(hist_buf_t* const*)a;
+    const hist_buf_t *hb = *(hist_buf_t* const*)b;
+    if(ha->last != hb->last) return ha->last < hb->last ? 1 : -1;
+    return strcmp(ha->filename, hb->filename);
+}
+
+/* turn the index into a linked list sorted by recency; the index is left
+   empty either way */
+static int index_to_list(hist_index_t *idx, hist_buf_t **out){
     *out = NULL;
+    hist_buf_t **arr = malloc((idx->len + 1) * sizeof(*arr));
+    if(!arr){
+        index_free(idx);
+        return 1;
+    }
+    size_t n = 0;
+    for(size_t i = 0; i < idx->cap; i++){
+        if(idx->slots[i]) arr[n++] = idx->slots[i];
+    }
+    qsort(arr, n, sizeof(*arr), cmp_recency);
+    for(size_t i = n; i > 0; i--){
+        arr[i-1]->next = *out;
+        *out = arr[i-1];
+    }
+    free(arr);
+    free(idx->slots);
+    *idx = (hist_index_t){0};
+    return 0;
+}
 
-    int ret = open_hist_dir(wc_dir, &hdir_fd, NULL);
-    if(ret) FAIL(3);
+static int dir_stamp(int hdir_fd, struct timespec *ts){
+    struct stat st;
+    if(fstat(hdir_fd, &st)) return 1;
+    *ts = st.st_mtim;
+    return 0;
+}
 
-    // open the message file
-    msg_fd = openat(hdir_fd, fname, OPEN_RD_FLAGS);
-    if(msg_fd < 0) FAIL(4);
+// parse "123:" at *c, leaving *c after the ':'
+static bool parse_num(const char **c, const char *end, unsigned long long *v){
+    const char *p = *c;
+    unsigned long long val = 0;
+    if(p >= end || *p < '0' || *p > '9') return false;
+    for(; p < end && *p >= '0' && *p <= '9'; p++) val = val * 10 + (*p - '0');
+    if(p >= end || *p != ':') return false;
+    *v = val;
+    *c = p + 1;
+    return true;
+}
 
-    // read the entire file into memory
-    size_t msize = 8192;
-    mem = malloc(msize);
-    size_t mlen = 0;
-    if(!mem) FAIL(5);
+static int scan_hist_file(int hdir_fd, hist_buf_t *hist);
 
-    // read until end of file
-    ssize_t amnt_read;
-    while( (amnt_read = read(msg_fd, mem + mlen, 4096)) ){
-        // check for error
-        if(amnt_read < 0) FAIL(6);
-        // add to length
-        mlen += (size_t)amnt_read;
-        // check if we need to reallocate before next read
-        if(msize - mlen < 4096){
-            msize *= 2;
-            char *new = realloc(mem, msize);
-            if(!new) FAIL(7);
-            mem = new;
+/* count what other programs appended to the files in idx since the manifest
+   recorded them, and record it.  Returns nonzero if a file is gone or shrank
+   (or can't be read), so the manifest needs to be rebuilt */
+static int manifest_catch_up(int hdir_fd, hist_index_t *idx){
+    int fd = -1;
+    for(size_t i = 0; i < idx->cap; i++){
+        hist_buf_t *h = idx->slots[i];
+        if(!h) continue;
+        struct stat st;
+        if(fstatat(hdir_fd, h->filename, &st, 0)) goto fail;
+        if((size_t)st.st_size < h->offset) goto fail;
+        // (a partial record at the end is left there, and looked at again)
+        if((size_t)st.st_size == h->offset) continue;
+        size_t offset = h->offset;
+        if(scan_hist_file(hdir_fd, h)) goto fail;
+        if(h->offset == offset) continue;
+        if(fd < 0){
+            fd = openat(hdir_fd, MANIFEST, O_WRONLY | O_APPEND | O_CLOEXEC);
+            if(fd < 0) goto fail;
         }
+        dprintf(fd, "F:%zu:%lld:%zu:%zu:%s\n", h->count, (long long)h->last,
+                h->offset, strlen(h->filename), h->filename);
     }
+    if(fd >= 0) close(fd);
+    return 0;
 
-    // read every entry in the file
-    char *c = mem;
-    // end of the *out linked list
-    hist_msg_t **out_end = out;
-    while(c - mem < mlen){
-        // semicolon marks
-        int semis = 0;
-        char* nums[3] = {c, NULL, NULL};
-        for(; c - mem < mlen ; c++){
-            if(*c >= '0' && *c <= '9') continue;
-            if(*c == ':'){
-                if(++semis == 3) break;
-                nums[semis] = c + 1;
-                continue;
-            }
-            // syntax error if we got here
+fail:
+    if(fd >= 0) close(fd);
+    return 1;
+}
+
+/* load the manifest into idx.  Returns nonzero if the manifest is missing,
+   corrupt or stale, in which case it needs to be rebuilt */
+static int manifest_load(int hdir_fd, hist_index_t *idx, size_t *nappends){
+    int fd = -1;
+    char *mem = NULL;
+    size_t mlen;
+    int retval = -1;
+    struct timespec last_stamp = {0}, now_stamp;
+    bool have_stamp = false;
+    *nappends = 0;
+
+    fd = openat(hdir_fd, MANIFEST, OPEN_RD_FLAGS);
+    if(fd < 0) FAIL(1);
+    if(read_whole_fd(fd, &mem, &mlen)) FAIL(2);
+
+    // only a full manifest starts with the header
+    size_t hlen = strlen(MANIFEST_HEADER);
+    if(mlen < hlen || memcmp(mem, MANIFEST_HEADER, hlen) != 0) FAIL(3);
+
+    const char *c = mem + hlen, *end = mem + mlen;
+    while(c < end){
+        char type = *c;
+        if(c + 2 > end || c[1] != ':') FAIL(4);
+        c += 2;
+        unsigned long long v[5], flen;
+        if(type == 'D'){
+            if(!parse_num(&c, end, &v[0])) FAIL(5);
+            // the last number ends in a newline
+            const char *nl = memchr(c, '\n', end - c);
+            if(!nl) FAIL(5);
+            last_stamp.tv_sec = v[0];
+            last_stamp.tv_nsec = strtol(c, NULL, 10);
+            have_stamp = true;
+            c = nl + 1;
+            continue;
+        }
+        if(type != 'F' && type != 'A') FAIL(6);
+        // F is count:last:offset:len:fname, A is time:offset:dsec:dnsec:len:
+        int nnums = type == 'F' ? 4 : 5;
+        for(int i = 0; i < nnums; i++){
+            if(!parse_num(&c, end, &v[i])) FAIL(7);
+        }
+        flen = v[nnums - 1];
+        if(flen == 0 || (size_t)(end - c) < flen + 1 || c[flen] != '\n'){
             FAIL(8);
         }
-        // if we got here without 3 semicolons, it's an error
-        if(semis != 3) FAIL(9);
+        hist_buf_t *hist = index_get(idx, c, flen);
+        if(!hist) FAIL(9);
+        if(type == 'F'){
+            hist->count = v[0];
+            hist->last = v[1];
+            hist->offset = v[2];
+        }else{
+            hist->count += 1;
+            if((time_t)v[0] > hist->last) hist->last = v[0];
+            hist->offset = v[1];
+            last_stamp.tv_sec = v[2];
+            last_stamp.tv_nsec = v[3];
+            have_stamp = true;
+            *nappends += 1;
+        }
+        c += flen + 1;
+    }
 
-        // advance *c past the last semicolon
-        c++;
+    // is the manifest still in sync with the directory?
+    if(!have_stamp) FAIL(10);
+    if(dir_stamp(hdir_fd, &now_stamp)) FAIL(11);
+    if(now_stamp.tv_sec != last_stamp.tv_sec
+            || now_stamp.tv_nsec != last_stamp.tv_nsec) FAIL(12);
+    if(manifest_catch_up(hdir_fd, idx)) FAIL(13);
 
-        // interpret the three values we got
-        errno = 0;
-        size_t time = strtoul(nums[0], NULL, 10);
-        size_t me_val = strtoul(nums[1], NULL, 10);
-        size_t bytes_len = strtoul(nums[2], NULL, 10);
-        if(errno) FAIL(10);
+    retval = 0;
 
-        // me_val should be 0 (the other person) or 1 (me)
-        if(me_val > 1) FAIL(11);
+fail:
+    if(fd >= 0) close(fd);
+    if(mem) free(mem);
+    if(retval) index_free(idx);
+    return retval;
+}
 
-        // make sure we have the whole message loaded, plus the ending newline
-        if((c - mem) + bytes_len + 1 > mlen) FAIL(12);
+// atomically replace the manifest with the contents of idx
+static int manifest_write(int hdir_fd, hist_index_t *idx){
+    int fd = -1;
+    FILE *f = NULL;
+    int retval = -1;
 
-        // start building the temporary entry
-        hist = malloc(sizeof(*hist));
-        if(!hist) FAIL(13);
-        hist->time = time;
-        hist->me = me_val;
-        hist->len = bytes_len;
-        hist->next = NULL;
+    fd = openat(hdir_fd, MANIFEST_TMP, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                0666);
+    if(fd < 0) FAIL(1);
+    f = fdopen(fd, "w");
+    if(!f) FAIL(2);
+    fd = -1;
+
+    fputs(MANIFEST_HEADER, f);
+    for(size_t i = 0; i < idx->cap; i++){
+        hist_buf_t *h = idx->slots[i];
+        if(!h) continue;
+        fprintf(f, "F:%zu:%lld:%zu:%zu:%s\n", h->count, (long long)h->last,
+                h->offset, strlen(h->filename), h->filename);
+    }
+    if(fflush(f)) FAIL(3);
+    int ret = fclose(f);
+    f = NULL;
+    if(ret) FAIL(4);
 
-        // allocate for this message's bytes
-        hist->msg = malloc(hist->len + 1);
-        if(!hist->msg) FAIL(14);
+    if(renameat(hdir_fd, MANIFEST_TMP, hdir_fd, MANIFEST)) FAIL(5);
 
-        // copy the message bytes
-        memcpy(hist->msg, c, bytes_len);
-        // null-terminate
-        hist->msg[hist->len] = '\0';
+    // the rename changed the directory; record its new mtime
+    struct timespec ts;
+    if(dir_stamp(hdir_fd, &ts)) FAIL(6);
+    fd = openat(hdir_fd, MANIFEST, OPEN_WR_FLAGS);
+    if(fd < 0) FAIL(7);
+    ret = dprintf(fd, "D:%lld:%ld\n", (long long)ts.tv_sec, ts.tv_nsec);
+    if(ret < 0) FAIL(8);
 
-        // move *c to end of message entry plus ending newline
-        c += hist->len + 1;
+    retval = 0;
 
-        // save to end of *out linked list
-        *out_end = hist;
-        out_end = &hist->next;
-        hist = NULL;
+fail:
+    if(f) fclose(f);
+    if(fd >= 0) close(fd);
+    if(retval) unlinkat(hdir_fd, MANIFEST_TMP, 0);
+    return retval;
+}
+
+/* count the messages in one history file past hist->offset, and move the
+   offset to the end of them */
+static int scan_hist_file(int hdir_fd, hist_buf_t *hist){
+    int fd = -1;
+    char *mem = NULL;
+    size_t mlen;
+    int retval = -1;
+
+    fd = openat(hdir_fd, hist->filename, OPEN_RD_FLAGS);
+    if(fd < 0) FAIL(1);
+    if(lseek(fd, (off_t)hist->offset, SEEK_SET) < 0) FAIL(1);
+    if(read_whole_fd(fd, &mem, &mlen)) FAIL(2);
+
+    size_t off = 0;
+    while(off < mlen){
+        time_t t;
+        bool me;
+        size_t msg_len, hdr_len;
+        // stop at a corrupt tail; offset marks the end of the good records
+        if(parse_hist_hdr(mem + off, mlen - off, &t, &me, &msg_len, &hdr_len)){
+            break;
+        }
+        off += hdr_len + msg_len + 1;
+        hist->count += 1;
+        if(t > hist->last) hist->last = t;
     }
+    hist->offset += off;
 
-    // success!
     retval = 0;
 
 fail:
-    if(hdir_fd >= 0) close(hdir_fd);
-    if(msg_fd >= 0) close(msg_fd);
+    if(fd >= 0) close(fd);
     if(mem) free(mem);
-    free_hist_msg(hist);
-    // free *out, but only if we are about to return an error
-    if(retval) free_hist_msg(*out);
     return retval;
 }
 
-
-static int check_name(int hdir_fd, const char* filename, size_t uri_len){
+// rebuild the manifest from the files in the history directory
+static int manifest_rebuild(int hdir_fd, hist_index_t *idx){
     // a dup of hdir_fd for making DIR *hdir
     int hdir_fd_dup = -1;
     // history directory
     DIR* hdir = NULL;
-    // return values
-    int retval = -1; // indicate error if we return early
+    int retval = -1;
 
-    // dup hdir_fd
     hdir_fd_dup = dup(hdir_fd);
     if(hdir_fd_dup < 0) FAIL(1);
-
-    // make it a DIR*
     hdir = fdopendir(hdir_fd_dup);
     if(!hdir) FAIL(2);
-    // don't close hdir_fd_dup now
     hdir_fd_dup = -1;
 
     struct dirent* entry;
-
     while( (entry = readdir(hdir)) ){
         // skip directories
         if(entry->d_type == DT_DIR) continue;
 
-        // skip short filenames (need <, >, and at least 1 name char)
-        if(strlen(entry->d_name) < uri_len + 3) continue;
-
-        // match the <sip_uri> portion of the filename
-        if(strncmp(entry->d_name, filename, uri_len + 2) != 0) continue;
+        // skip invalid filenames
+        size_t uri_len;
+        if(!hist_split_fname(entry->d_name, &uri_len)) continue;
 
-        // now check if a rematch is necessary
-        if(strcmp(entry->d_name, filename) != 0){
-            int ret = renameat(hdir_fd, entry->d_name, hdir_fd, filename);
-            if(ret) FAIL(3);
-        }
-        break;
+        hist_buf_t *hist = index_get(idx, entry->d_name,
+                                     strlen(entry->d_name));
+        if(!hist) FAIL(3);
+        if(scan_hist_file(hdir_fd, hist)) FAIL(4);
     }
 
+    /* failing to write the manifest isn't fatal; we'll just rebuild it
+       again next time */
+    manifest_write(hdir_fd, idx);
+
     retval = 0;
 
 fail:
     if(hdir_fd_dup >= 0) close(hdir_fd_dup);
     if(hdir) closedir(hdir);
+    if(retval) index_free(idx);
     return retval;
 }
 
-// add a message to the history
-int hist_add_msg(const char* wc_dir, const char* sip_uri, const char* name,
-                 const char* msg, size_t msg_len, bool me){
-    // filename of the history buffer for this sip_uri
-    char *fname = NULL;
-    int fd = -1;
-    // history directory (file descriptor)
-    int hdir_fd = -1;
-    // return values
-    int retval = -1; // indicate error if we return early
+// record one appended message in the manifest, if there is one
+static void manifest_append(int hdir_fd, const char *fname, time_t t,
+                            size_t offset){
+    struct timespec ts;
+    if(dir_stamp(hdir_fd, &ts)) return;
+    // don't create it; a partial manifest would look complete
+    int fd = openat(hdir_fd, MANIFEST, O_WRONLY | O_APPEND | O_CLOEXEC);
+    if(fd < 0) return;
+    dprintf(fd, "A:%lld:%zu:%lld:%ld:%zu:%s\n", (long long)t, offset,
+            (long long)ts.tv_sec, ts.tv_nsec, strlen(fname), fname);
+    close(fd);
+}
 
-    size_t uri_len = strlen(sip_uri);
-    size_t name_len = strlen(name);
+/* which file each conversation is in, by its "<sip_uri>", for check_name()
+   (one index per history directory).  An index is good while the directory
+   mtime is the one recorded with it: any other file created, removed or
+   renamed changes it, and then the directory is scanned again */
+typedef struct {
+    char *fname;
+    size_t uri_len;
+} name_slot_t;
+
+typedef struct name_index {
+    dev_t dev;
+    ino_t ino;
+    struct timespec stamp;
+    name_slot_t *slots;
+    size_t cap;
+    size_t len;
+    struct name_index *next;
+} name_index_t;
+
+static name_index_t *name_indexes = NULL;
+
+static name_slot_t *names_slot(name_index_t *n, const char *fname,
+                               size_t uri_len){
+    size_t i = hash_str(fname, uri_len + 2) & (n->cap - 1);
+    while(n->slots[i].fname){
+        if(n->slots[i].uri_len == uri_len
+                && memcmp(n->slots[i].fname, fname, uri_len + 2) == 0) break;
+        i = (i + 1) & (n->cap - 1);
+    }
+    return &n->slots[i];
+}
 
-    // allocate the filename (two strings and < and > and \0)
-    fname = malloc(uri_len + strlen(name) + 3);
-    if(!fname) FAIL(1);
+static void names_clear(name_index_t *n){
+    for(size_t i = 0; i < n->cap; i++){
+        if(n->slots[i].fname) free(n->slots[i].fname);
+    }
+    if(n->slots) free(n->slots);
+    n->slots = NULL;
+    n->cap = 0;
+    n->len = 0;
+    n->stamp = (struct timespec){0};
+}
 
-    // build the filename
-    sprintf(fname, "<%.*s>%.*s", (int)uri_len, sip_uri, (int)name_len, name);
+// record that fname is the file of its conversation
+static int names_put(name_index_t *n, const char *fname){
+    size_t uri_len;
+    if(!hist_split_fname(fname, &uri_len)) return 0;
+    // keep the table at most half full
+    if(2 * (n->len + 1) > n->cap){
+        size_t cap = n->cap ? n->cap * 2 : 64;
+        name_slot_t *old = n->slots;
+        size_t old_cap = n->cap;
+        n->slots = calloc(cap, sizeof(*n->slots));
+        if(!n->slots){
+            n->slots = old;
+            return 1;
+        }
+        n->cap = cap;
+        for(size_t i = 0; i < old_cap; i++){
+            if(!old[i].fname) continue;
+            *names_slot(n, old[i].fname, old[i].uri_len) = old[i];
+        }
+        if(old) free(old);
+    }
+    char *dup = strdup(fname);
+    if(!dup) return 1;
+    name_slot_t *slot = names_slot(n, fname, uri_len);
+    if(slot->fname) free(slot->fname);
+    else n->len++;
+    *slot = (name_slot_t){ .fname = dup, .uri_len = uri_len };
+    return 0;
+}
 
-    // open the history directory
-    int ret = open_hist_dir(wc_dir, &hdir_fd, NULL);
-    if(ret) FAIL(2);
+// the index for the directory at hdir_fd, adding an empty one if need be
+static name_index_t *names_get(int hdir_fd){
+    struct stat st;
+    if(fstat(hdir_fd, &st)) return NULL;
+    for(name_index_t *n = name_indexes; n; n = n->next){
+        if(n->dev == st.st_dev && n->ino == st.st_ino) return n;
+    }
+    name_index_t *n = calloc(1, sizeof(*n));
+    if(!n) return NULL;
+    n->dev = st.st_dev;
+    n->ino = st.st_ino;
+    n->next = name_indexes;
+    name_indexes = n;
+    return n;
+}
 
-    // check if the same file exists but under a different name
-    ret = check_name(hdir_fd, fname, uri_len);
-    if(ret) FAIL(3);
+/* the directory changed under us (or we changed it); stamp the index with
+   its new mtime, or drop the index if we can't */
+static void names_restamp(name_index_t *n, int hdir_fd){
+    if(dir_stamp(hdir_fd, &n->stamp)) names_clear(n);
+}
 
-    // open the file for appending
-    fd = openat(hdir_fd, fname, OPEN_WR_FLAGS);
-    if(fd < 0) FAIL(4);
+// the index for hdir_fd, scanning the directory if it's out of date
+static name_index_t *names_fresh(int hdir_fd){
+    // a dup of hdir_fd for making DIR *hdir
+    int hdir_fd_dup = -1;
+    DIR* hdir = NULL;
+    name_index_t *n = names_get(hdir_fd);
+    int retval = -1;
+    if(!n) FAIL(1);
 
-    // get the time
-    time_t t = time(NULL);
-    if(t == ((time_t)-1)) FAIL(5);
+    struct timespec ts;
+    if(dir_stamp(hdir_fd, &ts)) FAIL(2);
+    if(n->slots && ts.tv_sec == n->stamp.tv_sec
+            && ts.tv_nsec == n->stamp.tv_nsec){
+        return n;
+    }
+    names_clear(n);
 
-    // append the message to the file
+    hdir_fd_dup = dup(hdir_fd);
+    if(hdir_fd_dup < 0) FAIL(3);
+    hdir = fdopendir(hdir_fd_dup);
+    if(!hdir) FAIL(4);
+    hdir_fd_dup = -1;
+
+    struct dirent* entry;
+    while( (entry = readdir(hdir)) ){
+        // skip directories
+        if(entry->d_type == DT_DIR) continue;
+        if(names_put(n, entry->d_name)) FAIL(5);
+    }
+    // (an empty directory still gets a table, to mark the index as made)
+    if(!n->slots){
+        n->slots = calloc(64, sizeof(*n->slots));
+        if(!n->slots) FAIL(5);
+        n->cap = 64;
+    }
+    n->stamp = ts;
+
+    retval = 0;
+
+fail:
+    if(hdir_fd_dup >= 0) close(hdir_fd_dup);
+    if(hdir) closedir(hdir);
+    if(retval && n) names_clear(n);
+    return retval ? NULL : n;
+}
+
+/* the manifest knows every file in the directory, so it makes the index
+   without a scan */
+static void names_seed(int hdir_fd, hist_index_t *idx){
+    name_index_t *n = names_get(hdir_fd);
+    if(!n) return;
+    names_clear(n);
+    for(size_t i = 0; i < idx->cap; i++){
+        if(idx->slots[i] && names_put(n, idx->slots[i]->filename)){
+            names_clear(n);
+            return;
+        }
+    }
+    if(!n->slots) return;
+    names_restamp(n, hdir_fd);
+}
+
+/* for after creating fname: the index learns of it, and takes the
+   directory mtime which the new file gave it */
+static void names_created(int hdir_fd, const char *fname){
+    name_index_t *n = names_get(hdir_fd);
+    if(!n || !n->slots) return;
+    if(names_put(n, fname)) names_clear(n);
+    else names_restamp(n, hdir_fd);
+}
+
+static void names_free(void){
+    name_index_t *n, *next = name_indexes;
+    while( (n = next) ){
+        next = n->next;
+        names_clear(n);
+        free(n);
+    }
+    name_indexes = NULL;
+}
+
+
+// get a linked list of all the available buffer history files
+static int files_list(const char* wc_dir, const char* shard, hist_buf_t **out){
+    // history directory (file descriptor)
+    int hdir_fd = -1;
+    hist_index_t idx = {0};
+    // return values
+    int retval = -1; // indicate error if we return early
+    *out = NULL;
+
+    int ret = open_hist_dir(wc_dir, shard, &hdir_fd, NULL);
+    if(ret) FAIL(4);
+
+    size_t nappends;
+    if(manifest_load(hdir_fd, &idx, &nappends) == 0){
+        // compact the manifest once the appends outweigh the files
+        if(nappends > 4 * idx.len + 64) manifest_write(hdir_fd, &idx);
+    }else{
+        ret = manifest_rebuild(hdir_fd, &idx);
+        if(ret) FAIL(5);
+    }
+    // appending to these files needn't scan the directory to find them
+    names_seed(hdir_fd, &idx);
+
+    // sort by recency
+    ret = index_to_list(&idx, out);
+    if(ret) FAIL(6);
+
+    // success!
+    retval = 0;
+
+fail:
+    if(hdir_fd >= 0) close(hdir_fd);
+    index_free(&idx);
+    return retval;
+}
+
+
+// get a message history from a buffer history
+static int files_get(const char* wc_dir, const char* shard, const char* fname,
+                     hist_msg_t **out){
+    // .weechat/voipms/history directory (file descriptor)
+    int hdir_fd = -1;
+    // message file
+    int msg_fd = -1;
+    // a temporary msg entry
+    hist_msg_t *hist = NULL;
+    // memory for storing the entire file in memory
+    char *mem = NULL;
+    // return values
+    int retval = -1;
+    *out = NULL;
+
+    int ret = open_hist_dir(wc_dir, shard, &hdir_fd, NULL);
+    if(ret) FAIL(3);
+
+    // open the message file
+    msg_fd = openat(hdir_fd, fname, OPEN_RD_FLAGS);
+    if(msg_fd < 0) FAIL(4);
+
+    // read the entire file into memory
+    size_t mlen;
+    ret = read_whole_fd(msg_fd, &mem, &mlen);
+    if(ret) FAIL(ret);
+
+    // read every entry in the file
+    char *c = mem;
+    // end of the *out linked list
+    hist_msg_t **out_end = out;
+    while(c - mem < mlen){
+        time_t time;
+        bool me;
+        size_t bytes_len, hdr_len;
+        ret = parse_hist_hdr(c, mlen - (c - mem), &time, &me, &bytes_len,
+                             &hdr_len);
+        if(ret) FAIL(ret);
+
+        // advance *c past the header
+        c += hdr_len;
+
+        // start building the temporary entry
+        hist = malloc(sizeof(*hist));
+        if(!hist) FAIL(13);
+        hist->time = time;
+        hist->me = me;
+        hist->len = bytes_len;
+        hist->next = NULL;
+
+        // allocate for this message's bytes
+        hist->msg = malloc(hist->len + 1);
+        if(!hist->msg) FAIL(14);
+
+        // copy the message bytes
+        memcpy(hist->msg, c, bytes_len);
+        // null-terminate
+        hist->msg[hist->len] = '\0';
+
+        // move *c to end of message entry plus ending newline
+        c += hist->len + 1;
+        hist->end = c - mem;
+
+        // save to end of *out linked list
+        *out_end = hist;
+        out_end = &hist->next;
+        hist = NULL;
+    }
+
+    // success!
+    retval = 0;
+
+fail:
+    if(hdir_fd >= 0) close(hdir_fd);
+    if(msg_fd >= 0) close(msg_fd);
+    if(mem) free(mem);
+    free_hist_msg(hist);
+    // free *out, but only if we are about to return an error
+    if(retval) free_hist_msg(*out);
+    return retval;
+}
+
+
+/* make filename the name of its conversation's file, renaming the file if
+   it has another name.  The directory is only scanned when the index of
+   names is out of date */
+static int check_name(int hdir_fd, const char* filename, size_t uri_len){
+    name_index_t *n = names_fresh(hdir_fd);
+    if(!n) return -1;
+    name_slot_t *slot = names_slot(n, filename, uri_len);
+    // a new conversation, or one whose file already has this name
+    if(!slot->fname || strcmp(slot->fname, filename) == 0) return 0;
+
+    int ret = renameat(hdir_fd, slot->fname, hdir_fd, filename);
+    if(ret) return -1;
+    // the manifest still has the old name; make it get rebuilt
+    unlinkat(hdir_fd, MANIFEST, 0);
+    if(names_put(n, filename)) names_clear(n);
+    else names_restamp(n, hdir_fd);
+    return 0;
+}
+
+// add a message to the history
+static int files_add(const char* wc_dir, const char* shard,
+                     const char* fname, const char* msg, size_t msg_len,
+                     bool me, time_t t, hist_pos_t *pos){
+    int fd = -1;
+    // history directory (file descriptor)
+    int hdir_fd = -1;
+    // return values
+    int retval = -1; // indicate error if we return early
+
+    // the filename is "<sip_uri>name"
+    size_t uri_len;
+    if(!hist_split_fname(fname, &uri_len)) FAIL(1);
+
+    // open the history directory
+    int ret = open_hist_dir(wc_dir, shard, &hdir_fd, NULL);
+    if(ret) FAIL(2);
+
+    // check if the same file exists but under a different name
+    ret = check_name(hdir_fd, fname, uri_len);
+    if(ret) FAIL(3);
+
+    // open the file for appending
+    fd = openat(hdir_fd, fname, OPEN_WR_FLAGS);
+    if(fd < 0) FAIL(4);
+    names_created(hdir_fd, fname);
+
+    // append the message to the file
     ret = dprintf(fd, "%ld:%d:%zu:%.*s\n",t, me, msg_len, (int)msg_len, msg);
     if(ret < 0) FAIL(6);
 
+    // keep the manifest up to date
+    struct stat st;
+    if(fstat(fd, &st) == 0){
+        manifest_append(hdir_fd, fname, t, st.st_size);
+        // O_APPEND means our record is the end of the file
+        if(pos){
+            pos->end = st.st_size;
+            pos->start = pos->end - (size_t)ret;
+        }
+    }else if(pos){
+        *pos = (hist_pos_t){0};
+    }
+
     // success!
     retval = 0;
 
 fail:
-    if(fname) free(fname);
     if(fd >= 0) close(fd);
     if(hdir_fd >= 0) close(hdir_fd);
     return retval;
 }
 
+
+
+// give a conversation a new name (fname), which renames its file
+static int files_rename(const char* wc_dir, const char* shard,
+                        const char* fname){
+    int hdir_fd = -1;
+    int retval = -1;
+
+    size_t uri_len;
+    if(!hist_split_fname(fname, &uri_len)) FAIL(1);
+
+    int ret = open_hist_dir(wc_dir, shard, &hdir_fd, NULL);
+    if(ret) FAIL(2);
+
+    ret = check_name(hdir_fd, fname, uri_len);
+    if(ret) FAIL(3);
+
+    retval = 0;
+
+fail:
+    if(hdir_fd >= 0) close(hdir_fd);
+    return retval;
+}
+
+
+/* a streaming reader over one history file, which reads it a chunk at a time
+   instead of all at once */
+typedef struct {
+    int fd;
+    // unparsed bytes are buf[start, end)
+    char *buf;
+    size_t cap;
+    size_t start;
+    size_t end;
+    // file offset of buf[start], and how far into the file we may read
+    size_t offset;
+    size_t limit;
+    // the last message returned; its text points into buf
+    hist_msg_t msg;
+} file_reader_t;
+
+#define READER_CHUNK 65536
+
+static void files_reader_close(void *rp);
+
+static int files_reader_open(const char* wc_dir, const char* shard,
+                             const char* fname, size_t offset, void **out){
+    int hdir_fd = -1;
+    file_reader_t *r = NULL;
+    int retval = -1;
+    *out = NULL;
+
+    int ret = open_hist_dir(wc_dir, shard, &hdir_fd, NULL);
+    if(ret) FAIL(3);
+
+    r = malloc(sizeof(*r));
+    if(!r) FAIL(5);
+    *r = (file_reader_t){ .fd = -1, .offset = offset };
+
+    r->fd = openat(hdir_fd, fname, OPEN_RD_FLAGS);
+    if(r->fd < 0) FAIL(4);
+
+    /* only read what is there now; anything appended later (maybe even by
+       us, while this reader is in use) is left for the next reader */
+    struct stat st;
+    if(fstat(r->fd, &st)) FAIL(6);
+    r->limit = st.st_size;
+    if(offset > r->limit) r->offset = r->limit;
+
+    r->cap = READER_CHUNK;
+    r->buf = malloc(r->cap);
+    if(!r->buf) FAIL(5);
+
+    *out = r;
+    r = NULL;
+    retval = 0;
+
+fail:
+    if(hdir_fd >= 0) close(hdir_fd);
+    files_reader_close(r);
+    return retval;
+}
+
+// read more of the file into the buffer; returns 0, or 1 at the limit
+static int reader_fill(file_reader_t *r){
+    size_t file_pos = r->offset + (r->end - r->start);
+    if(file_pos >= r->limit) return 1;
+
+    // move the unparsed bytes to the front
+    if(r->start){
+        memmove(r->buf, r->buf + r->start, r->end - r->start);
+        r->end -= r->start;
+        r->start = 0;
+    }
+    // grow for records bigger than the buffer
+    if(r->cap - r->end < READER_CHUNK / 2){
+        char *new = realloc(r->buf, r->cap * 2);
+        if(!new) return -1;
+        r->buf = new;
+        r->cap *= 2;
+    }
+
+    size_t want = r->cap - r->end;
+    if(want > r->limit - file_pos) want = r->limit - file_pos;
+    ssize_t amnt_read = pread(r->fd, r->buf + r->end, want, file_pos);
+    if(amnt_read < 0) return -1;
+    // the file shrank
+    if(amnt_read == 0){
+        r->limit = file_pos;
+        return 1;
+    }
+    r->end += (size_t)amnt_read;
+    return 0;
+}
+
+static int files_reader_next(void *rp, hist_msg_t **out){
+    file_reader_t *r = rp;
+    *out = NULL;
+    while(true){
+        time_t t;
+        bool me;
+        size_t msg_len, hdr_len;
+        int ret = parse_hist_hdr(r->buf + r->start, r->end - r->start, &t, &me,
+                                 &msg_len, &hdr_len);
+        if(ret == 0){
+            char *msg = r->buf + r->start + hdr_len;
+            // null-terminate in place, over the ending newline
+            msg[msg_len] = '\0';
+            r->msg = (hist_msg_t){ .time = t, .me = me, .msg = msg,
+                                   .len = msg_len };
+            size_t rec_len = hdr_len + msg_len + 1;
+            r->start += rec_len;
+            r->offset += rec_len;
+            r->msg.end = r->offset;
+            *out = &r->msg;
+            return 0;
+        }
+        // anything but a record that continues past the buffer is corrupt
+        if(ret != 9 && ret != 12) return ret;
+        ret = reader_fill(r);
+        if(ret < 0) return 6;
+        /* at the limit; a partial record at the end of the file is left for
+           later, since it may still be in the middle of being written */
+        if(ret > 0) return 1;
+    }
+}
+
+static size_t files_reader_offset(const void *rp){
+    const file_reader_t *r = rp;
+    return r->offset;
+}
+
+static void files_reader_close(void *rp){
+    file_reader_t *r = rp;
+    if(!r) return;
+    if(r->fd >= 0) close(r->fd);
+    if(r->buf) free(r->buf);
+    free(r);
+}
+
+/* the first record boundary at or after p in buf: the start of a line from
+   which whole records follow each other right up to len.  Returns len if
+   there is none (e.g. the window ends in a partial record) */
+static size_t find_boundary(const char *buf, size_t len, size_t p){
+    for(; p < len; p++){
+        if(buf[p - 1] != '\n') continue;
+        size_t q = p;
+        time_t t;
+        bool me;
+        size_t msg_len, hdr_len;
+        while(parse_hist_hdr(buf + q, len - q, &t, &me, &msg_len,
+                             &hdr_len) == 0
+                && buf[q + hdr_len + msg_len] == '\n'){
+            q += hdr_len + msg_len + 1;
+            if(q == len) return p;
+        }
+    }
+    return len;
+}
+
+/* look back from the end of the file, in windows which double in size,
+   for the first message since; so the cost is that of the messages since,
+   not of the whole history */
+static int files_seek(const char* wc_dir, const char* shard,
+                      const char* fname, time_t since, size_t *offset){
+    int hdir_fd = -1;
+    int fd = -1;
+    char *buf = NULL;
+    int retval = -1;
+    *offset = 0;
+
+    int ret = open_hist_dir(wc_dir, shard, &hdir_fd, NULL);
+    if(ret) FAIL(3);
+    fd = openat(hdir_fd, fname, OPEN_RD_FLAGS);
+    if(fd < 0) FAIL(4);
+    struct stat st;
+    if(fstat(fd, &st)) FAIL(6);
+    size_t size = (size_t)st.st_size;
+
+    for(size_t want = READER_CHUNK;; want *= 2){
+        size_t start = size > want ? size - want : 0;
+        size_t len = size - start;
+        char *new = realloc(buf, len + 1);
+        if(!new) FAIL(5);
+        buf = new;
+        for(size_t got = 0; got < len;){
+            ssize_t amnt_read = pread(fd, buf + got, len - got, start + got);
+            if(amnt_read <= 0) FAIL(6);
+            got += (size_t)amnt_read;
+        }
+        buf[len] = '\0';
+
+        // the first message since, if the window starts before it
+        size_t p = start ? find_boundary(buf, len, 1) : 0;
+        size_t q = p;
+        time_t t;
+        bool me;
+        size_t msg_len, hdr_len;
+        while(q < len && parse_hist_hdr(buf + q, len - q, &t, &me, &msg_len,
+                                        &hdr_len) == 0 && t < since){
+            q += hdr_len + msg_len + 1;
+        }
+        if(start == 0 || (p < len && q > p)){
+            *offset = start + q;
+            break;
+        }
+    }
+
+    retval = 0;
+
+fail:
+    if(hdir_fd >= 0) close(hdir_fd);
+    if(fd >= 0) close(fd);
+    if(buf) free(buf);
+    return retval;
+}
+
+/* messages from time since up to (not including) until.  Files are in time
+   order, so this stops reading at the first message past the range */
+static int files_range(const char* wc_dir, const char* shard,
+                       const char* fname, time_t since, time_t until,
+                       hist_msg_t **out){
+    void *r = NULL;
+    hist_msg_t **out_end = out;
+    *out = NULL;
+    int ret = files_reader_open(wc_dir, shard, fname, 0, &r);
+    if(ret) return ret;
+
+    hist_msg_t *msg;
+    while( (ret = files_reader_next(r, &msg)) == 0 ){
+        if(msg->time < since) continue;
+        if(msg->time >= until) break;
+        // the reader's message is only borrowed; keep a copy
+        hist_msg_t *copy = malloc(sizeof(*copy));
+        if(!copy) goto fail;
+        *copy = *msg;
+        copy->next = NULL;
+        copy->msg = malloc(msg->len + 1);
+        if(!copy->msg){
+            free(copy);
+            goto fail;
+        }
+        memcpy(copy->msg, msg->msg, msg->len + 1);
+        *out_end = copy;
+        out_end = &copy->next;
+    }
+    if(ret > 1){
+        free_hist_msg(*out);
+        *out = NULL;
+        files_reader_close(r);
+        return ret;
+    }
+    files_reader_close(r);
+    return 0;
+
+fail:
+    free_hist_msg(*out);
+    *out = NULL;
+    files_reader_close(r);
+    return 13;
+}
+
+/* a writer buffers its records through stdio, and updates the manifest once
+   when it is closed.  A replacement is written to "." + fname (which isn't a
+   valid history filename) and renamed over the original */
+typedef struct {
+    int hdir_fd;
+    FILE *f;
+    char *fname;
+    char *tmp;
+    // the state of the file, for the manifest
+    hist_buf_t hist;
+    bool failed;
+} file_writer_t;
+
+static void files_writer_free(file_writer_t *w){
+    if(w->f) fclose(w->f);
+    if(w->tmp) unlinkat(w->hdir_fd, w->tmp, 0);
+    if(w->hdir_fd >= 0) close(w->hdir_fd);
+    if(w->fname) free(w->fname);
+    if(w->tmp) free(w->tmp);
+    free(w);
+}
+
+static int files_writer_open(const char* wc_dir, const char* shard,
+                             const char* fname, bool replace, void **out){
+    file_writer_t *w = NULL;
+    int fd = -1;
+    int retval = -1;
+    *out = NULL;
+
+    size_t uri_len;
+    if(!hist_split_fname(fname, &uri_len)) FAIL(1);
+
+    w = calloc(1, sizeof(*w));
+    if(!w) FAIL(2);
+    w->hdir_fd = -1;
+    w->fname = strdup(fname);
+    if(!w->fname) FAIL(2);
+    w->hist.filename = w->fname;
+
+    int ret = open_hist_dir(wc_dir, shard, &w->hdir_fd, NULL);
+    if(ret) FAIL(3);
+
+    // (rename the conversation to fname if it has another name)
+    ret = check_name(w->hdir_fd, fname, uri_len);
+    if(ret) FAIL(4);
+
+    if(replace){
+        w->tmp = malloc(strlen(fname) + 2);
+        if(!w->tmp) FAIL(2);
+        sprintf(w->tmp, ".%s", fname);
+        fd = openat(w->hdir_fd, w->tmp,
+                    O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+        if(fd < 0) FAIL(5);
+    }else{
+        // start from what is already there
+        fd = openat(w->hdir_fd, fname, OPEN_WR_FLAGS);
+        if(fd < 0) FAIL(5);
+        names_created(w->hdir_fd, fname);
+        if(scan_hist_file(w->hdir_fd, &w->hist)) FAIL(6);
+    }
+    w->f = fdopen(fd, "w");
+    if(!w->f) FAIL(7);
+    fd = -1;
+
+    *out = w;
+    w = NULL;
+    retval = 0;
+
+fail:
+    if(fd >= 0) close(fd);
+    if(w) files_writer_free(w);
+    return retval;
+}
+
+static int files_writer_add(void *wp, const char* msg, size_t msg_len,
+                            bool me, time_t t){
+    file_writer_t *w = wp;
+    int ret = fprintf(w->f, "%ld:%d:%zu:%.*s\n", t, me, msg_len, (int)msg_len,
+                      msg);
+    if(ret < 0){
+        w->failed = true;
+        return 6;
+    }
+    w->hist.count += 1;
+    if(t > w->hist.last) w->hist.last = t;
+    w->hist.offset += (size_t)ret;
+    return 0;
+}
+
+static int files_writer_close(void *wp){
+    file_writer_t *w = wp;
+    int retval = -1;
+    if(w->failed) FAIL(1);
+
+    int ret = fclose(w->f);
+    w->f = NULL;
+    if(ret) FAIL(2);
+    if(w->tmp){
+        if(renameat(w->hdir_fd, w->tmp, w->hdir_fd, w->fname)) FAIL(3);
+        free(w->tmp);
+        w->tmp = NULL;
+        names_created(w->hdir_fd, w->fname);
+    }
+
+    // the whole state of the file, then the directory mtime after any rename
+    struct timespec ts;
+    int fd = openat(w->hdir_fd, MANIFEST, O_WRONLY | O_APPEND | O_CLOEXEC);
+    if(fd >= 0){
+        if(dir_stamp(w->hdir_fd, &ts) == 0){
+            dprintf(fd, "F:%zu:%lld:%zu:%zu:%s\nD:%lld:%ld\n", w->hist.count,
+                    (long long)w->hist.last, w->hist.offset,
+                    strlen(w->fname), w->fname, (long long)ts.tv_sec,
+                    ts.tv_nsec);
+        }
+        close(fd);
+    }
+
+    retval = 0;
+
+fail:
+    files_writer_free(w);
+    return retval;
+}
+
+// every write goes straight to its file, so there is nothing to batch
+static int files_batch(const char* wc_dir, const char* shard){
+    return 0;
+}
+
+static void files_close(void){
+    names_free();
+}
+
+const hist_backend_t hist_files_backend = {
+    .name = "files",
+    .list = files_list,
+    .get = files_get,
+    .range = files_range,
+    .add = files_add,
+    .rename = files_rename,
+    .begin = files_batch,
+    .commit = files_batch,
+    .seek = files_seek,
+    .reader_open = files_reader_open,
+    .reader_next = files_reader_next,
+    .reader_offset = files_reader_offset,
+    .reader_close = files_reader_close,
+    .writer_open = files_writer_open,
+    .writer_add = files_writer_add,
+    .writer_close = files_writer_close,
+    .close = files_close,
+};
+
+
+/* everything else goes through whichever backend is in use; a backend is
+   picked once, when the plugin loads */
+static const hist_backend_t *backends[] = {
+    &hist_files_backend,
+    &hist_sqlite_backend,
+};
+
+static const hist_backend_t *backend = &hist_files_backend;
+
+const char* hist_backend(void){
+    return backend->name;
+}
+
+int hist_use_backend(const char* name){
+    for(size_t i = 0; i < sizeof(backends) / sizeof(*backends); i++){
+        if(strcmp(backends[i]->name, name) != 0) continue;
+        if(backend != backends[i]) backend->close();
+        backend = backends[i];
+        return 0;
+    }
+    return 1;
+}
+
+void hist_close(void){
+    backend->close();
+}
+
+int list_hist_bufs(const char* wc_dir, const char* shard, hist_buf_t **out){
+    return backend->list(wc_dir, shard, out);
+}
+
+int get_hist_msg(const char* wc_dir, const char* shard, const char* fname,
+                 hist_msg_t **out){
+    return backend->get(wc_dir, shard, fname, out);
+}
+
+int hist_range_msg(const char* wc_dir, const char* shard, const char* fname,
+                   time_t since, time_t until, hist_msg_t **out){
+    return backend->range(wc_dir, shard, fname, since, until, out);
+}
+
+int hist_add_msg(const char* wc_dir, const char* shard, const char* fname,
+                 const char* msg, size_t msg_len, bool me, hist_pos_t *pos){
+    time_t t = time(NULL);
+    if(t == ((time_t)-1)) return 5;
+    return backend->add(wc_dir, shard, fname, msg, msg_len, me, t, pos);
+}
+
+int hist_add_msg_at(const char* wc_dir, const char* shard, const char* fname,
+                    const char* msg, size_t msg_len, bool me, time_t t,
+                    hist_pos_t *pos){
+    return backend->add(wc_dir, shard, fname, msg, msg_len, me, t, pos);
+}
+
+int hist_rename(const char* wc_dir, const char* shard, const char* fname){
+    return backend->rename(wc_dir, shard, fname);
+}
+
+int hist_begin(const char* wc_dir, const char* shard){
+    return backend->begin(wc_dir, shard);
+}
+
+int hist_commit(const char* wc_dir, const char* shard){
+    return backend->commit(wc_dir, shard);
+}
+
+/* a reader remembers its backend, so it keeps working even if another
+   backend is picked while it is open */
+struct hist_reader_t {
+    const hist_backend_t *be;
+    void *r;
+};
+
+int hist_reader_open(const char* wc_dir, const char* shard, const char* fname,
+                     size_t offset, hist_reader_t **out){
+    *out = malloc(sizeof(**out));
+    if(!*out) return 5;
+    (*out)->be = backend;
+    int ret = backend->reader_open(wc_dir, shard, fname, offset, &(*out)->r);
+    if(ret){
+        free(*out);
+        *out = NULL;
+    }
+    return ret;
+}
+
+int hist_reader_next(hist_reader_t *r, hist_msg_t **out){
+    return r->be->reader_next(r->r, out);
+}
+
+size_t hist_reader_offset(const hist_reader_t *r){
+    return r->be->reader_offset(r->r);
+}
+
+void hist_reader_close(hist_reader_t *r){
+    if(!r) return;
+    r->be->reader_close(r->r);
+    free(r);
+}
+
+// writers remember their backend too
+struct hist_writer_t {
+    const hist_backend_t *be;
+    void *w;
+};
+
+int hist_writer_open(const char* wc_dir, const char* shard, const char* fname,
+                     bool replace, hist_writer_t **out){
+    *out = malloc(sizeof(**out));
+    if(!*out) return 5;
+    (*out)->be = backend;
+    int ret = backend->writer_open(wc_dir, shard, fname, replace,
+                                   &(*out)->w);
+    if(ret){
+        free(*out);
+        *out = NULL;
+    }
+    return ret;
+}
+
+int hist_writer_add(hist_writer_t *w, const char* msg, size_t msg_len,
+                    bool me, time_t t){
+    return w->be->writer_add(w->w, msg, msg_len, me, t);
+}
+
+int hist_writer_close(hist_writer_t *w){
+    int ret = w->be->writer_close(w->w);
+    free(w);
+    return ret;
+}
+
+
+/* the k-way merge is a binary min-heap of the next message from each source;
+   ties go to whichever was added first */
+typedef struct {
+    hist_msg_t *msg;
+    // a file source, or NULL for a pushed message (which msg then owns)
+    hist_reader_t *reader;
+    void *tag;
+    unsigned long long seq;
+} merge_entry_t;
+
+struct hist_merge_t {
+    merge_entry_t *heap;
+    size_t len;
+    size_t cap;
+    unsigned long long seq;
+    // the entry returned by the last hist_merge_next()
+    merge_entry_t cur;
+    bool have_cur;
+};
+
+static bool entry_less(const merge_entry_t *a, const merge_entry_t *b){
+    if(a->msg->time != b->msg->time) return a->msg->time < b->msg->time;
+    return a->seq < b->seq;
+}
+
+static void heap_swap(merge_entry_t *a, merge_entry_t *b){
+    merge_entry_t tmp = *a;
+    *a = *b;
+    *b = tmp;
+}
+
+static int heap_push(hist_merge_t *m, merge_entry_t e){
+    if(m->len == m->cap){
+        size_t cap = m->cap ? m->cap * 2 : 16;
+        merge_entry_t *new = realloc(m->heap, cap * sizeof(*new));
+        if(!new) return 1;
+        m->heap = new;
+        m->cap = cap;
+    }
+    size_t i = m->len++;
+    m->heap[i] = e;
+    // sift up
+    while(i > 0){
+        size_t parent = (i - 1) / 2;
+        if(!entry_less(&m->heap[i], &m->heap[parent])) break;
+        heap_swap(&m->heap[i], &m->heap[parent]);
+        i = parent;
+    }
+    return 0;
+}
+
+static merge_entry_t heap_pop(hist_merge_t *m){
+    merge_entry_t top = m->heap[0];
+    m->heap[0] = m->heap[--m->len];
+    // sift down
+    size_t i = 0;
+    while(true){
+        size_t l = 2 * i + 1, r = l + 1, min = i;
+        if(l < m->len && entry_less(&m->heap[l], &m->heap[min])) min = l;
+        if(r < m->len && entry_less(&m->heap[r], &m->heap[min])) min = r;
+        if(min == i) break;
+        heap_swap(&m->heap[i], &m->heap[min]);
+        i = min;
+    }
+    return top;
+}
+
+int hist_merge_new(hist_merge_t **out){
+    *out = calloc(1, sizeof(**out));
+    return *out ? 0 : 1;
+}
+
+int hist_merge_add_file(hist_merge_t *m, const char* wc_dir,
+                        const char* shard, const char* fname, time_t since,
+                        void *tag){
+    hist_reader_t *r = NULL;
+    // start near since, rather than reading the whole history up to it
+    size_t offset = 0;
+    if(since > 0) backend->seek(wc_dir, shard, fname, since, &offset);
+    int ret = hist_reader_open(wc_dir, shard, fname, offset, &r);
+    if(ret) return ret;
+
+    // skip to the first message we want
+    hist_msg_t *msg;
+    do{
+        ret = hist_reader_next(r, &msg);
+    }while(ret == 0 && msg->time < since);
+
+    // nothing to read is fine
+    if(ret){
+        hist_reader_close(r);
+        return ret == 1 ? 0 : ret;
+    }
+
+    merge_entry_t e = { .msg = msg, .reader = r, .tag = tag, .seq = m->seq++ };
+    if(heap_push(m, e)){
+        hist_reader_close(r);
+        return 5;
+    }
+    return 0;
+}
+
+int hist_merge_push(hist_merge_t *m, time_t time, bool me, const char* msg,
+                    size_t len, void *tag){
+    hist_msg_t *copy = malloc(sizeof(*copy));
+    if(!copy) return 1;
+    *copy = (hist_msg_t){ .time = time, .me = me, .len = len };
+    copy->msg = malloc(len + 1);
+    if(!copy->msg){
+        free(copy);
+        return 1;
+    }
+    memcpy(copy->msg, msg, len);
+    copy->msg[len] = '\0';
+
+    merge_entry_t e = { .msg = copy, .reader = NULL, .tag = tag,
+                        .seq = m->seq++ };
+    if(heap_push(m, e)){
+        free_hist_msg(copy);
+        return 1;
+    }
+    return 0;
+}
+
+/* advance (or free) whatever the last hist_merge_next() returned; a source
+   which fails is closed, and its tag set in *tag */
+static int merge_release(hist_merge_t *m, void **tag){
+    if(!m->have_cur) return 0;
+    m->have_cur = false;
+    merge_entry_t e = m->cur;
+    if(!e.reader){
+        free_hist_msg(e.msg);
+        return 0;
+    }
+    int ret = hist_reader_next(e.reader, &e.msg);
+    if(ret){
+        hist_reader_close(e.reader);
+        // the end of a file is not an error
+        if(ret == 1) return 0;
+        if(tag) *tag = e.tag;
+        return ret;
+    }
+    e.seq = m->seq++;
+    if(heap_push(m, e)){
+        hist_reader_close(e.reader);
+        if(tag) *tag = e.tag;
+        return 5;
+    }
+    return 0;
+}
+
+int hist_merge_next(hist_merge_t *m, hist_msg_t **msg, void **tag){
+    *msg = NULL;
+    int ret = merge_release(m, tag);
+    if(ret) return ret;
+    if(m->len == 0) return 1;
+    m->cur = heap_pop(m);
+    m->have_cur = true;
+    *msg = m->cur.msg;
+    if(tag) *tag = m->cur.tag;
+    return 0;
+}
+
+size_t hist_merge_sources(const hist_merge_t *m){
+    return m->len + (m->have_cur ? 1 : 0);
+}
+
+void hist_merge_free(hist_merge_t *m){
+    if(!m) return;
+    if(m->have_cur){
+        if(m->cur.reader) hist_reader_close(m->cur.reader);
+        else free_hist_msg(m->cur.msg);
+    }
+    for(size_t i = 0; i < m->len; i++){
+        if(m->heap[i].reader) hist_reader_close(m->heap[i].reader);
+        else free_hist_msg(m->heap[i].msg);
+    }
+    if(m->heap) free(m->heap);
+    free(m);
+}
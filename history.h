@@ -2,15 +2,22 @@
 #define HISTORY_H
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
 
 // we are going to do a quick-and-easy (malloc-heavy) design here
 
 // per-buffer history, (file name)
 typedef struct hist_buf_t {
-    // filename is of format "<sip_uri>name"
+    /* filename is of format "<sip_uri>name"; sip_uri and name share its
+       allocation */
     char* filename;
     char* sip_uri;
     char* name;
+    // number of messages, time of the last one, and end of the last one
+    size_t count;
+    time_t last;
+    size_t offset;
     struct hist_buf_t* next;
 } hist_buf_t;
 
@@ -21,20 +28,140 @@ typedef struct hist_msg_t {
     bool me;
     char* msg;
     size_t len;
+    // offset just past this message (in bytes, for the files backend)
+    size_t end;
     struct hist_msg_t* next;
 } hist_msg_t;
 
+// where hist_add_msg() put a message: the range of offsets it takes up
+typedef struct {
+    size_t start;
+    size_t end;
+} hist_pos_t;
+
 void free_hist_buf(hist_buf_t *hist);
 void free_hist_msg(hist_msg_t *msg);
 
-// get a linked list of all the available buffer history files
-int list_hist_bufs(const char* wc_dir, hist_buf_t **out);
+/* history is kept by a storage backend: "files" (one file per conversation,
+   the default) or "sqlite" (one database per shard, indexed by conversation
+   and time).  Pick one before using anything else; returns nonzero for an
+   unknown backend */
+int hist_use_backend(const char* name);
+
+// the backend in use
+const char* hist_backend(void);
+
+// release anything the backend keeps open (e.g. database connections)
+void hist_close(void);
+
+/* history lives in .weechat/voipms/history, or in a subdirectory of it named
+   after the account (the "shard") when shard is not NULL or empty */
+
+/* get a linked list of all the available buffer history files, most recently
+   active first.  This is read from a manifest file which is kept up to date
+   by hist_add_msg(), and rebuilt from the directory when it is out of date */
+int list_hist_bufs(const char* wc_dir, const char* shard, hist_buf_t **out);
 
 // get a linked list of messages from a history file
-int get_hist_msg(const char* wc_dir, const char* fname, hist_msg_t **out);
+int get_hist_msg(const char* wc_dir, const char* shard, const char* fname,
+                 hist_msg_t **out);
+
+// get the messages from time since up to (not including) until
+int hist_range_msg(const char* wc_dir, const char* shard, const char* fname,
+                   time_t since, time_t until, hist_msg_t **out);
+
+/* add a message to the history of fname ("<sip_uri>name"); pos may be NULL.
+   If the conversation has a different name in the history, it's renamed */
+int hist_add_msg(const char* wc_dir, const char* shard, const char* fname,
+                 const char* msg, size_t msg_len, bool me, hist_pos_t *pos);
+
+// the same, but with a given time (e.g. for importing old messages)
+int hist_add_msg_at(const char* wc_dir, const char* shard, const char* fname,
+                    const char* msg, size_t msg_len, bool me, time_t t,
+                    hist_pos_t *pos);
+
+// give the conversation in fname's sip_uri the name in fname
+int hist_rename(const char* wc_dir, const char* shard, const char* fname);
+
+/* group many hist_add_msg() calls into one transaction, for backends that
+   have them; every hist_begin() needs a hist_commit() */
+int hist_begin(const char* wc_dir, const char* shard);
+int hist_commit(const char* wc_dir, const char* shard);
+
+/* a writer for many messages to one conversation, for bulk imports.  It
+   appends, or with replace, it writes a whole new history which takes the
+   place of the old one when it's closed (so older messages can be merged in
+   while keeping it in time order).  The old history can still be read while
+   the writer is open.  Offsets change when a history is replaced, so don't
+   use one while the plugin is running */
+typedef struct hist_writer_t hist_writer_t;
+
+int hist_writer_open(const char* wc_dir, const char* shard, const char* fname,
+                     bool replace, hist_writer_t **out);
+
+int hist_writer_add(hist_writer_t *w, const char* msg, size_t msg_len,
+                    bool me, time_t t);
+
+/* finish writing; returns nonzero if anything failed, in which case a
+   replaced history is left as it was */
+int hist_writer_close(hist_writer_t *w);
+
+/* history filenames are of the format "<sip_uri>name".  Returns true for a
+   valid filename and sets *uri_len; the name starts at fname + uri_len + 2 */
+bool hist_split_fname(const char *fname, size_t *uri_len);
+
+/* a streaming reader over one conversation, starting at an offset.  It only
+   reads up to the end the history had when it was opened, and never reads
+   more than the next message needs */
+typedef struct hist_reader_t hist_reader_t;
+
+int hist_reader_open(const char* wc_dir, const char* shard, const char* fname,
+                     size_t offset, hist_reader_t **out);
+
+/* get the next message; returns 0, 1 at the end of the file (including a
+   partial record at the end), or an error.  *out belongs to the reader and
+   is only valid until the next call */
+int hist_reader_next(hist_reader_t *r, hist_msg_t **out);
+
+// the offset just past the last message returned
+size_t hist_reader_offset(const hist_reader_t *r);
+
+void hist_reader_close(hist_reader_t *r);
+
+/* a k-way merge of messages from many history files, in time order.  Files
+   are read incrementally, and single messages (e.g. new ones) can be pushed
+   in at any time; each message costs O(log k) for k sources */
+typedef struct hist_merge_t hist_merge_t;
+
+int hist_merge_new(hist_merge_t **out);
+
+/* add a history file, skipping messages before since; tag identifies it.
+   Reading starts at the first message since (found from the end of the
+   history), so older messages cost nothing */
+int hist_merge_add_file(hist_merge_t *m, const char* wc_dir,
+                        const char* shard, const char* fname, time_t since,
+                        void *tag);
+
+// add one message, which is copied
+int hist_merge_push(hist_merge_t *m, time_t time, bool me, const char* msg,
+                    size_t len, void *tag);
+
+/* get the next message in time order, and the tag of its source; returns 0,
+   1 when there are no more messages, or an error.  An error comes from one
+   source, whose tag is set; that source is dropped, and the merge can carry
+   on with the rest.  *msg is only valid until the next call */
+int hist_merge_next(hist_merge_t *m, hist_msg_t **msg, void **tag);
+
+// how many sources still have messages
+size_t hist_merge_sources(const hist_merge_t *m);
+
+void hist_merge_free(hist_merge_t *m);
+
+// which record header parser is in use: "avx2", "sse2" or "scalar"
+const char* hist_parser(void);
 
-// add a message to the history
-int hist_add_msg(const char* wc_dir, const char* sip_uri, const char* name,
-                 const char* msg, size_t msg_len, bool me);
+/* force a particular record header parser (for tests and benchmarks);
+   returns nonzero if this cpu doesn't support it */
+int hist_use_parser(const char* name);
 
 #endif // HISTORY_H
@@ -0,0 +1,84 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "importer.h"
+#include "history.h"
+#include "uri.h"
+
+/* import a VoIP.ms sms export into the history:
+       ./import -r realm [-d weechat_dir] [-s shard] [-b backend] [-n did]
+                [-m megabytes] file...
+   Files are CSV or JSON exports (see importer.h), or - for stdin, and are
+   read a batch of up to -m megabytes at a time.  Conversations which get
+   messages older than their newest one are rewritten in time order, so
+   don't run this while the plugin is loaded. */
+
+// batch size, in megabytes
+#define IMPORT_BATCH_MB 64
+
+static void usage(void){
+    fprintf(stderr, "usage: import -r realm [-d weechat_dir] [-s shard] "
+            "[-b files|sqlite] [-n did] [-m megabytes] file...\n");
+    exit(1);
+}
+
+int main(int argc, char** argv){
+    int retval = 1;
+    const char* backend = "files";
+    size_t batch_mb = IMPORT_BATCH_MB;
+    static char default_dir[4096];
+    snprintf(default_dir, sizeof(default_dir), "%s/.weechat",
+             getenv("HOME") ? getenv("HOME") : ".");
+    import_opts_t opts = { .wc_dir = default_dir };
+    import_stats_t stats;
+
+    int opt;
+    while( (opt = getopt(argc, argv, "r:d:s:b:n:m:")) != -1 ){
+        switch(opt){
+        case 'r': opts.realm = optarg; break;
+        case 'd': opts.wc_dir = optarg; break;
+        case 's': opts.shard = optarg; break;
+        case 'b': backend = optarg; break;
+        case 'n':
+            if(!strpbrk(optarg, "0123456789")) usage();
+            opts.did = optarg;
+            break;
+        case 'm':
+            batch_mb = strtoul(optarg, NULL, 10);
+            if(!batch_mb) usage();
+            break;
+        default: usage();
+        }
+    }
+    if(!opts.realm || optind == argc) usage();
+    if(hist_use_backend(backend)){
+        fprintf(stderr, "import: unknown backend %s\n", backend);
+        return 1;
+    }
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    opts.batch = batch_mb * 1024 * 1024;
+    if(import_files(&opts, (const char* const*)argv + optind,
+                    (size_t)(argc - optind), &stats)){
+        goto done;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    printf("%zu records: %zu added to %zu conversations (%zu rewritten), "
+           "%zu already there, %zu repeated, %zu for other DIDs, "
+           "%zu unreadable; %zu batches, %.2fs\n", stats.read, stats.added,
+           stats.convs, stats.rewritten, stats.dups, stats.repeated,
+           stats.filtered, stats.bad, stats.runs + 1,
+           (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9);
+    retval = 0;
+
+done:
+    sip_uri_free_all();
+    hist_close();
+    return retval;
+}
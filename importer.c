@@ -0,0 +1,907 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <time.h>
+
+#include "importer.h"
+#include "history.h"
+#include "uri.h"
+
+// messages per transaction, for backends that have them
+#define IMPORT_COMMIT 100000
+
+#define FAIL(n) { retval = n; goto fail; }
+
+static const char* wc_dir;
+static const char* shard;
+static const char* realm;
+
+static import_stats_t stats;
+
+
+/* a growable string */
+typedef struct {
+    char* s;
+    size_t len;
+    size_t cap;
+} strbuf_t;
+
+static int sb_put(strbuf_t* sb, char c){
+    if(sb->len + 1 >= sb->cap){
+        size_t cap = sb->cap ? 2 * sb->cap : 256;
+        char* s = realloc(sb->s, cap);
+        if(!s) return 1;
+        sb->s = s;
+        sb->cap = cap;
+    }
+    sb->s[sb->len++] = c;
+    sb->s[sb->len] = '\0';
+    return 0;
+}
+
+// the fields of an export record
+enum { F_DATE, F_TYPE, F_DID, F_CONTACT, F_MESSAGE, NFIELDS };
+
+static const char* field_names[NFIELDS] = {
+    [F_DATE] = "date",
+    [F_TYPE] = "type",
+    [F_DID] = "did",
+    [F_CONTACT] = "contact",
+    [F_MESSAGE] = "message",
+};
+
+typedef struct {
+    strbuf_t v[NFIELDS];
+    bool have[NFIELDS];
+} fields_t;
+
+static int field_index(const char* name){
+    while(isspace((unsigned char)*name)) name++;
+    size_t len = strlen(name);
+    while(len && isspace((unsigned char)name[len - 1])) len--;
+    for(int i = 0; i < NFIELDS; i++){
+        if(strlen(field_names[i]) == len
+                && strncasecmp(name, field_names[i], len) == 0) return i;
+    }
+    return -1;
+}
+
+// move sb into field f; sb gets the field's old buffer
+static void fields_set(fields_t* fl, int f, strbuf_t* sb){
+    strbuf_t old = fl->v[f];
+    fl->v[f] = *sb;
+    *sb = old;
+    sb->len = 0;
+    fl->have[f] = true;
+}
+
+static void fields_clear(fields_t* fl){
+    for(int i = 0; i < NFIELDS; i++) fl->have[i] = false;
+}
+
+static void fields_free(fields_t* fl){
+    for(int i = 0; i < NFIELDS; i++){
+        if(fl->v[i].s) free(fl->v[i].s);
+    }
+}
+
+
+/* The spool: records are collected in an arena, sorted by (uri, time, order
+   read) when it fills up, and written out as a run.  The runs are temporary
+   files which only this process reads, so a record's uri is kept as its
+   (interned) pointer. */
+typedef struct {
+    sip_uri_t* uri;
+    time_t t;
+    size_t seq;
+    size_t len;
+    bool me;
+    char body[];
+} rec_t;
+
+// the size of a record, not counting the body's terminating nul
+#define REC_SIZE(len) (offsetof(rec_t, body) + (len))
+
+static struct {
+    char* arena;
+    size_t used;
+    size_t size;
+    rec_t** recs;
+    size_t n;
+    size_t max;
+    FILE** runs;
+    size_t nruns;
+    size_t seq;
+} spool;
+
+static int rec_cmp(const rec_t* a, const rec_t* b){
+    if(a->uri != b->uri) return strcmp(a->uri->str, b->uri->str);
+    if(a->t != b->t) return a->t < b->t ? -1 : 1;
+    return a->seq < b->seq ? -1 : a->seq > b->seq;
+}
+
+static int rec_qsort_cmp(const void* a, const void* b){
+    return rec_cmp(*(rec_t* const*)a, *(rec_t* const*)b);
+}
+
+// sort the arena and write it to a new run
+static int spool_spill(void){
+    qsort(spool.recs, spool.n, sizeof(*spool.recs), rec_qsort_cmp);
+    FILE** runs = realloc(spool.runs, (spool.nruns + 1) * sizeof(*runs));
+    if(!runs) return 1;
+    spool.runs = runs;
+    FILE* f = tmpfile();
+    if(!f) return 2;
+    spool.runs[spool.nruns++] = f;
+    for(size_t i = 0; i < spool.n; i++){
+        rec_t* r = spool.recs[i];
+        if(fwrite(r, REC_SIZE(r->len), 1, f) != 1) return 3;
+    }
+    if(fflush(f) || fseek(f, 0, SEEK_SET)) return 4;
+    spool.used = 0;
+    spool.n = 0;
+    stats.runs++;
+    return 0;
+}
+
+static int spool_add(sip_uri_t* uri, time_t t, bool me, const char* body,
+                     size_t len){
+    // keep records aligned in the arena
+    size_t need = (REC_SIZE(len) + 1 + 7) & ~(size_t)7;
+    if(spool.used + need > spool.size){
+        if(spool.n && spool_spill()) return 1;
+        // (a single message bigger than the whole batch)
+        if(need > spool.size){
+            char* arena = realloc(spool.arena, need);
+            if(!arena) return 2;
+            spool.arena = arena;
+            spool.size = need;
+        }
+    }
+    if(spool.n == spool.max){
+        size_t max = spool.max ? 2 * spool.max : 4096;
+        rec_t** recs = realloc(spool.recs, max * sizeof(*recs));
+        if(!recs) return 3;
+        spool.recs = recs;
+        spool.max = max;
+    }
+    rec_t* r = (rec_t*)(spool.arena + spool.used);
+    *r = (rec_t){ .uri = uri, .t = t, .seq = spool.seq++, .len = len,
+                  .me = me };
+    memcpy(r->body, body, len);
+    r->body[len] = '\0';
+    spool.recs[spool.n++] = r;
+    spool.used += need;
+    return 0;
+}
+
+static void spool_free(void){
+    for(size_t i = 0; i < spool.nruns; i++) fclose(spool.runs[i]);
+    if(spool.runs) free(spool.runs);
+    if(spool.recs) free(spool.recs);
+    if(spool.arena) free(spool.arena);
+    memset(&spool, 0, sizeof(spool));
+}
+
+
+static bool parse_date(const char* s, time_t* out){
+    while(isspace((unsigned char)*s)) s++;
+    // seconds since the epoch
+    char* end;
+    long long v = strtoll(s, &end, 10);
+    if(end != s && *end == '\0'){
+        *out = (time_t)v;
+        return true;
+    }
+    // "2019-03-30 10:24:16"
+    struct tm tm = {0};
+    if(sscanf(s, "%d-%d-%d%*[ T]%d:%d:%d", &tm.tm_year, &tm.tm_mon,
+              &tm.tm_mday, &tm.tm_hour, &tm.tm_min, &tm.tm_sec) != 6){
+        return false;
+    }
+    tm.tm_year -= 1900;
+    tm.tm_mon -= 1;
+    tm.tm_isdst = -1;
+    *out = mktime(&tm);
+    return *out != (time_t)-1;
+}
+
+/* the digits of a phone number, without the 1 of an 11-digit North American
+   number, so they match the numbers in the uris of live messages */
+static size_t norm_number(const char* s, char* out, size_t max){
+    size_t n = 0;
+    for(; *s && n < max; s++){
+        if(isdigit((unsigned char)*s)) out[n++] = *s;
+    }
+    if(n == 11 && out[0] == '1'){
+        memmove(out, out + 1, 10);
+        n = 10;
+    }
+    return n;
+}
+
+static char only_did[32];
+static size_t only_did_len;
+
+// one record from an export
+static int import_record(fields_t* fl){
+    stats.read++;
+    if(!fl->have[F_DATE] || !fl->have[F_CONTACT] || !fl->have[F_MESSAGE]){
+        stats.bad++;
+        return 0;
+    }
+    if(only_did_len){
+        char did[32];
+        size_t n = fl->have[F_DID] ? norm_number(fl->v[F_DID].s, did,
+                                                 sizeof(did)) : 0;
+        if(n != only_did_len || memcmp(did, only_did, n) != 0){
+            stats.filtered++;
+            return 0;
+        }
+    }
+    time_t t;
+    char number[32];
+    size_t n = norm_number(fl->v[F_CONTACT].s, number, sizeof(number));
+    if(!n || !parse_date(fl->v[F_DATE].s, &t)){
+        stats.bad++;
+        return 0;
+    }
+    // type 1 is received, 0 is sent
+    bool me = false;
+    if(fl->have[F_TYPE]){
+        const char* type = fl->v[F_TYPE].s;
+        me = strcmp(type, "0") == 0 || tolower((unsigned char)*type) == 's'
+             || tolower((unsigned char)*type) == 'o';
+    }
+    sip_uri_t* uri = sip_uri_from_number(number, n, realm);
+    if(!uri) return 1;
+    return spool_add(uri, t, me, fl->v[F_MESSAGE].s, fl->v[F_MESSAGE].len);
+}
+
+
+/* read one CSV field (RFC 4180: quotes, doubled quotes, and newlines within
+   quotes); returns what ended it: ',', '\n' or EOF */
+static int csv_field(FILE* f, strbuf_t* sb){
+    sb->len = 0;
+    if(sb->s) sb->s[0] = '\0';
+    int c = getc_unlocked(f);
+    if(c == '"'){
+        while( (c = getc_unlocked(f)) != EOF ){
+            if(c == '"'){
+                c = getc_unlocked(f);
+                if(c != '"') break;
+            }
+            if(sb_put(sb, (char)c)) return -2;
+        }
+    }
+    // (anything after a closing quote is kept too)
+    while(c != ',' && c != '\n' && c != EOF){
+        if(c != '\r' && sb_put(sb, (char)c)) return -2;
+        c = getc_unlocked(f);
+    }
+    if(!sb->s && sb_put(sb, '\0') == 0) sb->len = 0;
+    return c;
+}
+
+static int import_csv(FILE* f, fields_t* fl){
+    strbuf_t sb = {0};
+    int* map = NULL;
+    size_t ncols = 0;
+    int retval = -1;
+
+    // the header says which column is which
+    int end;
+    do{
+        end = csv_field(f, &sb);
+        if(end == -2) FAIL(1);
+        int* m = realloc(map, (ncols + 1) * sizeof(*map));
+        if(!m) FAIL(1);
+        map = m;
+        map[ncols++] = field_index(sb.s);
+    }while(end == ',');
+    bool found[NFIELDS] = {0};
+    for(size_t i = 0; i < ncols; i++){
+        if(map[i] >= 0) found[map[i]] = true;
+    }
+    if(!found[F_DATE] || !found[F_CONTACT] || !found[F_MESSAGE]){
+        fprintf(stderr, "import: the CSV header needs date, contact and "
+                "message columns\n");
+        FAIL(2);
+    }
+
+    while(end != EOF){
+        fields_clear(fl);
+        size_t col = 0, chars = 0;
+        do{
+            end = csv_field(f, &sb);
+            if(end == -2) FAIL(1);
+            chars += sb.len;
+            if(col < ncols && map[col] >= 0) fields_set(fl, map[col], &sb);
+            col++;
+        }while(end == ',');
+        // skip blank lines
+        if(col == 1 && !chars) continue;
+        if(import_record(fl)) FAIL(3);
+    }
+    if(ferror(f)) FAIL(4);
+
+    retval = 0;
+
+fail:
+    if(sb.s) free(sb.s);
+    if(map) free(map);
+    return retval;
+}
+
+static int utf8_put(strbuf_t* sb, unsigned long cp){
+    if(cp < 0x80) return sb_put(sb, (char)cp);
+    if(cp < 0x800){
+        return sb_put(sb, (char)(0xc0 | cp >> 6))
+               || sb_put(sb, (char)(0x80 | (cp & 0x3f)));
+    }
+    if(cp < 0x10000){
+        return sb_put(sb, (char)(0xe0 | cp >> 12))
+               || sb_put(sb, (char)(0x80 | ((cp >> 6) & 0x3f)))
+               || sb_put(sb, (char)(0x80 | (cp & 0x3f)));
+    }
+    return sb_put(sb, (char)(0xf0 | cp >> 18))
+           || sb_put(sb, (char)(0x80 | ((cp >> 12) & 0x3f)))
+           || sb_put(sb, (char)(0x80 | ((cp >> 6) & 0x3f)))
+           || sb_put(sb, (char)(0x80 | (cp & 0x3f)));
+}
+
+static long json_hex4(FILE* f){
+    long v = 0;
+    for(int i = 0; i < 4; i++){
+        int c = getc_unlocked(f);
+        if(!isxdigit(c)) return -1;
+        v = v * 16 + (isdigit(c) ? c - '0' : tolower(c) - 'a' + 10);
+    }
+    return v;
+}
+
+// read a JSON string (after its opening quote), unescaping it
+static int json_string(FILE* f, strbuf_t* sb){
+    sb->len = 0;
+    if(sb_put(sb, '\0')) return 1;
+    sb->len = 0;
+    int c;
+    while( (c = getc_unlocked(f)) != '"' ){
+        if(c == EOF) return 2;
+        if(c != '\\'){
+            if(sb_put(sb, (char)c)) return 1;
+            continue;
+        }
+        c = getc_unlocked(f);
+        const char* from = "\"\\/bfnrt";
+        const char* to = "\"\\/\b\f\n\r\t";
+        const char* esc = c != EOF && c ? strchr(from, c) : NULL;
+        if(esc){
+            if(sb_put(sb, to[esc - from])) return 1;
+            continue;
+        }
+        if(c != 'u') return 3;
+        long cp = json_hex4(f);
+        if(cp < 0) return 3;
+        // a surrogate pair
+        if(cp >= 0xd800 && cp < 0xdc00){
+            if(getc_unlocked(f) != '\\' || getc_unlocked(f) != 'u') return 3;
+            long lo = json_hex4(f);
+            if(lo < 0xdc00 || lo >= 0xe000) return 3;
+            cp = 0x10000 + ((cp - 0xd800) << 10) + (lo - 0xdc00);
+        }
+        if(utf8_put(sb, (unsigned long)cp)) return 1;
+    }
+    return 0;
+}
+
+/* a streaming scan of the JSON: the fields of each object are collected as
+   they go by, and an object with the fields of a message is a message.  It
+   doesn't care what the objects are nested in */
+static int import_json(FILE* f, fields_t* fl){
+    strbuf_t sb = {0};
+    int key = -1;
+    bool want_key = false;
+    // whether each open container is an object
+    bool is_obj[256];
+    size_t depth = 0;
+    int retval = -1;
+
+    int c;
+    while( (c = getc_unlocked(f)) != EOF ){
+        switch(c){
+        case '{':
+        case '[':
+            if(depth == sizeof(is_obj)) FAIL(1);
+            is_obj[depth++] = c == '{';
+            want_key = c == '{';
+            fields_clear(fl);
+            break;
+        case '}':
+        case ']':
+            if(!depth || is_obj[depth - 1] != (c == '}')) FAIL(2);
+            depth--;
+            if(c == '}' && fl->have[F_DATE]){
+                if(import_record(fl)) FAIL(3);
+                fields_clear(fl);
+            }
+            want_key = false;
+            break;
+        case ',':
+            want_key = depth && is_obj[depth - 1];
+            break;
+        case ':':
+            break;
+        case '"':
+            if(json_string(f, &sb)) FAIL(4);
+            if(want_key){
+                key = field_index(sb.s);
+                want_key = false;
+            }else if(key >= 0){
+                fields_set(fl, key, &sb);
+                key = -1;
+            }
+            break;
+        default:
+            if(isspace(c)) break;
+            // a number, true, false or null
+            sb.len = 0;
+            while(c != EOF && !strchr(",}] \t\r\n", c)){
+                if(sb_put(&sb, (char)c)) FAIL(5);
+                c = getc_unlocked(f);
+            }
+            if(c != EOF) ungetc(c, f);
+            if(!want_key && key >= 0 && sb.len
+                    && strcmp(sb.s, "null") != 0){
+                fields_set(fl, key, &sb);
+            }
+            key = -1;
+            break;
+        }
+    }
+    if(depth) FAIL(6);
+
+    retval = 0;
+
+fail:
+    if(retval > 0 && retval != 3){
+        fprintf(stderr, "import: bad JSON (error %d)\n", retval);
+    }
+    if(sb.s) free(sb.s);
+    return retval;
+}
+
+static int import_file(const char* path){
+    FILE* f = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+    if(!f){
+        perror(path);
+        return 1;
+    }
+    fields_t fl = {0};
+    // skip a byte order mark; JSON starts with an object or an array
+    int c;
+    while( (c = getc_unlocked(f)) != EOF && (isspace(c) || c == 0xef
+            || c == 0xbb || c == 0xbf) ){}
+    if(c != EOF) ungetc(c, f);
+    int ret = c == '{' || c == '[' ? import_json(f, &fl) : import_csv(f, &fl);
+    fields_free(&fl);
+    if(f != stdin) fclose(f);
+    if(ret) fprintf(stderr, "import: failed to read %s\n", path);
+    return ret;
+}
+
+
+/* the merge: the runs and whatever is left in the arena are each sorted, so
+   a heap of them gives every record in order */
+typedef struct {
+    // a run, or the arena when f is NULL
+    FILE* f;
+    size_t i;
+    rec_t* rec;
+    size_t cap;
+} source_t;
+
+static struct {
+    source_t* srcs;
+    size_t n;
+    // a heap of indexes into srcs
+    size_t* heap;
+    size_t len;
+    // the source of the record merge_next() returned last, or -1
+    size_t prev;
+} merge = { .prev = (size_t)-1 };
+
+// the next record from a source; 0, 1 at the end, or an error
+static int source_next(source_t* s){
+    if(!s->f){
+        if(s->i == spool.n) return 1;
+        s->rec = spool.recs[s->i++];
+        return 0;
+    }
+    rec_t hdr;
+    if(fread(&hdr, REC_SIZE(0), 1, s->f) != 1) return ferror(s->f) ? 2 : 1;
+    if(REC_SIZE(hdr.len) + 1 > s->cap){
+        size_t cap = REC_SIZE(hdr.len) + 1;
+        if(cap < 1024) cap = 1024;
+        void* mem = s->cap ? realloc(s->rec, cap) : malloc(cap);
+        if(!mem) return 3;
+        s->rec = mem;
+        s->cap = cap;
+    }
+    memcpy(s->rec, &hdr, REC_SIZE(0));
+    if(hdr.len && fread(s->rec->body, hdr.len, 1, s->f) != 1) return 2;
+    s->rec->body[hdr.len] = '\0';
+    return 0;
+}
+
+static bool src_less(size_t a, size_t b){
+    return rec_cmp(merge.srcs[a].rec, merge.srcs[b].rec) < 0;
+}
+
+static void heap_down(size_t i){
+    while(true){
+        size_t l = 2 * i + 1, r = l + 1, min = i;
+        if(l < merge.len && src_less(merge.heap[l], merge.heap[min])) min = l;
+        if(r < merge.len && src_less(merge.heap[r], merge.heap[min])) min = r;
+        if(min == i) return;
+        size_t tmp = merge.heap[i];
+        merge.heap[i] = merge.heap[min];
+        merge.heap[min] = tmp;
+        i = min;
+    }
+}
+
+static int merge_start(void){
+    // the arena is the last run, and doesn't need to be written out
+    qsort(spool.recs, spool.n, sizeof(*spool.recs), rec_qsort_cmp);
+    merge.srcs = calloc(spool.nruns + 1, sizeof(*merge.srcs));
+    merge.heap = calloc(spool.nruns + 1, sizeof(*merge.heap));
+    if(!merge.srcs || !merge.heap) return 1;
+    merge.n = spool.nruns + 1;
+    for(size_t i = 0; i < merge.n; i++){
+        merge.srcs[i].f = i < spool.nruns ? spool.runs[i] : NULL;
+        int ret = source_next(&merge.srcs[i]);
+        if(ret > 1) return ret;
+        if(ret == 0) merge.heap[merge.len++] = i;
+    }
+    for(size_t i = merge.len; i-- > 0;) heap_down(i);
+    return 0;
+}
+
+/* the next record in order; 0, 1 at the end, or an error.  It's valid until
+   the next call */
+static int merge_next(rec_t** out){
+    // advance the source of the last record now that it's been used
+    if(merge.prev != (size_t)-1){
+        int ret = source_next(&merge.srcs[merge.prev]);
+        if(ret > 1) return ret;
+        if(ret == 1) merge.heap[0] = merge.heap[--merge.len];
+        heap_down(0);
+        merge.prev = (size_t)-1;
+    }
+    if(!merge.len) return 1;
+    merge.prev = merge.heap[0];
+    *out = merge.srcs[merge.prev].rec;
+    return 0;
+}
+
+static void merge_free(void){
+    for(size_t i = 0; i < merge.n; i++){
+        if(merge.srcs[i].f && merge.srcs[i].cap) free(merge.srcs[i].rec);
+    }
+    if(merge.srcs) free(merge.srcs);
+    if(merge.heap) free(merge.heap);
+    memset(&merge, 0, sizeof(merge));
+    merge.prev = (size_t)-1;
+}
+
+
+/* a conversation already in the history, by uri */
+typedef struct {
+    const sip_uri_t* uri;
+    time_t last;
+} existing_t;
+
+static existing_t* existing;
+static size_t nexisting;
+
+static int existing_cmp(const void* a, const void* b){
+    const sip_uri_t* x = ((const existing_t*)a)->uri;
+    const sip_uri_t* y = ((const existing_t*)b)->uri;
+    return x < y ? -1 : x > y;
+}
+
+static int existing_load(void){
+    hist_buf_t* hist = NULL;
+    int ret = list_hist_bufs(wc_dir, shard, &hist);
+    if(ret) return ret;
+    for(hist_buf_t* p = hist; p; p = p->next) nexisting++;
+    existing = calloc(nexisting + 1, sizeof(*existing));
+    if(!existing){
+        free_hist_buf(hist);
+        return 1;
+    }
+    size_t i = 0;
+    for(hist_buf_t* p = hist; p; p = p->next){
+        // keep the name it has; sip_uri_filename() remembers it
+        sip_uri_t* uri = sip_uri_intern(p->sip_uri, strlen(p->sip_uri));
+        if(!uri || !sip_uri_filename(uri, p->name)){
+            free_hist_buf(hist);
+            return 1;
+        }
+        existing[i++] = (existing_t){ .uri = uri, .last = p->last };
+    }
+    free_hist_buf(hist);
+    qsort(existing, nexisting, sizeof(*existing), existing_cmp);
+    return 0;
+}
+
+static const existing_t* existing_find(const sip_uri_t* uri){
+    existing_t key = { .uri = uri };
+    return bsearch(&key, existing, nexisting, sizeof(*existing),
+                   existing_cmp);
+}
+
+
+/* a message from the history, kept while it's close enough in time to the
+   imported messages to be one of them */
+typedef struct {
+    time_t t;
+    bool me;
+    bool matched;
+    size_t len;
+    char* msg;
+} seen_t;
+
+// importing one conversation
+static struct {
+    sip_uri_t* uri;
+    const char* fname;
+    const existing_t* old;
+    // the history, for finding duplicates
+    hist_reader_t* dedup;
+    bool dedup_end;
+    seen_t* win;
+    size_t head;
+    size_t n;
+    size_t max;
+    // the history again, when it's being copied into a replacement
+    hist_reader_t* copy;
+    hist_msg_t* copy_msg;
+    hist_writer_t* w;
+} conv;
+
+static int win_push(hist_msg_t* m){
+    if(conv.n == conv.max){
+        // reuse the space of messages which have been dropped
+        if(conv.head){
+            for(size_t i = 0; i < conv.head; i++) free(conv.win[i].msg);
+            memmove(conv.win, conv.win + conv.head,
+                    (conv.n - conv.head) * sizeof(*conv.win));
+            conv.n -= conv.head;
+            conv.head = 0;
+        }
+        if(conv.n == conv.max){
+            size_t max = conv.max ? 2 * conv.max : 64;
+            seen_t* win = realloc(conv.win, max * sizeof(*win));
+            if(!win) return 1;
+            conv.win = win;
+            conv.max = max;
+        }
+    }
+    char* msg = malloc(m->len + 1);
+    if(!msg) return 1;
+    memcpy(msg, m->msg, m->len + 1);
+    conv.win[conv.n++] = (seen_t){ .t = m->time, .me = m->me, .len = m->len,
+                                   .msg = msg };
+    return 0;
+}
+
+// is r already in the history?
+static int conv_is_dup(const rec_t* r, bool* dup){
+    *dup = false;
+    if(!conv.dedup) return 0;
+    // read until past the slop
+    while(!conv.dedup_end && (conv.head == conv.n
+            || conv.win[conv.n - 1].t <= r->t + IMPORT_SLOP)){
+        hist_msg_t* m;
+        int ret = hist_reader_next(conv.dedup, &m);
+        if(ret == 1){
+            conv.dedup_end = true;
+            break;
+        }
+        if(ret) return ret;
+        if(win_push(m)) return 1;
+    }
+    // forget what's too old to match
+    while(conv.head < conv.n && conv.win[conv.head].t < r->t - IMPORT_SLOP){
+        free(conv.win[conv.head].msg);
+        conv.win[conv.head++].msg = NULL;
+    }
+    for(size_t i = conv.head; i < conv.n; i++){
+        seen_t* s = &conv.win[i];
+        if(s->t > r->t + IMPORT_SLOP) break;
+        if(s->matched || s->me != r->me || s->len != r->len) continue;
+        if(memcmp(s->msg, r->body, r->len) != 0) continue;
+        // each message in the history only matches one imported message
+        s->matched = true;
+        *dup = true;
+        break;
+    }
+    return 0;
+}
+
+// copy the history into a replacement, up to time t
+static int conv_copy_until(time_t t){
+    while(conv.copy_msg && conv.copy_msg->time <= t){
+        hist_msg_t* m = conv.copy_msg;
+        if(hist_writer_add(conv.w, m->msg, m->len, m->me, m->time)) return 1;
+        int ret = hist_reader_next(conv.copy, &conv.copy_msg);
+        if(ret == 1) conv.copy_msg = NULL;
+        else if(ret) return ret;
+    }
+    return 0;
+}
+
+static int conv_start(sip_uri_t* uri){
+    conv.uri = uri;
+    conv.old = existing_find(uri);
+    conv.fname = conv.old ? uri->filename : sip_uri_filename(uri, uri->number);
+    if(!conv.fname) return 1;
+    if(conv.old){
+        int ret = hist_reader_open(wc_dir, shard, conv.fname, 0, &conv.dedup);
+        if(ret) return ret;
+    }
+    stats.convs++;
+    return 0;
+}
+
+static int conv_add(const rec_t* r){
+    bool dup;
+    int ret = conv_is_dup(r, &dup);
+    if(ret) return ret;
+    if(dup){
+        stats.dups++;
+        return 0;
+    }
+    if(!conv.w){
+        // older than what's there already means rewriting it in order
+        bool replace = conv.old && r->t < conv.old->last;
+        ret = hist_writer_open(wc_dir, shard, conv.fname, replace, &conv.w);
+        if(ret) return ret;
+        if(replace){
+            stats.rewritten++;
+            ret = hist_reader_open(wc_dir, shard, conv.fname, 0, &conv.copy);
+            if(ret) return ret;
+            ret = hist_reader_next(conv.copy, &conv.copy_msg);
+            if(ret == 1) conv.copy_msg = NULL;
+            else if(ret) return ret;
+        }
+    }
+    if(conv.copy && conv_copy_until(r->t)) return 1;
+    if(hist_writer_add(conv.w, r->body, r->len, r->me, r->t)) return 1;
+    stats.added++;
+    return 0;
+}
+
+static int conv_end(void){
+    int retval = 0;
+    if(conv.copy && conv_copy_until((time_t)INT64_MAX)) retval = 1;
+    // the readers have to be done before a replacement takes over
+    if(conv.copy) hist_reader_close(conv.copy);
+    if(conv.dedup) hist_reader_close(conv.dedup);
+    if(conv.w && hist_writer_close(conv.w)) retval = 2;
+    for(size_t i = conv.head; i < conv.n; i++) free(conv.win[i].msg);
+    seen_t* win = conv.win;
+    size_t max = conv.max;
+    memset(&conv, 0, sizeof(conv));
+    conv.win = win;
+    conv.max = max;
+    return retval;
+}
+
+static int import_merged(void){
+    rec_t* r;
+    rec_t* prev = NULL;
+    size_t since_commit = 0;
+    int retval = -1;
+    int ret;
+
+    // the previous record, to drop exact repeats (e.g. overlapping exports)
+    size_t prev_cap = 0;
+
+    if(hist_begin(wc_dir, shard)) FAIL(1);
+    while( (ret = merge_next(&r)) == 0 ){
+        if(prev && prev->uri == r->uri && prev->t == r->t
+                && prev->me == r->me && prev->len == r->len
+                && memcmp(prev->body, r->body, r->len) == 0){
+            stats.repeated++;
+            continue;
+        }
+        if(!prev || prev->uri != r->uri){
+            if(prev && conv_end()) FAIL(2);
+            // a good place for a commit
+            if(since_commit >= IMPORT_COMMIT){
+                if(hist_commit(wc_dir, shard)) FAIL(3);
+                if(hist_begin(wc_dir, shard)) FAIL(1);
+                since_commit = 0;
+            }
+            if(conv_start(r->uri)) FAIL(4);
+        }
+        if(conv_add(r)) FAIL(5);
+        since_commit++;
+
+        size_t size = REC_SIZE(r->len) + 1;
+        if(size > prev_cap){
+            rec_t* p = realloc(prev, size);
+            if(!p) FAIL(6);
+            prev = p;
+            prev_cap = size;
+        }
+        memcpy(prev, r, size);
+    }
+    if(ret != 1) FAIL(7);
+    if(prev && conv_end()) FAIL(2);
+    if(hist_commit(wc_dir, shard)) FAIL(3);
+
+    retval = 0;
+
+fail:
+    if(retval){
+        conv_end();
+        hist_commit(wc_dir, shard);
+    }
+    if(conv.win) free(conv.win);
+    memset(&conv, 0, sizeof(conv));
+    if(prev) free(prev);
+    return retval;
+}
+
+int import_files(const import_opts_t* opts, const char* const* paths,
+                 size_t npaths, import_stats_t* out){
+    int retval = -1;
+    wc_dir = opts->wc_dir;
+    shard = opts->shard;
+    realm = opts->realm;
+    only_did_len = opts->did ? norm_number(opts->did, only_did,
+                                           sizeof(only_did)) : 0;
+    memset(&stats, 0, sizeof(stats));
+
+    if(existing_load()){
+        fprintf(stderr, "import: unable to list the history in %s\n", wc_dir);
+        FAIL(1);
+    }
+    spool.size = opts->batch;
+    spool.arena = malloc(spool.size);
+    if(!spool.arena){
+        perror("malloc");
+        FAIL(2);
+    }
+    for(size_t i = 0; i < npaths; i++){
+        if(import_file(paths[i])) FAIL(3);
+    }
+    if(merge_start()){
+        fprintf(stderr, "import: unable to merge the batches\n");
+        FAIL(4);
+    }
+    if(import_merged()){
+        fprintf(stderr, "import: unable to write the history\n");
+        FAIL(5);
+    }
+
+    retval = 0;
+
+fail:
+    merge_free();
+    spool_free();
+    if(existing) free(existing);
+    existing = NULL;
+    nexisting = 0;
+    if(out) *out = stats;
+    return retval;
+}
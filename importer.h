@@ -0,0 +1,53 @@
+#ifndef IMPORTER_H
+#define IMPORTER_H
+
+#include <stddef.h>
+
+/* Importing VoIP.ms sms exports into the history (for ./import).  Exports
+   are CSV (with a header line naming the date, type, did, contact and
+   message columns) or JSON (the getSMS response, or any objects with those
+   fields).  Dates are read in the local timezone (TZ).
+
+   The exports are read once, a batch at a time.  Each batch is sorted by
+   conversation and time and, unless it's the last one, spilled to a
+   temporary file; the batches are then merged, so each conversation is
+   written once, in time order, whatever the size of the exports.  Messages
+   which are already in the history (within IMPORT_SLOP seconds, since the
+   history has the time they were seen rather than the provider's) are
+   skipped, and so are exact repeats within the exports. */
+
+// how far apart the same message's times may be in the history and export
+#define IMPORT_SLOP 300
+
+typedef struct {
+    const char* wc_dir;
+    // the account's history shard, or NULL
+    const char* shard;
+    // for the sip uris of the contacts
+    const char* realm;
+    // only import messages to or from this DID, if it isn't NULL
+    const char* did;
+    // bytes of messages per batch
+    size_t batch;
+} import_opts_t;
+
+typedef struct {
+    size_t read;
+    size_t bad;
+    size_t filtered;
+    size_t repeated;
+    size_t dups;
+    size_t added;
+    size_t convs;
+    size_t rewritten;
+    // batches spilled to temporary files (all but the last)
+    size_t runs;
+} import_stats_t;
+
+/* import every export in paths ("-" is stdin), with the history backend in
+   use; returns 0 on success.  What was done goes in *stats, if it isn't
+   NULL.  The uris are interned, so they last until sip_uri_free_all() */
+int import_files(const import_opts_t* opts, const char* const* paths,
+                 size_t npaths, import_stats_t* stats);
+
+#endif // IMPORTER_H
@@ -0,0 +1,331 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "latency.h"
+#include "voipms.h"
+#include "accounts.h"
+
+// defaults for the settings in config.h
+#ifndef LATENCY_WINDOW
+#define LATENCY_WINDOW 1000
+#endif
+// answers kept per destination
+#ifndef LATENCY_DEST_WINDOW
+#define LATENCY_DEST_WINDOW 100
+#endif
+// how much of the end of voipms/latency to load at startup
+#define LATENCY_LOAD_BYTES (256 * 1024)
+// destinations shown by /sms -latency without a number
+#define LATENCY_SHOW 10
+
+#define LATENCY_NAME "latency"
+
+// a MESSAGE waiting for its answer
+typedef struct latency_req_t {
+    size_t acct;
+    const sip_uri_t* uri;
+    void* token;
+    // wall clock milliseconds, and monotonic microseconds
+    int64_t submit_ms;
+    int64_t submit_us;
+    struct latency_req_t *prev, *next;
+} latency_req_t;
+
+// the last answers, in a ring
+typedef struct {
+    uint32_t* ms;
+    size_t cap;
+    size_t len;
+    size_t next;
+    // every answer, and the ones which weren't 2xx
+    size_t answers;
+    size_t failures;
+} latency_ring_t;
+
+// one destination's answers
+typedef struct latency_dest_t {
+    const sip_uri_t* uri;
+    latency_ring_t ring;
+    struct latency_dest_t* next;
+} latency_dest_t;
+
+struct latency {
+    // pager_status_cb() may run on a pjsip thread
+    pthread_mutex_t lock;
+    latency_req_t* pending;
+    latency_ring_t all;
+    // destinations, hashed by their (interned) uri
+    latency_dest_t** dests;
+    size_t ndests;
+    size_t nbuckets;
+    char* path;
+};
+
+struct latency latency = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+// the time on clock, in 1/per_sec second units
+static int64_t clock_now(clockid_t clock, int64_t per_sec){
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (int64_t)ts.tv_sec * per_sec + ts.tv_nsec / (1000000000 / per_sec);
+}
+
+static int ring_add(latency_ring_t* r, size_t cap, uint32_t ms, int status){
+    if(!r->ms){
+        r->ms = malloc(cap * sizeof(*r->ms));
+        if(!r->ms) return 1;
+        r->cap = cap;
+    }
+    r->ms[r->next] = ms;
+    r->next = (r->next + 1) % r->cap;
+    if(r->len < r->cap) r->len++;
+    r->answers++;
+    if(status / 100 != 2) r->failures++;
+    return 0;
+}
+
+static latency_dest_t* dest_get(const sip_uri_t* uri){
+    if(latency.nbuckets){
+        latency_dest_t* d = latency.dests[uri->hash & (latency.nbuckets - 1)];
+        for(; d; d = d->next){
+            if(d->uri == uri) return d;
+        }
+    }
+    // grow the table once it's as full as it is long
+    if(latency.ndests >= latency.nbuckets){
+        size_t n = latency.nbuckets ? 2 * latency.nbuckets : 64;
+        latency_dest_t** dests = calloc(n, sizeof(*dests));
+        if(!dests) return NULL;
+        for(size_t i = 0; i < latency.nbuckets; i++){
+            latency_dest_t *d, *next = latency.dests[i];
+            while( (d = next) ){
+                next = d->next;
+                d->next = dests[d->uri->hash & (n - 1)];
+                dests[d->uri->hash & (n - 1)] = d;
+            }
+        }
+        if(latency.dests) free(latency.dests);
+        latency.dests = dests;
+        latency.nbuckets = n;
+    }
+    latency_dest_t* d = calloc(1, sizeof(*d));
+    if(!d) return NULL;
+    d->uri = uri;
+    size_t b = uri->hash & (latency.nbuckets - 1);
+    d->next = latency.dests[b];
+    latency.dests[b] = d;
+    latency.ndests++;
+    return d;
+}
+
+// add an answer to the windows; call with the lock held
+static void latency_add(const sip_uri_t* uri, uint32_t ms, int status){
+    ring_add(&latency.all, LATENCY_WINDOW, ms, status);
+    latency_dest_t* d = dest_get(uri);
+    if(d) ring_add(&d->ring, LATENCY_DEST_WINDOW, ms, status);
+}
+
+// seed the windows with the end of the file
+static void latency_load(void){
+    FILE* f = fopen(latency.path, "r");
+    if(!f) return;
+    struct stat st;
+    if(fstat(fileno(f), &st) == 0 && st.st_size > LATENCY_LOAD_BYTES){
+        fseek(f, st.st_size - LATENCY_LOAD_BYTES, SEEK_SET);
+        // skip what's left of the line we landed in
+        int c;
+        while( (c = getc(f)) != EOF && c != '\n' );
+    }
+    char line[1024];
+    while(fgets(line, sizeof(line), f)){
+        char* p = line;
+        long long submit = strtoll(p, &p, 10);
+        if(*p++ != ':') continue;
+        long status = strtol(p, &p, 10);
+        if(*p++ != ':') continue;
+        unsigned long ms = strtoul(p, &p, 10);
+        if(*p++ != ':') continue;
+        size_t llen = strtoul(p, &p, 10);
+        if(*p++ != ':') continue;
+        size_t ulen = strtoul(p, &p, 10);
+        if(*p++ != ':') continue;
+        if(strlen(p) < llen + ulen || submit <= 0) continue;
+        sip_uri_t* uri = sip_uri_intern(p + llen, ulen);
+        if(uri) latency_add(uri, (uint32_t)ms, (int)status);
+    }
+    fclose(f);
+}
+
+int latency_start(void){
+    size_t len = strlen(wc_dir) + sizeof("/voipms/" LATENCY_NAME);
+    latency.path = malloc(len);
+    if(!latency.path) return 1;
+    snprintf(latency.path, len, "%s/voipms", wc_dir);
+    mkdir(latency.path, 0777);
+    snprintf(latency.path, len, "%s/voipms/" LATENCY_NAME, wc_dir);
+    latency_load();
+    return 0;
+}
+
+void* latency_submit(size_t acct, const sip_uri_t* uri, void* token){
+    latency_req_t* req = malloc(sizeof(*req));
+    if(!req) return NULL;
+    *req = (latency_req_t){ .acct = acct, .uri = uri, .token = token,
+                            .submit_ms = clock_now(CLOCK_REALTIME, 1000),
+                            .submit_us = clock_now(CLOCK_MONOTONIC, 1000000) };
+    pthread_mutex_lock(&latency.lock);
+    req->next = latency.pending;
+    if(req->next) req->next->prev = req;
+    latency.pending = req;
+    pthread_mutex_unlock(&latency.lock);
+    return req;
+}
+
+// take req out of the pending list, returning its token; call with the lock
+static void* latency_unlink(latency_req_t* req){
+    if(req->prev) req->prev->next = req->next;
+    else latency.pending = req->next;
+    if(req->next) req->next->prev = req->prev;
+    void* token = req->token;
+    free(req);
+    return token;
+}
+
+void* latency_done(void* p, int status){
+    latency_req_t* req = p;
+    int64_t us = clock_now(CLOCK_MONOTONIC, 1000000) - req->submit_us;
+    uint32_t ms = (uint32_t)((us + 500) / 1000);
+
+    pthread_mutex_lock(&latency.lock);
+    latency_add(req->uri, ms, status);
+    if(latency.path){
+        FILE* f = fopen(latency.path, "a");
+        if(f){
+            const char* label = voip_accounts[req->acct].label;
+            fprintf(f, "%lld:%d:%lu:%zu:%zu:%s%.*s\n",
+                    (long long)req->submit_ms, status, (unsigned long)ms,
+                    strlen(label), req->uri->len, label,
+                    (int)req->uri->len, req->uri->str);
+            fclose(f);
+        }
+    }
+    void* token = latency_unlink(req);
+    pthread_mutex_unlock(&latency.lock);
+    return token;
+}
+
+void* latency_cancel(void* p){
+    pthread_mutex_lock(&latency.lock);
+    void* token = latency_unlink(p);
+    pthread_mutex_unlock(&latency.lock);
+    return token;
+}
+
+static int cmp_u32(const void* a, const void* b){
+    uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+    return (x > y) - (x < y);
+}
+
+typedef struct {
+    uint32_t p50, p95, p99;
+} latency_pct_t;
+
+// nearest-rank percentiles of a ring; call with the lock held
+static latency_pct_t ring_pct(const latency_ring_t* r){
+    latency_pct_t pct = {0, 0, 0};
+    if(!r->len) return pct;
+    uint32_t* sorted = malloc(r->len * sizeof(*sorted));
+    if(!sorted) return pct;
+    memcpy(sorted, r->ms, r->len * sizeof(*sorted));
+    qsort(sorted, r->len, sizeof(*sorted), cmp_u32);
+    pct.p50 = sorted[(r->len * 50 + 99) / 100 - 1];
+    pct.p95 = sorted[(r->len * 95 + 99) / 100 - 1];
+    pct.p99 = sorted[(r->len * 99 + 99) / 100 - 1];
+    free(sorted);
+    return pct;
+}
+
+static void print_ring(struct t_gui_buffer* buffer, const char* what,
+                       const latency_ring_t* r, latency_pct_t pct){
+    weechat_printf(buffer, "voipms: %s: p50 %ums p95 %ums p99 %ums "
+                   "(last %zu of %zu answers, %zu failed)", what,
+                   pct.p50, pct.p95, pct.p99, r->len, r->answers,
+                   r->failures);
+}
+
+typedef struct {
+    const latency_dest_t* dest;
+    latency_pct_t pct;
+} latency_row_t;
+
+static int cmp_row(const void* a, const void* b){
+    const latency_row_t *x = a, *y = b;
+    return (x->pct.p95 < y->pct.p95) - (x->pct.p95 > y->pct.p95);
+}
+
+void latency_print(struct t_gui_buffer* buffer, const sip_uri_t* uri){
+    pthread_mutex_lock(&latency.lock);
+    if(uri){
+        latency_dest_t* d = NULL;
+        if(latency.nbuckets){
+            d = latency.dests[uri->hash & (latency.nbuckets - 1)];
+            while(d && d->uri != uri) d = d->next;
+        }
+        if(d) print_ring(buffer, uri->number, &d->ring, ring_pct(&d->ring));
+        else weechat_printf(buffer, "voipms: no answers from %s yet",
+                            uri->number);
+        pthread_mutex_unlock(&latency.lock);
+        return;
+    }
+
+    if(!latency.all.len){
+        weechat_printf(buffer, "voipms: no answers yet");
+        pthread_mutex_unlock(&latency.lock);
+        return;
+    }
+    print_ring(buffer, "overall", &latency.all, ring_pct(&latency.all));
+    // then the slowest destinations
+    latency_row_t* rows = malloc(latency.ndests * sizeof(*rows));
+    size_t n = 0;
+    for(size_t i = 0; rows && i < latency.nbuckets; i++){
+        for(latency_dest_t* d = latency.dests[i]; d; d = d->next){
+            rows[n++] = (latency_row_t){ d, ring_pct(&d->ring) };
+        }
+    }
+    if(rows){
+        qsort(rows, n, sizeof(*rows), cmp_row);
+        for(size_t i = 0; i < n && i < LATENCY_SHOW; i++){
+            print_ring(buffer, rows[i].dest->uri->number, &rows[i].dest->ring,
+                       rows[i].pct);
+        }
+        free(rows);
+    }
+    pthread_mutex_unlock(&latency.lock);
+}
+
+void latency_stop(void){
+    pthread_mutex_lock(&latency.lock);
+    while(latency.pending) latency_unlink(latency.pending);
+    for(size_t i = 0; i < latency.nbuckets; i++){
+        latency_dest_t *d, *next = latency.dests[i];
+        while( (d = next) ){
+            next = d->next;
+            if(d->ring.ms) free(d->ring.ms);
+            free(d);
+        }
+    }
+    if(latency.dests) free(latency.dests);
+    latency.dests = NULL;
+    latency.ndests = 0;
+    latency.nbuckets = 0;
+    if(latency.all.ms) free(latency.all.ms);
+    latency.all = (latency_ring_t){0};
+    if(latency.path) free(latency.path);
+    latency.path = NULL;
+    pthread_mutex_unlock(&latency.lock);
+}
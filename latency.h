@@ -0,0 +1,36 @@
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <stddef.h>
+
+#include <weechat/weechat-plugin.h>
+
+#include "uri.h"
+
+/* How long the server takes to answer the MESSAGEs we send.  Each answer is
+   appended to voipms/latency:
+       submit_time_ms:status:response_ms:label_len:uri_len:<label><uri>\n
+   and kept in a rolling window, overall and per destination, for
+   /sms -latency. */
+
+// load the last answers from voipms/latency; returns 0 on success
+int latency_start(void);
+
+/* a MESSAGE to uri is about to be sent: returns what to give pjsip as its
+   user data (wrapping token), or NULL if out of memory */
+void* latency_submit(size_t acct, const sip_uri_t* uri, void* token);
+
+// the MESSAGE was answered with status: record it, and return its token
+void* latency_done(void* req, int status);
+
+// the MESSAGE couldn't be sent after all: forget it, and return its token
+void* latency_cancel(void* req);
+
+/* print p50/p95/p99 to buffer, for one destination if uri isn't NULL, or
+   overall and for the slowest destinations otherwise */
+void latency_print(struct t_gui_buffer* buffer, const sip_uri_t* uri);
+
+// once pjsip can't answer any more MESSAGEs (on plugin unload)
+void latency_stop(void);
+
+#endif // LATENCY_H
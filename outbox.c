@@ -0,0 +1,227 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "outbox.h"
+#include "voipms.h"
+#include "sip_client.h"
+#include "accounts.h"
+
+/* the outbox file is a list of records like the history's:
+       queued_time:label_len:uri_len:msg_len:<label><uri><msg>\n
+   New messages are appended to it, and it's rewritten when messages are
+   sent */
+#define OUTBOX_NAME "outbox"
+
+typedef struct outbox_msg_t {
+    size_t acct;
+    sip_uri_t* uri;
+    time_t queued;
+    // a fan-out recipient waiting for the answer
+    void* token;
+    size_t len;
+    struct outbox_msg_t* next;
+    char msg[];
+} outbox_msg_t;
+
+static struct {
+    outbox_msg_t* head;
+    outbox_msg_t** tail;
+    char* path;
+} outbox = { .tail = &outbox.head };
+
+static void outbox_free(void){
+    outbox_msg_t *m, *next = outbox.head;
+    while( (m = next) ){
+        next = m->next;
+        free(m);
+    }
+    outbox.head = NULL;
+    outbox.tail = &outbox.head;
+}
+
+static int outbox_write(FILE* f, const outbox_msg_t* m){
+    const char* label = voip_accounts[m->acct].label;
+    size_t llen = strlen(label);
+    if(fprintf(f, "%ld:%zu:%zu:%zu:", (long)m->queued, llen, m->uri->len,
+               m->len) < 0) return 1;
+    if(fwrite(label, 1, llen, f) != llen) return 1;
+    if(fwrite(m->uri->str, 1, m->uri->len, f) != m->uri->len) return 1;
+    if(fwrite(m->msg, 1, m->len, f) != m->len) return 1;
+    return fputc('\n', f) == EOF;
+}
+
+// rewrite the file with what's still queued
+static int outbox_save(void){
+    if(!outbox.head){
+        unlink(outbox.path);
+        return 0;
+    }
+    size_t len = strlen(outbox.path) + 5;
+    char* tmp = malloc(len);
+    if(!tmp) return 1;
+    snprintf(tmp, len, "%s.tmp", outbox.path);
+    int retval = 1;
+    FILE* f = fopen(tmp, "w");
+    if(!f) goto done;
+    for(outbox_msg_t* m = outbox.head; m; m = m->next){
+        if(outbox_write(f, m)){
+            fclose(f);
+            unlink(tmp);
+            goto done;
+        }
+    }
+    if(fclose(f) || rename(tmp, outbox.path)){
+        unlink(tmp);
+        goto done;
+    }
+    retval = 0;
+done:
+    free(tmp);
+    return retval;
+}
+
+static outbox_msg_t* outbox_new(size_t acct, sip_uri_t* uri, const char* msg,
+                                size_t len, time_t queued, void* token){
+    outbox_msg_t* m = malloc(sizeof(*m) + len + 1);
+    if(!m) return NULL;
+    *m = (outbox_msg_t){ .acct = acct, .uri = uri, .queued = queued,
+                         .token = token, .len = len };
+    memcpy(m->msg, msg, len);
+    m->msg[len] = '\0';
+    *outbox.tail = m;
+    outbox.tail = &m->next;
+    return m;
+}
+
+// parse the records in mem; a corrupt tail is ignored
+static void outbox_parse(const char* mem, size_t mlen){
+    const char* c = mem;
+    const char* end = mem + mlen;
+    while(c < end){
+        char* p;
+        long queued = strtol(c, &p, 10);
+        size_t lens[3];
+        for(int i = 0; i < 3; i++){
+            if(p >= end || *p != ':') return;
+            lens[i] = strtoul(p + 1, &p, 10);
+        }
+        if(p >= end || *p != ':') return;
+        p++;
+        size_t total = lens[0] + lens[1] + lens[2];
+        if((size_t)(end - p) < total + 1 || p[total] != '\n') return;
+
+        char label[256];
+        if(lens[0] >= sizeof(label)) return;
+        memcpy(label, p, lens[0]);
+        label[lens[0]] = '\0';
+        int acct = voip_account_find(label);
+        sip_uri_t* uri = sip_uri_intern(p + lens[0], lens[1]);
+        if(acct < 0){
+            if(voip_buffer){
+                weechat_printf(voip_buffer, "voipms: dropping a queued "
+                               "message for unknown account \"%s\"", label);
+            }
+        }else if(uri){
+            outbox_new((size_t)acct, uri, p + lens[0] + lens[1], lens[2],
+                       (time_t)queued, NULL);
+        }
+        c = p + total + 1;
+    }
+}
+
+int outbox_start(void){
+    outbox_free();
+    size_t len = strlen(wc_dir) + sizeof("/voipms/" OUTBOX_NAME);
+    outbox.path = malloc(len);
+    if(!outbox.path) return 1;
+    // attempt to make the directory, ignoring errors
+    snprintf(outbox.path, len, "%s/voipms", wc_dir);
+    mkdir(outbox.path, 0777);
+    snprintf(outbox.path, len, "%s/voipms/" OUTBOX_NAME, wc_dir);
+
+    FILE* f = fopen(outbox.path, "r");
+    if(!f) return 0;
+    char* mem = NULL;
+    size_t mlen = 0, cap = 0;
+    char chunk[4096];
+    size_t n;
+    int retval = 0;
+    while( (n = fread(chunk, 1, sizeof(chunk), f)) ){
+        if(mlen + n > cap){
+            cap = 2 * (mlen + n);
+            char* new = realloc(mem, cap);
+            if(!new){
+                retval = 1;
+                break;
+            }
+            mem = new;
+        }
+        memcpy(mem + mlen, chunk, n);
+        mlen += n;
+    }
+    fclose(f);
+    if(!retval) outbox_parse(mem, mlen);
+    if(mem) free(mem);
+
+    size_t count = 0;
+    for(outbox_msg_t* m = outbox.head; m; m = m->next) count++;
+    if(count && voip_buffer){
+        weechat_printf(voip_buffer, "voipms: %zu queued messages will be "
+                       "sent once registered", count);
+    }
+    return retval;
+}
+
+int outbox_add(size_t acct, sip_uri_t* uri, const char* msg, void* token){
+    if(!outbox.path) return 1;
+    outbox_msg_t* m = outbox_new(acct, uri, msg, strlen(msg), time(NULL),
+                                 token);
+    if(!m) return 1;
+    // not being able to save it only matters if we're restarted
+    FILE* f = fopen(outbox.path, "a");
+    if(f){
+        outbox_write(f, m);
+        fclose(f);
+    }
+    return 0;
+}
+
+bool outbox_pending(size_t acct){
+    for(outbox_msg_t* m = outbox.head; m; m = m->next){
+        if(m->acct == acct) return true;
+    }
+    return false;
+}
+
+size_t outbox_flush(size_t acct){
+    size_t sent = 0;
+    outbox_msg_t** p = &outbox.head;
+    while(*p){
+        outbox_msg_t* m = *p;
+        if(m->acct != acct){
+            p = &m->next;
+            continue;
+        }
+        // keep the order: nothing goes before a message which failed
+        if(sip_client_send_sms(acct, m->uri, m->msg, m->token)) break;
+        *p = m->next;
+        free(m);
+        sent++;
+    }
+    // fix the tail
+    outbox.tail = &outbox.head;
+    while(*outbox.tail) outbox.tail = &(*outbox.tail)->next;
+    if(sent) outbox_save();
+    return sent;
+}
+
+void outbox_stop(void){
+    outbox_free();
+    if(outbox.path) free(outbox.path);
+    outbox.path = NULL;
+}
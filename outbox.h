@@ -0,0 +1,31 @@
+#ifndef OUTBOX_H
+#define OUTBOX_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "uri.h"
+
+/* Messages which can't be sent right now (the account isn't registered, or
+   sending failed) wait in the outbox, in the order they were written, until
+   the account is registered again.  The outbox is kept in voipms/outbox, so
+   queued messages survive a restart too. */
+
+// load whatever was still queued last time; returns 0 on success
+int outbox_start(void);
+
+/* queue a message; token is passed on to sip_client_send_sms() when it is
+   sent (but isn't kept across a restart) */
+int outbox_add(size_t acct, sip_uri_t* uri, const char* msg, void* token);
+
+// whether an account has queued messages (which anything new must follow)
+bool outbox_pending(size_t acct);
+
+/* send an account's queued messages, in order, stopping at the first one
+   which can't be sent; returns how many were sent */
+size_t outbox_flush(size_t acct);
+
+// forget the queue (it's still on disk for next time)
+void outbox_stop(void);
+
+#endif // OUTBOX_H
@@ -0,0 +1,146 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include "reassemble.h"
+#include "segment.h"
+#include "voipms.h"
+
+// defaults for the settings in config.h
+#ifndef REASSEMBLY_MS
+#define REASSEMBLY_MS 2000
+#endif
+// carriers don't concatenate more than this many segments
+#define REASSEMBLY_MAX_PARTS 10
+
+// the segments received so far from one sender
+typedef struct partial_t {
+    size_t acct;
+    sip_uri_t* uri;
+    char* text;
+    size_t len;
+    size_t parts;
+    // (monotonic) milliseconds of the last segment
+    long long last_ms;
+    struct partial_t* next;
+} partial_t;
+
+struct reassembly {
+    partial_t* list;
+    struct t_hook* timer;
+};
+
+struct reassembly reassembly;
+
+static long long now_ms(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// take a sender's segments out of the list; NULL if there are none
+static partial_t* partial_take(size_t acct, const sip_uri_t* uri){
+    for(partial_t** p = &reassembly.list; *p; p = &(*p)->next){
+        partial_t* m = *p;
+        if(m->acct != acct || m->uri != uri) continue;
+        *p = m->next;
+        return m;
+    }
+    return NULL;
+}
+
+static void reassembly_unhook(void){
+    if(reassembly.list || !reassembly.timer) return;
+    weechat_unhook(reassembly.timer);
+    reassembly.timer = NULL;
+}
+
+// deliver what was received, and free it
+static int partial_deliver(partial_t* m){
+    int ret = voip_plugin_deliver_sms(m->acct, m->uri, m->text, m->len);
+    free(m->text);
+    free(m);
+    return ret;
+}
+
+// deliver the senders which have gone quiet
+static int reassembly_timer_cb(const void* ptr, void* data, int remaining){
+    (void)ptr;
+    (void)data;
+    (void)remaining;
+    long long now = now_ms();
+    partial_t** p = &reassembly.list;
+    while(*p){
+        partial_t* m = *p;
+        if(now - m->last_ms < REASSEMBLY_MS){
+            p = &m->next;
+            continue;
+        }
+        *p = m->next;
+        partial_deliver(m);
+    }
+    reassembly_unhook();
+    return WEECHAT_RC_OK;
+}
+
+int reassemble_add(size_t acct, sip_uri_t* uri, const char* body,
+                   size_t blen){
+    bool partial = REASSEMBLY_MS > 0 && segment_maybe_partial(body, blen);
+    partial_t* m = reassembly.list ? partial_take(acct, uri) : NULL;
+    if(!m && !partial){
+        return voip_plugin_deliver_sms(acct, uri, body, blen);
+    }
+
+    if(!m){
+        m = malloc(sizeof(*m));
+        if(!m) return voip_plugin_deliver_sms(acct, uri, body, blen);
+        *m = (partial_t){ .acct = acct, .uri = uri };
+    }
+    char* text = realloc(m->text, m->len + blen);
+    if(!text){
+        // deliver what we have, then this on its own
+        partial_deliver(m);
+        reassembly_unhook();
+        return voip_plugin_deliver_sms(acct, uri, body, blen);
+    }
+    memcpy(text + m->len, body, blen);
+    m->text = text;
+    m->len += blen;
+    m->parts++;
+    m->last_ms = now_ms();
+
+    // the last segment is the short one
+    if(!partial || m->parts >= REASSEMBLY_MAX_PARTS){
+        int ret = partial_deliver(m);
+        reassembly_unhook();
+        return ret;
+    }
+    if(!reassembly.timer){
+        long tick = REASSEMBLY_MS / 4 > 10 ? REASSEMBLY_MS / 4 : 10;
+        reassembly.timer = weechat_hook_timer(tick, 0, 0, reassembly_timer_cb,
+                                              NULL, NULL);
+        // without a timer, nothing would deliver it later
+        if(!reassembly.timer) return partial_deliver(m);
+    }
+    m->next = reassembly.list;
+    reassembly.list = m;
+    return WEECHAT_RC_OK;
+}
+
+void reassemble_flush(size_t acct, const sip_uri_t* uri){
+    if(!reassembly.list) return;
+    partial_t* m = partial_take(acct, uri);
+    if(!m) return;
+    partial_deliver(m);
+    reassembly_unhook();
+}
+
+void reassemble_stop(void){
+    while(reassembly.list){
+        partial_t* m = reassembly.list;
+        reassembly.list = m->next;
+        partial_deliver(m);
+    }
+    reassembly_unhook();
+}
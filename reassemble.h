@@ -0,0 +1,24 @@
+#ifndef REASSEMBLE_H
+#define REASSEMBLE_H
+
+#include <stddef.h>
+
+#include "uri.h"
+
+/* A long SMS arrives as several MESSAGEs in a row.  Messages from a sender
+   which look like segments of something longer (see
+   segment_maybe_partial()) are held for up to REASSEMBLY_MS for the next
+   one, and the whole text is then printed, and added to the history, once
+   (by voip_plugin_deliver_sms()). */
+
+// a message was received; returns what delivering it returned, if it was
+int reassemble_add(size_t acct, sip_uri_t* uri, const char* body,
+                   size_t blen);
+
+// deliver what is held for a conversation now (e.g. before we reply)
+void reassemble_flush(size_t acct, const sip_uri_t* uri);
+
+// deliver everything held (on plugin unload, before buffers go away)
+void reassemble_stop(void);
+
+#endif // REASSEMBLE_H
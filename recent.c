@@ -0,0 +1,213 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "recent.h"
+
+// defaults for the settings in config.h
+#ifndef RECENT_MESSAGES
+#define RECENT_MESSAGES 50
+#endif
+#ifndef RECENT_MAX_KB
+#define RECENT_MAX_KB 4096
+#endif
+
+/* the slab is made of pages, each cut into slots of one size class; a
+   message takes the smallest slot its header and text fit in.  Messages too
+   big for any slot get a malloc of their own.  The cap counts whole pages
+   (and the big messages), so a page is freed as soon as it's empty. */
+#define RECENT_PAGE (64 * 1024)
+static const size_t slot_sizes[] = {64, 128, 256, 512, 1024, 2048, 4096};
+#define NCLASSES (sizeof(slot_sizes) / sizeof(*slot_sizes))
+#define CLASS_MALLOC 0xff
+
+/* the start of every page (pages are aligned to their size, so a slot's
+   page is found by rounding its address down) */
+typedef struct recent_page {
+    // pages of the same class with a free slot
+    struct recent_page *prev, *next;
+    // this page's free slots, linked through ->next
+    sip_recent_t* free;
+    // slots holding a message
+    size_t live;
+    int cls;
+} recent_page_t;
+
+// slots start after the page header, at the first multiple of 64
+#define PAGE_HEADER ((sizeof(recent_page_t) + 63) & ~(size_t)63)
+
+struct recent {
+    // pages of each class with a free slot
+    recent_page_t* partial[NCLASSES];
+    // bytes of pages and big messages
+    size_t used;
+    /* conversations with messages, most recently used first; evictions
+       come from the back */
+    sip_contact_t* lru;
+    sip_contact_t* lru_last;
+};
+
+struct recent recent;
+
+static int slot_class(size_t size){
+    for(size_t i = 0; i < NCLASSES; i++){
+        if(size <= slot_sizes[i]) return (int)i;
+    }
+    return -1;
+}
+
+static recent_page_t* slot_page(const sip_recent_t* m){
+    return (recent_page_t*)((uintptr_t)m & ~(uintptr_t)(RECENT_PAGE - 1));
+}
+
+static void partial_unlink(recent_page_t* p){
+    if(p->prev) p->prev->next = p->next;
+    else recent.partial[p->cls] = p->next;
+    if(p->next) p->next->prev = p->prev;
+    p->prev = p->next = NULL;
+}
+
+static void partial_push(recent_page_t* p){
+    p->prev = NULL;
+    p->next = recent.partial[p->cls];
+    if(p->next) p->next->prev = p;
+    recent.partial[p->cls] = p;
+}
+
+// cut a new page into free slots of class cls
+static int slab_grow(int cls){
+    recent_page_t* p = aligned_alloc(RECENT_PAGE, RECENT_PAGE);
+    if(!p) return 1;
+    *p = (recent_page_t){ .cls = cls };
+    size_t size = slot_sizes[cls];
+    for(size_t off = PAGE_HEADER; off + size <= RECENT_PAGE; off += size){
+        sip_recent_t* slot = (sip_recent_t*)((char*)p + off);
+        slot->next = p->free;
+        p->free = slot;
+    }
+    partial_push(p);
+    recent.used += RECENT_PAGE;
+    return 0;
+}
+
+// give a slot back, and its page too once nothing else is in it
+static void slot_free(sip_recent_t* m){
+    recent_page_t* p = slot_page(m);
+    if(!p->free) partial_push(p);
+    m->next = p->free;
+    p->free = m;
+    if(--p->live) return;
+    partial_unlink(p);
+    free(p);
+    recent.used -= RECENT_PAGE;
+}
+
+// bytes more the slab would take to hold a message of size (and class cls)
+static size_t slab_need(int cls, size_t size){
+    if(cls < 0) return size;
+    return recent.partial[cls] ? 0 : RECENT_PAGE;
+}
+
+static void lru_unlink(sip_contact_t* c){
+    if(c->lru_prev) c->lru_prev->lru_next = c->lru_next;
+    else if(recent.lru == c) recent.lru = c->lru_next;
+    else return;
+    if(c->lru_next) c->lru_next->lru_prev = c->lru_prev;
+    else recent.lru_last = c->lru_prev;
+    c->lru_prev = c->lru_next = NULL;
+}
+
+static void lru_push(sip_contact_t* c){
+    lru_unlink(c);
+    c->lru_next = recent.lru;
+    if(recent.lru) recent.lru->lru_prev = c;
+    else recent.lru_last = c;
+    recent.lru = c;
+}
+
+// drop a conversation's oldest message
+static void drop_oldest(sip_contact_t* c){
+    sip_recent_t* m = c->messages;
+    c->messages = m->next;
+    if(c->messages) c->messages->prev = NULL;
+    else c->last_message = NULL;
+    c->message_count--;
+    if(m->cls == CLASS_MALLOC){
+        // (exactly what recent_add() counted)
+        recent.used -= sizeof(*m) + m->len + 1;
+        free(m);
+    }else{
+        slot_free(m);
+    }
+    if(!c->messages) lru_unlink(c);
+}
+
+void recent_add(const sip_contact_t* contact, time_t t, bool me,
+                const char* msg, size_t len){
+    if(!contact || RECENT_MESSAGES <= 0) return;
+    // (the contact is ours; callers only get to see it as const)
+    sip_contact_t* c = (sip_contact_t*)contact;
+    if(c->message_count >= RECENT_MESSAGES) drop_oldest(c);
+
+    size_t size = sizeof(sip_recent_t) + len + 1;
+    int cls = slot_class(size);
+    const size_t cap = (size_t)RECENT_MAX_KB * 1024;
+    if((cls < 0 ? size : RECENT_PAGE) > cap) return;
+    // make room, from the conversations used longest ago
+    while(recent.used + slab_need(cls, size) > cap && recent.lru_last){
+        drop_oldest(recent.lru_last);
+    }
+    if(recent.used + slab_need(cls, size) > cap) return;
+
+    sip_recent_t* m;
+    if(cls < 0){
+        m = malloc(size);
+        if(!m) return;
+        recent.used += size;
+    }else{
+        if(!recent.partial[cls] && slab_grow(cls)) return;
+        recent_page_t* p = recent.partial[cls];
+        m = p->free;
+        p->free = m->next;
+        p->live++;
+        if(!p->free) partial_unlink(p);
+    }
+    *m = (sip_recent_t){ .time = t ? t : time(NULL), .me = me,
+                         .cls = cls < 0 ? CLASS_MALLOC : (unsigned char)cls,
+                         .msg = (char*)(m + 1), .len = len,
+                         .prev = c->last_message };
+    memcpy(m->msg, msg, len);
+    m->msg[len] = '\0';
+
+    if(c->last_message) c->last_message->next = m;
+    else c->messages = m;
+    c->last_message = m;
+    c->message_count++;
+    lru_push(c);
+}
+
+void recent_clear(const sip_contact_t* contact){
+    sip_contact_t* c = (sip_contact_t*)contact;
+    while(c->messages) drop_oldest(c);
+}
+
+void recent_touch(const sip_contact_t* contact){
+    sip_contact_t* c = (sip_contact_t*)contact;
+    if(c->messages) lru_push(c);
+}
+
+size_t recent_bytes(void){
+    return recent.used;
+}
+
+void recent_stop(void){
+    // (an empty page is freed right away, so only a stray one is left here)
+    for(size_t i = 0; i < NCLASSES; i++){
+        while(recent.partial[i]){
+            recent_page_t* p = recent.partial[i];
+            recent.partial[i] = p->next;
+            free(p);
+        }
+    }
+    recent = (struct recent){0};
+}
@@ -0,0 +1,35 @@
+#ifndef RECENT_H
+#define RECENT_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include "buffers.h"
+
+/* The last RECENT_MESSAGES messages of each conversation are kept in memory
+   (contact->messages), so a conversation can be reopened, and scripts can
+   read it, without going back to the history.  The messages live in one
+   slab shared by every conversation; once it holds RECENT_MAX_KB, the least
+   recently used conversations lose their oldest messages first.
+
+   A conversation's messages are always the tail of its history: messages
+   are only ever dropped from the front. */
+
+// remember a message printed to a conversation's buffer (t 0 means now)
+void recent_add(const sip_contact_t* contact, time_t t, bool me,
+                const char* msg, size_t len);
+
+// forget a conversation's messages
+void recent_clear(const sip_contact_t* contact);
+
+// the conversation was used, so keep its messages over others'
+void recent_touch(const sip_contact_t* contact);
+
+// bytes the slab and the messages outside it take up (for tests)
+size_t recent_bytes(void);
+
+// free the slab (once every conversation is gone)
+void recent_stop(void);
+
+#endif // RECENT_H
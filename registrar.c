@@ -0,0 +1,195 @@
+/* a stand-in for voip.ms's SIP server, for trying out what the plugin does
+   when registration is lost.  It answers REGISTER and MESSAGE over UDP with
+   200 OK (printing each MESSAGE it receives, so you can check the order
+   queued messages arrive in), and every so often goes down for a while,
+   either ignoring everything or answering 503.
+
+   usage: registrar [-p port] [-u up_secs] [-d down_secs] [-e expires] [-5]
+
+   Use "127.0.0.1:port" as an account's realm in config.h, with
+   SIP_TRANSPORT "udp"; with -d 0 it never goes down */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <stdbool.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#define MAX_PACKET 65536
+
+// up to the end of the line
+static size_t line_len(const char* c, const char* end){
+    const char* p = c;
+    while(p < end && *p != '\r' && *p != '\n') p++;
+    return (size_t)(p - c);
+}
+
+// skip the line ending after a line
+static const char* next_line(const char* c, const char* end){
+    c += line_len(c, end);
+    if(c < end && *c == '\r') c++;
+    if(c < end && *c == '\n') c++;
+    return c;
+}
+
+// whether a header line is name (or its compact form), ignoring case
+static bool is_header(const char* c, size_t len, const char* name,
+                      const char* compact){
+    const char* colon = memchr(c, ':', len);
+    if(!colon) return false;
+    size_t n = (size_t)(colon - c);
+    while(n && (c[n - 1] == ' ' || c[n - 1] == '\t')) n--;
+    if(n == strlen(name) && !strncasecmp(c, name, n)) return true;
+    return compact && n == strlen(compact) && !strncasecmp(c, compact, n);
+}
+
+static void handle(int sock, const struct sockaddr_in* from, char* pkt,
+                   size_t len, bool down, int expires){
+    const char* end = pkt + len;
+    size_t rlen = line_len(pkt, end);
+    if(rlen >= len) return;
+    // ignore responses (e.g. to nothing we sent) and keepalives
+    if(!strncmp(pkt, "SIP/", 4) || rlen == 0) return;
+    bool is_register = !strncmp(pkt, "REGISTER ", 9);
+    bool is_message = !strncmp(pkt, "MESSAGE ", 8);
+
+    char resp[MAX_PACKET];
+    size_t r = 0;
+    int code = 200;
+    const char* reason = "OK";
+    if(down){
+        code = 503;
+        reason = "Service Unavailable";
+    }else if(!is_register && !is_message){
+        code = 501;
+        reason = "Not Implemented";
+    }
+    r += snprintf(resp + r, sizeof(resp) - r, "SIP/2.0 %d %s\r\n", code,
+                  reason);
+
+    // copy the headers a response needs
+    const char* c = next_line(pkt, end);
+    const char* body = end;
+    size_t clen = 0;
+    while(c < end){
+        size_t l = line_len(c, end);
+        if(l == 0){
+            body = next_line(c, end);
+            break;
+        }
+        bool copy = is_header(c, l, "Via", "v")
+                 || is_header(c, l, "From", "f")
+                 || is_header(c, l, "Call-ID", "i")
+                 || is_header(c, l, "CSeq", NULL)
+                 || (is_register && code == 200
+                     && is_header(c, l, "Contact", "m"));
+        if(is_header(c, l, "Content-Length", "l")){
+            clen = strtoul(memchr(c, ':', l) + 1, NULL, 10);
+        }
+        if(copy && r + l + 2 < sizeof(resp)){
+            memcpy(resp + r, c, l);
+            r += l;
+            r += snprintf(resp + r, sizeof(resp) - r, "\r\n");
+        }else if(is_header(c, l, "To", "t") && r + l + 32 < sizeof(resp)){
+            memcpy(resp + r, c, l);
+            r += l;
+            // the To of a response to a new request needs a tag
+            bool tagged = false;
+            for(size_t i = 0; i + 4 <= l; i++){
+                if(!strncasecmp(c + i, "tag=", 4)) tagged = true;
+            }
+            if(!tagged) r += snprintf(resp + r, sizeof(resp) - r, ";tag=%d",
+                                      rand());
+            r += snprintf(resp + r, sizeof(resp) - r, "\r\n");
+        }
+        c = next_line(c, end);
+    }
+    if(is_register && code == 200){
+        r += snprintf(resp + r, sizeof(resp) - r, "Expires: %d\r\n", expires);
+    }
+    r += snprintf(resp + r, sizeof(resp) - r, "Content-Length: 0\r\n\r\n");
+
+    if(clen > (size_t)(end - body)) clen = (size_t)(end - body);
+    if(is_message){
+        printf("%s MESSAGE: %.*s\n", down ? "rejected" : "received",
+               (int)clen, body);
+    }else if(is_register){
+        printf("%s REGISTER\n", down ? "rejected" : "accepted");
+    }
+    fflush(stdout);
+
+    if(r < sizeof(resp)){
+        sendto(sock, resp, r, 0, (const struct sockaddr*)from, sizeof(*from));
+    }
+}
+
+int main(int argc, char** argv){
+    int port = 5060;
+    int up_secs = 60;
+    int down_secs = 30;
+    int expires = 30;
+    // answer 503 while down, instead of ignoring everything
+    bool reject = false;
+
+    int opt;
+    while( (opt = getopt(argc, argv, "p:u:d:e:5")) != -1 ){
+        switch(opt){
+            case 'p': port = atoi(optarg); break;
+            case 'u': up_secs = atoi(optarg); break;
+            case 'd': down_secs = atoi(optarg); break;
+            case 'e': expires = atoi(optarg); break;
+            case '5': reject = true; break;
+            default:
+                fprintf(stderr, "usage: %s [-p port] [-u up_secs] "
+                        "[-d down_secs] [-e expires] [-5]\n", argv[0]);
+                return 1;
+        }
+    }
+    if(up_secs <= 0 || down_secs < 0 || expires <= 0){
+        fprintf(stderr, "%s: up_secs and expires must be positive\n",
+                argv[0]);
+        return 1;
+    }
+
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if(sock < 0){
+        perror("socket");
+        return 1;
+    }
+    struct sockaddr_in addr = { .sin_family = AF_INET,
+                                .sin_port = htons(port),
+                                .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    if(bind(sock, (struct sockaddr*)&addr, sizeof(addr))){
+        perror("bind");
+        return 1;
+    }
+    srand(time(NULL));
+
+    time_t start = time(NULL);
+    bool was_down = false;
+    static char pkt[MAX_PACKET];
+    while(true){
+        struct sockaddr_in from;
+        socklen_t flen = sizeof(from);
+        ssize_t n = recvfrom(sock, pkt, sizeof(pkt), 0,
+                             (struct sockaddr*)&from, &flen);
+        if(n < 0){
+            perror("recvfrom");
+            return 1;
+        }
+        // up for up_secs, then down for down_secs, and so on
+        time_t t = (time(NULL) - start) % (up_secs + down_secs);
+        bool down = t >= up_secs;
+        if(down != was_down){
+            printf("--- %s ---\n", down ? "down" : "up");
+            was_down = down;
+        }
+        if(down && !reject) continue;
+        handle(sock, &from, pkt, (size_t)n, down, expires);
+    }
+}
@@ -0,0 +1,138 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include <weechat/weechat-plugin.h>
+
+#include "replay.h"
+#include "trace.h"
+#include "voipms.h"
+#include "accounts.h"
+
+// events dispatched per timer call at most, so weechat stays responsive
+#ifndef REPLAY_SLICE
+#define REPLAY_SLICE 1000
+#endif
+
+static struct {
+    struct t_hook* timer;
+    trace_reader_t* reader;
+    double speed;
+    // the next event, read ahead so we know when it's due
+    trace_event_t ev;
+    bool have_ev;
+    // trace time of the first event, and wall time the replay started
+    int64_t trace_start;
+    double wall_start;
+    // counts and time spent in the handlers, for the report
+    size_t rx, tx, failed;
+    double handler_secs;
+} replay;
+
+static double now(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void replay_free(void){
+    if(replay.timer) weechat_unhook(replay.timer);
+    trace_reader_close(replay.reader);
+    replay.timer = NULL;
+    replay.reader = NULL;
+    replay.have_ev = false;
+}
+
+static void replay_report(const char* how){
+    if(!voip_buffer) return;
+    double wall = now() - replay.wall_start;
+    size_t n = replay.rx ? replay.rx : 1;
+    weechat_printf(voip_buffer, "voipms: replay %s: %zu received messages "
+                   "(%zu failed) and %zu sent ones (skipped) in %.3fs; "
+                   "%.1fus per message in the handlers", how, replay.rx,
+                   replay.failed, replay.tx, wall,
+                   replay.handler_secs * 1e6 / n);
+}
+
+static void replay_dispatch(const trace_event_t* ev){
+    if(ev->kind == TRACE_TX){
+        replay.tx++;
+        return;
+    }
+    size_t acct = ev->acct < voip_naccounts ? ev->acct : 0;
+    double t0 = now();
+    int ret;
+    if(ev->mlen == 10 && !memcmp(ev->mime, "text/plain", 10)){
+        ret = voip_plugin_handle_sms(acct, ev->from, ev->flen,
+                                     ev->body, ev->blen);
+    }else{
+        ret = voip_plugin_handle_mms(acct, ev->from, ev->flen,
+                                     ev->mime, ev->mlen, ev->body, ev->blen);
+    }
+    replay.handler_secs += now() - t0;
+    replay.rx++;
+    if(ret != WEECHAT_RC_OK) replay.failed++;
+}
+
+static int replay_timer_cb(const void* ptr, void* data, int remaining){
+    (void)ptr;
+    (void)data;
+    (void)remaining;
+
+    // how far into the trace we should be by now
+    double elapsed = (now() - replay.wall_start) * replay.speed;
+    int64_t due = replay.trace_start + (int64_t)(elapsed * 1e6);
+    for(size_t budget = REPLAY_SLICE; budget; budget--){
+        if(!replay.have_ev){
+            int ret = trace_reader_next(replay.reader, &replay.ev);
+            if(ret){
+                replay_report(ret > 0 ? "done" : "stopped at a corrupt event");
+                replay_free();
+                return WEECHAT_RC_OK;
+            }
+            replay.have_ev = true;
+        }
+        if(replay.speed > 0 && replay.ev.usec > due) break;
+        replay_dispatch(&replay.ev);
+        replay.have_ev = false;
+    }
+    return WEECHAT_RC_OK;
+}
+
+int replay_start(struct t_gui_buffer* buffer, const char* path, double speed){
+    if(replay.reader){
+        weechat_printf(buffer, "voipms: a replay is already running");
+        return 1;
+    }
+    int ret = trace_reader_open(path, &replay.reader);
+    if(ret){
+        weechat_printf(buffer, "voipms: \"%s\" is not a trace (%d)", path, ret);
+        return 1;
+    }
+    replay.speed = speed > 0 ? speed : 0;
+    replay.rx = replay.tx = replay.failed = 0;
+    replay.handler_secs = 0;
+
+    // the first event sets the clock
+    ret = trace_reader_next(replay.reader, &replay.ev);
+    if(ret){
+        weechat_printf(buffer, "voipms: \"%s\" has no events", path);
+        replay_free();
+        return 1;
+    }
+    replay.have_ev = true;
+    replay.trace_start = replay.ev.usec;
+    replay.wall_start = now();
+
+    replay.timer = weechat_hook_timer(1, 0, 0, replay_timer_cb, NULL, NULL);
+    if(!replay.timer){
+        replay_free();
+        return 1;
+    }
+    return 0;
+}
+
+void replay_stop(void){
+    replay_free();
+}
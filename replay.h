@@ -0,0 +1,18 @@
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include <weechat/weechat-plugin.h>
+
+/* Replays a trace (see trace.h) from a weechat timer: each received message
+   goes through voip_plugin_handle_sms()/handle_mms() again, as if it had
+   just arrived.  Sent messages are counted but not sent. */
+
+/* start replaying the trace at path, speed times as fast as it was recorded
+   (0 for as fast as possible).  Errors are printed to buffer, and the
+   timings at the end to the voipms buffer.  Returns 0 on success. */
+int replay_start(struct t_gui_buffer* buffer, const char* path, double speed);
+
+// abandon the replay (on plugin unload)
+void replay_stop(void);
+
+#endif // REPLAY_H
@@ -0,0 +1,228 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "restore.h"
+#include "voipms.h"
+#include "buffers.h"
+#include "history.h"
+#include "accounts.h"
+#include "complete.h"
+#include "watch.h"
+#include "startup.h"
+
+// defaults for the settings in config.h
+#ifndef RESTORE_ACTIVE_DAYS
+#define RESTORE_ACTIVE_DAYS 30
+#endif
+
+// a conversation to open during the restore
+typedef struct {
+    size_t acct;
+    sip_uri_t* uri;
+    hist_buf_t* hist;
+} restore_item_t;
+
+struct restore_job {
+    struct t_hook* timer;
+    // every account's history list, freed when we're done
+    hist_buf_t** hists;
+    // the conversations that get a buffer, and the next one to open
+    restore_item_t* items;
+    size_t nitems;
+    size_t next;
+    // the conversation currently being printed, read a slice at a time
+    restore_item_t* item;
+    struct t_gui_buffer* buffer;
+    hist_reader_t* reader;
+    // the end of the last message printed
+    size_t end;
+    // for the progress report
+    size_t nmsgs;
+    struct timespec start;
+};
+
+struct restore_job restore;
+
+static void restore_free(void){
+    if(restore.timer) weechat_unhook(restore.timer);
+    hist_reader_close(restore.reader);
+    if(restore.hists){
+        for(size_t i = 0; i < voip_naccounts; i++){
+            free_hist_buf(restore.hists[i]);
+        }
+        free(restore.hists);
+    }
+    if(restore.items) free(restore.items);
+    restore = (struct restore_job){0};
+}
+
+/* done with the current conversation; whole is true if its history was
+   read to the end */
+static void restore_finish_buffer(bool whole){
+    /* anything appended after what we printed is picked up by the watch (a
+       history cut short is printed again when it's next opened) */
+    if(whole && restore.end){
+        watch_seen(restore.item->acct, restore.item->hist->filename,
+                   restore.end);
+    }
+    restore.item = NULL;
+    restore.end = 0;
+    hist_reader_close(restore.reader);
+    restore.reader = NULL;
+    restore.buffer = NULL;
+}
+
+// read and print up to budget messages of the current conversation
+static size_t restore_print(size_t budget){
+    size_t n = 0;
+    int ret = 0;
+    hist_msg_t* msg;
+    while(n < budget && (ret = hist_reader_next(restore.reader, &msg)) == 0){
+        voip_plugin_print_hist_msg(restore.buffer, msg);
+        restore.end = msg->end;
+        n++;
+    }
+    restore.nmsgs += n;
+    // (an unreadable record ends it too)
+    if(ret) restore_finish_buffer(ret == 1);
+    return n;
+}
+
+// start on the next conversation, if it has any history to print
+static void restore_next_buffer(void){
+    restore_item_t* item = &restore.items[restore.next++];
+    hist_buf_t* p = item->hist;
+
+    // conversations that were opened early already have their history
+    if(sip_buffers_lookup(item->acct, item->uri)) return;
+
+    struct t_gui_buffer* buffer;
+    buffer = sip_buffers_open(item->acct, item->uri, false);
+    if(!buffer) return;
+
+    weechat_printf_date_tags(buffer, 0, NULL, "%s", item->uri->str);
+    // the manifest tells us when there is nothing to load
+    if(p->count == 0) return;
+
+    const char* shard = voip_accounts[item->acct].label;
+    if(hist_reader_open(wc_dir, shard, p->filename, 0, &restore.reader)){
+        return;
+    }
+    restore.item = item;
+    restore.buffer = buffer;
+}
+
+static void restore_report(void){
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    long ms = (end.tv_sec - restore.start.tv_sec) * 1000
+              + (end.tv_nsec - restore.start.tv_nsec) / 1000000;
+    if(voip_buffer){
+        weechat_printf(voip_buffer, "voipms: restored %zu conversations "
+                       "(%zu messages) in %ldms", restore.nitems,
+                       restore.nmsgs, ms);
+        weechat_buffer_set(voip_buffer, "title", "voipms");
+    }
+}
+
+static int restore_timer_cb(const void* ptr, void* data, int remaining){
+    (void)ptr;
+    (void)data;
+    (void)remaining;
+
+    size_t budget = RESTORE_SLICE;
+    while(budget){
+        if(restore.buffer){
+            budget -= restore_print(budget);
+            continue;
+        }
+        if(restore.next == restore.nitems){
+            // all done
+            restore_report();
+            restore_free();
+            startup_restored();
+            return WEECHAT_RC_OK;
+        }
+        // opening (or skipping) a conversation costs as much as a message
+        restore_next_buffer();
+        budget--;
+    }
+
+    // show our progress
+    if(voip_buffer){
+        char title[128];
+        snprintf(title, sizeof(title), "voipms: restoring history "
+                 "(%zu/%zu conversations)", restore.next, restore.nitems);
+        weechat_buffer_set(voip_buffer, "title", title);
+    }
+    return WEECHAT_RC_OK;
+}
+
+int restore_start(void){
+    restore_free();
+    clock_gettime(CLOCK_MONOTONIC, &restore.start);
+
+    restore.hists = calloc(voip_naccounts, sizeof(*restore.hists));
+    if(!restore.hists) goto fail;
+
+    /* only conversations active within RESTORE_ACTIVE_DAYS get a buffer now;
+       the rest are opened when they are next used */
+    time_t cutoff = 0;
+    if(RESTORE_ACTIVE_DAYS >= 0){
+        cutoff = time(NULL) - (time_t)RESTORE_ACTIVE_DAYS * 24 * 60 * 60;
+    }
+
+    /* reading the manifests is cheap, so register every conversation up
+       front; then anything opened early (by a live message) gets its whole
+       history right away.  Their completions are sorted once at the end */
+    size_t maxitems = 0;
+    complete_defer();
+    for(size_t i = 0; i < voip_naccounts; i++){
+        // a missing or unreadable history just means no conversations
+        list_hist_bufs(wc_dir, voip_accounts[i].label, &restore.hists[i]);
+        for(hist_buf_t* p = restore.hists[i]; p; p = p->next){
+            const char* filename = p->count ? p->filename : NULL;
+            sip_uri_t* uri = sip_uri_intern(p->sip_uri, strlen(p->sip_uri));
+            if(sip_buffers_add_closed(i, uri, p->name, filename)) goto fail;
+            if(p->last >= cutoff) maxitems++;
+        }
+    }
+    complete_sort();
+
+    restore.items = malloc((maxitems + 1) * sizeof(*restore.items));
+    if(!restore.items) goto fail;
+    for(size_t i = 0; i < voip_naccounts; i++){
+        for(hist_buf_t* p = restore.hists[i]; p; p = p->next){
+            if(p->last < cutoff) continue;
+            sip_uri_t* uri = sip_uri_intern(p->sip_uri, strlen(p->sip_uri));
+            restore.items[restore.nitems++] = (restore_item_t){i, uri, p};
+        }
+    }
+
+    // do the rest from the main loop
+    restore.timer = weechat_hook_timer(1, 0, 0, restore_timer_cb, NULL, NULL);
+    if(!restore.timer) goto fail;
+    return 0;
+
+fail:
+    complete_sort();
+    restore_free();
+    return 1;
+}
+
+void restore_flush(struct t_gui_buffer* buffer){
+    if(!buffer || restore.buffer != buffer) return;
+    restore_print((size_t)-1);
+}
+
+void restore_closed(struct t_gui_buffer* buffer){
+    if(!buffer || restore.buffer != buffer) return;
+    restore_finish_buffer(false);
+}
+
+void restore_stop(void){
+    restore_free();
+}
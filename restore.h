@@ -0,0 +1,29 @@
+#ifndef RESTORE_H
+#define RESTORE_H
+
+#include <weechat/weechat-plugin.h>
+
+#include "config.h"
+
+// messages printed per timer tick (the timeline merges in slices this size)
+#ifndef RESTORE_SLICE
+#define RESTORE_SLICE 500
+#endif
+
+/* History is restored incrementally from a weechat timer, a slice at a time,
+   so that startup doesn't block on the size of the archive. */
+
+// start restoring the history of every account; returns 0 on success
+int restore_start(void);
+
+/* make sure a buffer's history is completely printed before anything new is
+   printed to it (for live messages arriving during the restore) */
+void restore_flush(struct t_gui_buffer* buffer);
+
+// for when a buffer is closed: stop restoring its history
+void restore_closed(struct t_gui_buffer* buffer);
+
+// abandon the restore (on plugin unload)
+void restore_stop(void);
+
+#endif // RESTORE_H
@@ -0,0 +1,204 @@
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include <weechat/weechat-plugin.h>
+
+#include "script.h"
+#include "voipms.h"
+#include "buffers.h"
+#include "uri.h"
+
+static struct t_hook* hooks[5];
+
+static struct t_hdata* hdata_conversation_cb(const void* ptr, void* data,
+                                             const char* hdata_name){
+    (void)ptr;
+    (void)data;
+    struct t_hdata* hdata = weechat_hdata_new(hdata_name, "prev", "next",
+                                              0, 0, NULL, NULL);
+    if(!hdata) return NULL;
+    WEECHAT_HDATA_VAR(sip_contact_t, acct, LONG, 0, NULL, NULL);
+    WEECHAT_HDATA_VAR(sip_contact_t, label, STRING, 0, NULL, NULL);
+    WEECHAT_HDATA_VAR(sip_contact_t, uri, POINTER, 0, NULL, "voipms_uri");
+    WEECHAT_HDATA_VAR(sip_contact_t, filename, STRING, 0, NULL, NULL);
+    WEECHAT_HDATA_VAR(sip_contact_t, name, STRING, 0, NULL, NULL);
+    WEECHAT_HDATA_VAR(sip_contact_t, buffer, POINTER, 0, NULL, "buffer");
+    WEECHAT_HDATA_VAR(sip_contact_t, messages, POINTER, 0, NULL,
+                      "voipms_message");
+    WEECHAT_HDATA_VAR(sip_contact_t, last_message, POINTER, 0, NULL,
+                      "voipms_message");
+    WEECHAT_HDATA_VAR(sip_contact_t, message_count, INTEGER, 0, NULL, NULL);
+    WEECHAT_HDATA_VAR(sip_contact_t, prev, POINTER, 0, NULL, hdata_name);
+    WEECHAT_HDATA_VAR(sip_contact_t, next, POINTER, 0, NULL, hdata_name);
+    weechat_hdata_new_list(hdata, "conversations", &sip_contacts,
+                           WEECHAT_HDATA_LIST_CHECK_POINTERS);
+    weechat_hdata_new_list(hdata, "last_conversation", &last_sip_contact, 0);
+    return hdata;
+}
+
+static struct t_hdata* hdata_message_cb(const void* ptr, void* data,
+                                        const char* hdata_name){
+    (void)ptr;
+    (void)data;
+    struct t_hdata* hdata = weechat_hdata_new(hdata_name, "prev", "next",
+                                              0, 0, NULL, NULL);
+    if(!hdata) return NULL;
+    WEECHAT_HDATA_VAR(sip_recent_t, time, TIME, 0, NULL, NULL);
+    WEECHAT_HDATA_VAR(sip_recent_t, me, INTEGER, 0, NULL, NULL);
+    WEECHAT_HDATA_VAR(sip_recent_t, msg, STRING, 0, NULL, NULL);
+    WEECHAT_HDATA_VAR(sip_recent_t, prev, POINTER, 0, NULL, hdata_name);
+    WEECHAT_HDATA_VAR(sip_recent_t, next, POINTER, 0, NULL, hdata_name);
+    return hdata;
+}
+
+static struct t_hdata* hdata_uri_cb(const void* ptr, void* data,
+                                    const char* hdata_name){
+    (void)ptr;
+    (void)data;
+    struct t_hdata* hdata = weechat_hdata_new(hdata_name, NULL, NULL,
+                                              0, 0, NULL, NULL);
+    if(!hdata) return NULL;
+    WEECHAT_HDATA_VAR(sip_uri_t, str, STRING, 0, NULL, NULL);
+    WEECHAT_HDATA_VAR(sip_uri_t, len, LONG, 0, NULL, NULL);
+    WEECHAT_HDATA_VAR(sip_uri_t, number, STRING, 0, NULL, NULL);
+    return hdata;
+}
+
+static int add_conversation(struct t_infolist* infolist,
+                            const sip_contact_t* c){
+    struct t_infolist_item* item = weechat_infolist_new_item(infolist);
+    if(!item) return 1;
+    if(!weechat_infolist_new_var_pointer(item, "pointer", (void*)c)
+            || !weechat_infolist_new_var_string(item, "account", c->label)
+            || !weechat_infolist_new_var_string(item, "uri", c->uri->str)
+            || !weechat_infolist_new_var_string(item, "number",
+                                                c->uri->number)
+            || !weechat_infolist_new_var_string(item, "name", c->name)
+            || !weechat_infolist_new_var_string(item, "filename",
+                                                c->filename)
+            || !weechat_infolist_new_var_pointer(item, "buffer", c->buffer)
+            || !weechat_infolist_new_var_integer(item, "message_count",
+                                                 c->message_count)
+            || !weechat_infolist_new_var_time(item, "last_time",
+                       c->last_message ? c->last_message->time : 0)){
+        return 1;
+    }
+    return 0;
+}
+
+/* one conversation (by pointer), or every conversation whose number or
+   name matches the mask in arguments (all of them without one) */
+static struct t_infolist* infolist_conversation_cb(const void* ptr,
+                                                   void* data,
+                                                   const char* infolist_name,
+                                                   void* obj_pointer,
+                                                   const char* arguments){
+    (void)ptr;
+    (void)data;
+    (void)infolist_name;
+    const sip_contact_t* one = obj_pointer;
+    if(one && !sip_buffers_valid(one)) return NULL;
+    const char* mask = arguments && *arguments ? arguments : NULL;
+
+    struct t_infolist* infolist = weechat_infolist_new();
+    if(!infolist) return NULL;
+    for(const sip_contact_t* c = one ? one : sip_contacts; c;
+            c = one ? NULL : c->next){
+        if(mask && !weechat_string_match(c->uri->number, mask, 0)
+                && !(c->name && weechat_string_match(c->name, mask, 0))){
+            continue;
+        }
+        if(add_conversation(infolist, c)){
+            weechat_infolist_free(infolist);
+            return NULL;
+        }
+    }
+    return infolist;
+}
+
+/* the recent messages of a conversation newer than a time, oldest first:
+   arguments are "[since[,count]]", where count limits it to the newest
+   count of them.  Only those messages are looked at, however many the
+   conversation keeps. */
+static struct t_infolist* infolist_message_cb(const void* ptr, void* data,
+                                              const char* infolist_name,
+                                              void* obj_pointer,
+                                              const char* arguments){
+    (void)ptr;
+    (void)data;
+    (void)infolist_name;
+    const sip_contact_t* c = obj_pointer;
+    if(!c || !sip_buffers_valid(c)) return NULL;
+    time_t since = 0;
+    long count = -1;
+    if(arguments && *arguments){
+        char* end;
+        since = (time_t)strtol(arguments, &end, 10);
+        if(*end == ',') count = strtol(end + 1, &end, 10);
+        if(*end || count == 0) return NULL;
+    }
+
+    // walk back from the newest to the first one wanted
+    const sip_recent_t* first = NULL;
+    long n = 0;
+    for(const sip_recent_t* m = c->last_message; m && m->time > since
+            && (count < 0 || n < count); m = m->prev){
+        first = m;
+        n++;
+    }
+
+    struct t_infolist* infolist = weechat_infolist_new();
+    if(!infolist) return NULL;
+    for(const sip_recent_t* m = first; m && n--; m = m->next){
+        struct t_infolist_item* item = weechat_infolist_new_item(infolist);
+        if(!item
+                || !weechat_infolist_new_var_time(item, "time", m->time)
+                || !weechat_infolist_new_var_integer(item, "me", m->me)
+                || !weechat_infolist_new_var_string(item, "msg", m->msg)){
+            weechat_infolist_free(infolist);
+            return NULL;
+        }
+    }
+    return infolist;
+}
+
+int script_start(void){
+    hooks[0] = weechat_hook_hdata("voipms_conversation",
+                                  "a voipms conversation",
+                                  hdata_conversation_cb, NULL, NULL);
+    hooks[1] = weechat_hook_hdata("voipms_message",
+                                  "a recent message of a voipms conversation",
+                                  hdata_message_cb, NULL, NULL);
+    hooks[2] = weechat_hook_hdata("voipms_uri", "a sip uri",
+                                  hdata_uri_cb, NULL, NULL);
+    hooks[3] = weechat_hook_infolist("voipms_conversation",
+                                     "voipms conversations",
+                                     "conversation pointer (optional)",
+                                     "number or name (wildcards allowed) "
+                                     "(optional)",
+                                     infolist_conversation_cb, NULL, NULL);
+    hooks[4] = weechat_hook_infolist("voipms_message",
+                                     "recent messages of a voipms "
+                                     "conversation, oldest first",
+                                     "conversation pointer",
+                                     "since[,count]: only messages after the "
+                                     "time since, and only the last count "
+                                     "of them (optional)",
+                                     infolist_message_cb, NULL, NULL);
+    for(size_t i = 0; i < sizeof(hooks) / sizeof(*hooks); i++){
+        if(!hooks[i]){
+            script_stop();
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void script_stop(void){
+    for(size_t i = 0; i < sizeof(hooks) / sizeof(*hooks); i++){
+        if(hooks[i]) weechat_unhook(hooks[i]);
+        hooks[i] = NULL;
+    }
+}
@@ -0,0 +1,13 @@
+#ifndef SCRIPT_H
+#define SCRIPT_H
+
+/* What other plugins and scripts can see of ours, without reading the
+   history directory: the conversations and their recent messages, as hdata
+   ("voipms_conversation", "voipms_message", "voipms_uri") and infolists
+   ("voipms_conversation", "voipms_message"). */
+
+// returns 0 on success
+int script_start(void);
+void script_stop(void);
+
+#endif // SCRIPT_H
@@ -0,0 +1,38 @@
+#include "segment.h"
+
+// a concatenated SMS loses a few characters per segment to its header
+#define PARTIAL_GSM_CHARS 153
+#define PARTIAL_UCS2_CHARS 67
+
+// a byte which starts a UTF-8 character
+static bool char_start(unsigned char c){
+    return (c & 0xc0) != 0x80;
+}
+
+size_t segment_next(const char* msg, size_t len, size_t max_chars){
+    if(max_chars == 0) return len;
+    // find where max_chars characters end
+    size_t cut = 0;
+    size_t chars = 0;
+    for(; cut < len; cut++){
+        if(char_start((unsigned char)msg[cut]) && chars++ == max_chars) break;
+    }
+    if(cut >= len) return len;
+    // rather not split a word
+    for(size_t i = cut; i > cut / 2; i--){
+        if(msg[i - 1] == ' ' || msg[i - 1] == '\n') return i;
+    }
+    return cut;
+}
+
+bool segment_maybe_partial(const char* msg, size_t len){
+    size_t chars = 0;
+    bool ascii = true;
+    for(size_t i = 0; i < len; i++){
+        unsigned char c = (unsigned char)msg[i];
+        if(c & 0x80) ascii = false;
+        if(char_start(c)) chars++;
+    }
+    // anything longer or shorter is a whole message
+    return chars == (ascii ? PARTIAL_GSM_CHARS : PARTIAL_UCS2_CHARS);
+}
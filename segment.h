@@ -0,0 +1,20 @@
+#ifndef SEGMENT_H
+#define SEGMENT_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+/* SMS segments.  The provider takes at most SMS_SEGMENT_CHARS characters in
+   a MESSAGE, so longer messages are sent as several.  A long SMS sent to us
+   arrives the same way, as several MESSAGEs with nothing to say they belong
+   together, so all we can go by is their length. */
+
+/* bytes of the first segment of msg: at most max_chars characters (UTF-8),
+   ending after a space or newline if there is one in its second half */
+size_t segment_next(const char* msg, size_t len, size_t max_chars);
+
+/* whether a received message is exactly as long as a segment of a longer
+   one: 153 characters (GSM) or 67 (anything else, sent as UCS-2) */
+bool segment_maybe_partial(const char* msg, size_t len);
+
+#endif // SEGMENT_H
@@ -1,58 +1,465 @@
 #include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
 
 #include "sip_client.h"
 #include "voipms.h"
 #include "constify.h"
+#include "accounts.h"
+#include "trace.h"
+#include "latency.h"
+#include "startup.h"
+#include "segment.h"
 
+/* registration state of one account.  on_reg_state (which may run on a
+   pjsip thread) only stores the result of each REGISTER; the watchdog acts
+   on it from weechat's main loop */
 typedef struct {
-    pjsua_acc_id aid;
+    // the last REGISTER's status code: 0 while one is in progress
+    atomic_int code;
+    atomic_bool up;
+    // when it was last answered (monotonic milliseconds)
+    atomic_llong answered_ms;
+    // the rest belongs to the watchdog
+    bool was_up;
+    unsigned failures;
+    // when to try registering again; 0 if not scheduled
+    time_t retry_at;
+} reg_state_t;
+
+/* a MESSAGE which arrived on a pjsip thread, or the final status of one we
+   sent, waiting for weechat's main loop (which alone may touch buffers, and
+   is where the restore and fanout run) */
+typedef struct sip_inbound_t {
+    // for a status, the token it's for (NULL for a MESSAGE) and its code
+    void* token;
+    int code;
+    size_t acct;
+    size_t flen;
+    size_t mlen;
+    size_t blen;
+    struct sip_inbound_t* next;
+    // from, mime and body, one after the other (a status has only a reason)
+    char data[];
+} sip_inbound_t;
+
+typedef struct {
+    // one pjsua account per configured account, all on one transport
+    pjsua_acc_id aid[PJSUA_MAX_ACC];
+    reg_state_t reg[PJSUA_MAX_ACC];
     pjsua_transport_id tid;
+    // weechat hooks that drive pjsip when it has no threads of its own
+    struct t_hook* poll_hook;
+    struct t_hook* fd_hook;
+    struct t_hook* watchdog_hook;
+    // with threads, received MESSAGEs and statuses are queued, and the pipe
+    // wakes us up
+    bool queue_inbound;
+    int inbound_pipe[2];
+    struct t_hook* inbound_hook;
     bool did_create;
     bool did_transport;
-    bool did_account;
+    bool did_account[PJSUA_MAX_ACC];
 } global_pj_state;
 
-global_pj_state gpj;
+global_pj_state gpj = { .inbound_pipe = {-1, -1} };
+
+/* one message sent as one or more MESSAGEs; its token gets the first
+   failure, or the last success, once all of them are answered */
+typedef struct {
+    void* token;
+    // answers still to come, plus one while we're still sending
+    size_t remaining;
+    int code;
+    char reason[64];
+} sip_send_t;
+
+// answers to a message's segments may come in on several pjsip threads
+pthread_mutex_t send_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// the queue of received MESSAGEs and statuses (the rest of gpj is the main
+// loop's)
+pthread_mutex_t inbound_lock = PTHREAD_MUTEX_INITIALIZER;
+sip_inbound_t* inbound;
+sip_inbound_t** inbound_tail = &inbound;
+
+// defaults for the transport settings in config.h
+#ifndef SIP_TRANSPORT
+#define SIP_TRANSPORT "udp"
+#endif
+#ifndef SIP_KEEPALIVE_SECS
+#define SIP_KEEPALIVE_SECS 15
+#endif
+#ifndef SIP_RECONNECT_SECS
+#define SIP_RECONNECT_SECS 2
+#endif
+#ifndef SIP_RECONNECT_MAX_SECS
+#define SIP_RECONNECT_MAX_SECS 300
+#endif
+#ifndef SIP_TLS_CA_FILE
+#define SIP_TLS_CA_FILE ""
+#endif
+#ifndef SIP_TLS_VERIFY_SERVER
+#define SIP_TLS_VERIFY_SERVER 1
+#endif
+#ifndef SIP_THREADS
+#define SIP_THREADS 1
+#endif
+#ifndef SIP_POLL_MS
+#define SIP_POLL_MS 50
+#endif
+#ifndef SMS_SEGMENT_CHARS
+#define SMS_SEGMENT_CHARS 160
+#endif
+// most events to handle in one go, so a flood can't stall weechat
+#define SIP_PUMP_MAX 64
+
+// parse SIP_TRANSPORT; returns 0 on success
+static int transport_type(const char* name, pjsip_transport_type_e *type,
+                          const char** uri_param){
+    if(strcmp(name, "udp") == 0){
+        *type = PJSIP_TRANSPORT_UDP;
+        *uri_param = "";
+    }else if(strcmp(name, "tcp") == 0){
+        *type = PJSIP_TRANSPORT_TCP;
+        *uri_param = ";transport=tcp";
+    }else if(strcmp(name, "tls") == 0){
+        *type = PJSIP_TRANSPORT_TLS;
+        *uri_param = ";transport=tls";
+    }else{
+        return 1;
+    }
+    return 0;
+}
 
 void global_pj_state_reset(void){
+    gpj.poll_hook = NULL;
+    gpj.fd_hook = NULL;
+    gpj.watchdog_hook = NULL;
+    gpj.queue_inbound = false;
+    gpj.inbound_pipe[0] = -1;
+    gpj.inbound_pipe[1] = -1;
+    gpj.inbound_hook = NULL;
     gpj.did_create = false;
     gpj.did_transport = false;
-    gpj.did_account = false;
+    for(size_t i = 0; i < PJSUA_MAX_ACC; i++){
+        gpj.did_account[i] = false;
+        atomic_store(&gpj.reg[i].code, 0);
+        atomic_store(&gpj.reg[i].up, false);
+        atomic_store(&gpj.reg[i].answered_ms, 0);
+        gpj.reg[i].was_up = false;
+        gpj.reg[i].failures = 0;
+        gpj.reg[i].retry_at = 0;
+    }
+}
+
+// map a pjsua account id back to an index into voip_accounts
+static size_t acct_from_aid(pjsua_acc_id aid){
+    for(size_t i = 0; i < voip_naccounts; i++){
+        if(gpj.did_account[i] && gpj.aid[i] == aid) return i;
+    }
+    // pjsua couldn't match the message to an account; use the first one
+    return 0;
 }
 
 inline bool pj_str_match(const pj_str_t* a, const pj_str_t* b){
     return (a->slen == b->slen) && (strncmp(a->ptr, b->ptr, a->slen) == 0);
 }
 
-void pager_cb(pjsua_call_id call_id,
-              const pj_str_t *from,
-              const pj_str_t *to,
-              const pj_str_t *contact,
-              const pj_str_t *mime,
-              const pj_str_t *body){
+// hand a received MESSAGE to the rest of the plugin
+static void inbound_dispatch(size_t acct, const char* from, size_t flen,
+                             const char* mime, size_t mlen,
+                             const char* body, size_t blen){
     // print plain text messages to the buffer
-    pj_str_t text_plain = pj_str("text/plain");
-    if(pj_str_match(mime, &text_plain)){
+    if(mlen == strlen("text/plain") && strncmp(mime, "text/plain", mlen) == 0){
         // TODO: error handling
-        voip_plugin_handle_sms(from->ptr, from->slen,
-                               body->ptr, body->slen);
+        voip_plugin_handle_sms(acct, from, flen, body, blen);
     }
     // for non-text messages, save to a file and show an alert
     else{
         // TODO: error handling
-        voip_plugin_handle_mms(from->ptr, from->slen,
-                               mime->ptr, mime->slen,
-                               body->ptr, body->slen);
+        voip_plugin_handle_mms(acct, from, flen, mime, mlen, body, blen);
     }
 }
 
-int sip_client_send_sms(const char* sip_uri, const char* msg){
-    pj_str_t to = constify(sip_uri, strlen(sip_uri));
-    pj_str_t mime = pj_str("text/plain");
-    pj_str_t content = constify(msg, strlen(msg));
+// dispatch every queued MESSAGE and status, in the order they arrived
+static void inbound_drain(void){
+    pthread_mutex_lock(&inbound_lock);
+    sip_inbound_t* m = inbound;
+    inbound = NULL;
+    inbound_tail = &inbound;
+    pthread_mutex_unlock(&inbound_lock);
+    while(m){
+        sip_inbound_t* next = m->next;
+        if(m->token){
+            voip_plugin_sms_status(m->token, m->code, m->data, m->blen);
+            free(m);
+            m = next;
+            continue;
+        }
+        inbound_dispatch(m->acct, m->data, m->flen, m->data + m->flen, m->mlen,
+                         m->data + m->flen + m->mlen, m->blen);
+        free(m);
+        m = next;
+    }
+}
+
+static int inbound_fd_cb(const void* ptr, void* data, int fd){
+    (void)ptr;
+    (void)data;
+    char buf[64];
+    while(read(fd, buf, sizeof(buf)) > 0);
+    inbound_drain();
+    return WEECHAT_RC_OK;
+}
+
+// queue something for the main loop, and wake it up
+static void inbound_push(sip_inbound_t* m){
+    pthread_mutex_lock(&inbound_lock);
+    *inbound_tail = m;
+    inbound_tail = &m->next;
+    pthread_mutex_unlock(&inbound_lock);
+    // (a full pipe already has a wakeup in it)
+    if(write(gpj.inbound_pipe[1], "", 1) < 0){}
+}
+
+void pager_cb(pjsua_call_id call_id,
+              const pj_str_t *from,
+              const pj_str_t *to,
+              const pj_str_t *contact,
+              const pj_str_t *mime,
+              const pj_str_t *body,
+              pjsip_rx_data *rdata,
+              pjsua_acc_id acc_id){
+    // which of our accounts was this sent to?
+    size_t acct = acct_from_aid(acc_id);
+    if(trace_enabled()){
+        trace_record(&(trace_event_t){ .kind = TRACE_RX, .acct = acct,
+                     .from = from->ptr, .flen = from->slen,
+                     .to = to->ptr, .tlen = to->slen,
+                     .mime = mime->ptr, .mlen = mime->slen,
+                     .body = body->ptr, .blen = body->slen });
+    }
+    // without threads we're already on the main loop
+    if(!gpj.queue_inbound){
+        inbound_dispatch(acct, from->ptr, from->slen, mime->ptr, mime->slen,
+                         body->ptr, body->slen);
+        return;
+    }
+    size_t len = from->slen + mime->slen + body->slen;
+    sip_inbound_t* m = malloc(sizeof(*m) + len);
+    // TODO: error handling
+    if(!m) return;
+    *m = (sip_inbound_t){ .acct = acct, .flen = from->slen,
+                          .mlen = mime->slen, .blen = body->slen };
+    memcpy(m->data, from->ptr, m->flen);
+    memcpy(m->data + m->flen, mime->ptr, m->mlen);
+    memcpy(m->data + m->flen + m->mlen, body->ptr, m->blen);
+    inbound_push(m);
+}
 
-    pjsua_im_send(gpj.aid, &to, &mime, &content, NULL, NULL);
+// pass a sent message's status on, from the main loop
+static void status_post(void* token, int code, const char* reason,
+                        size_t rlen){
+    // without threads we're already on the main loop
+    if(!gpj.queue_inbound){
+        voip_plugin_sms_status(token, code, reason, rlen);
+        return;
+    }
+    sip_inbound_t* m = malloc(sizeof(*m) + rlen);
     // TODO: error handling
+    if(!m) return;
+    *m = (sip_inbound_t){ .token = token, .code = code, .blen = rlen };
+    memcpy(m->data, reason, rlen);
+    inbound_push(m);
+}
+
+/* count one answer to a message (or, with code 0, the end of sending it);
+   once they're all in, pass the token on (answers come in on pjsip threads,
+   so that's queued for the main loop, like a received MESSAGE) */
+static void send_answered(sip_send_t* send, int code, const char* reason,
+                          size_t rlen){
+    pthread_mutex_lock(&send_lock);
+    if(code && (send->code == 0 || send->code / 100 == 2)){
+        send->code = code;
+        if(rlen >= sizeof(send->reason)) rlen = sizeof(send->reason) - 1;
+        memcpy(send->reason, reason, rlen);
+        send->reason[rlen] = '\0';
+    }
+    bool done = --send->remaining == 0;
+    pthread_mutex_unlock(&send_lock);
+    if(!done) return;
+    if(send->token){
+        status_post(send->token, send->code, send->reason,
+                    strlen(send->reason));
+    }
+    free(send);
+}
+
+// the final status of a MESSAGE we sent
+void pager_status_cb(pjsua_call_id call_id,
+                     const pj_str_t *to,
+                     const pj_str_t *body,
+                     void *user_data,
+                     pjsip_status_code status,
+                     const pj_str_t *reason){
+    // every MESSAGE we send is timed (see sip_client_send_sms)
+    if(!user_data) return;
+    sip_send_t* send = latency_done(user_data, (int)status);
+    if(!send) return;
+    send_answered(send, (int)status, reason->ptr, reason->slen);
+}
+
+// the answer to a REGISTER (or a failure to send one)
+void reg_state_cb(pjsua_acc_id acc_id, pjsua_reg_info *info){
+    size_t acct = acct_from_aid(acc_id);
+    struct pjsip_regc_cbparam *p = info->cbparam;
+    if(!p) return;
+    // a transport error has no status code of its own
+    int code = p->code ? p->code : 503;
+    bool up = p->status == PJ_SUCCESS && code / 100 == 2 && p->expiration > 0;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    atomic_store(&gpj.reg[acct].answered_ms,
+                 (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000);
+    atomic_store(&gpj.reg[acct].up, up);
+    atomic_store(&gpj.reg[acct].code, code);
+}
+
+bool sip_client_registered(size_t acct){
+    return acct < voip_naccounts && atomic_load(&gpj.reg[acct].up);
+}
+
+// seconds to wait before the next attempt: exponential, with jitter
+static time_t reg_backoff(unsigned failures){
+    time_t secs = SIP_RECONNECT_SECS > 0 ? SIP_RECONNECT_SECS : 1;
+    while(failures-- && secs < SIP_RECONNECT_MAX_SECS) secs *= 2;
+    if(secs > SIP_RECONNECT_MAX_SECS) secs = SIP_RECONNECT_MAX_SECS;
+    // anywhere from half to all of it, so many clients don't retry together
+    return secs / 2 + rand() % (secs / 2 + 1);
+}
+
+/* once a second: notice registrations which were lost or regained, retry
+   failed ones, and let queued messages go once an account is registered */
+static int sip_watchdog_cb(const void* ptr, void* data, int remaining_calls){
+    (void)ptr;
+    (void)data;
+    (void)remaining_calls;
+    time_t now = time(NULL);
+    bool all_up = true;
+    long long last_up_ms = 0;
+    for(size_t i = 0; i < voip_naccounts; i++){
+        if(!gpj.did_account[i]) continue;
+        reg_state_t* r = &gpj.reg[i];
+        const char* label = *voip_accounts[i].label ? voip_accounts[i].label
+                                                    : voip_accounts[i].username;
+        int code = atomic_load(&r->code);
+        if(atomic_load(&r->up)){
+            if(!r->was_up && voip_buffer){
+                weechat_printf(voip_buffer, "voipms: %s registered", label);
+            }
+            r->was_up = true;
+            long long at = atomic_load(&r->answered_ms);
+            if(at > last_up_ms) last_up_ms = at;
+            r->failures = 0;
+            r->retry_at = 0;
+            voip_plugin_sip_ready(i);
+            continue;
+        }
+        all_up = false;
+        // nothing to do until the REGISTER in progress is answered
+        if(code == 0) continue;
+        if(!r->retry_at){
+            time_t wait = reg_backoff(r->failures++);
+            r->retry_at = now + wait;
+            if(voip_buffer && (r->was_up || r->failures == 1)){
+                weechat_printf(voip_buffer, "voipms: %s is not registered "
+                               "(%d), retrying in %lds", label, code,
+                               (long)wait);
+            }
+            r->was_up = false;
+        }else if(now >= r->retry_at){
+            r->retry_at = 0;
+            atomic_store(&r->code, 0);
+            if(pjsua_acc_set_registration(gpj.aid[i], PJ_TRUE)
+                    != PJ_SUCCESS){
+                // try again later
+                atomic_store(&r->code, 503);
+            }
+        }
+    }
+    if(all_up) startup_registered(last_up_ms);
+    return WEECHAT_RC_OK;
+}
+
+/* send a message without waiting for the answer; if token is not NULL, the
+   answer is passed to voip_plugin_sms_status() along with it.  Either way
+   the answer's delay is recorded by latency_done().  A message longer than
+   SMS_SEGMENT_CHARS goes as several MESSAGEs, sent back to back; they are
+   answered together. */
+int sip_client_send_sms(size_t acct, const sip_uri_t* uri, const char* msg,
+                        void* token){
+    if(acct >= voip_naccounts || !gpj.did_account[acct]) return 1;
+
+    pj_str_t to = constify(uri->str, uri->len);
+    pj_str_t mime = pj_str("text/plain");
+    sip_send_t* send = malloc(sizeof(*send));
+    if(!send) return 3;
+    *send = (sip_send_t){ .token = token, .remaining = 1 };
+
+    const char* p = msg;
+    size_t left = strlen(msg);
+    int retval = 0;
+    do{
+        size_t seg = segment_next(p, left, SMS_SEGMENT_CHARS);
+        pj_str_t content = constify(p, seg);
+        if(trace_enabled()){
+            trace_record(&(trace_event_t){ .kind = TRACE_TX, .acct = acct,
+                         .from = "", .to = uri->str, .tlen = uri->len,
+                         .mime = mime.ptr, .mlen = mime.slen,
+                         .body = p, .blen = seg });
+        }
+        // time it until the answer (which gets send back to us)
+        void* req = latency_submit(acct, uri, send);
+        if(!req){
+            retval = 3;
+            break;
+        }
+        pthread_mutex_lock(&send_lock);
+        send->remaining++;
+        pthread_mutex_unlock(&send_lock);
+        pj_status_t pret = pjsua_im_send(gpj.aid[acct], &to, &mime, &content,
+                                         NULL, req);
+        if(pret != PJ_SUCCESS){
+            latency_cancel(req);
+            pthread_mutex_lock(&send_lock);
+            send->remaining--;
+            pthread_mutex_unlock(&send_lock);
+            retval = 2;
+            break;
+        }
+        p += seg;
+        left -= seg;
+    }while(left);
+
+    if(retval && p == msg){
+        // nothing went out, so the caller can try it all again
+        free(send);
+        return retval;
+    }
+    if(retval){
+        // some of it went out; the token hears about the rest failing
+        const char* reason = "not every segment could be sent";
+        send_answered(send, 500, reason, strlen(reason));
+        return 0;
+    }
+    send_answered(send, 0, NULL, 0);
     return 0;
 }
 
@@ -61,14 +468,100 @@ void pj_log_cb(int level, const char* data, int len){
     if(voip_buffer) weechat_printf(voip_buffer, "%.*s", len, data);
 }
 
+// handle whatever pjsip has ready (packets, timers) without blocking
+static void sip_pump(void){
+    for(int i = 0; i < SIP_PUMP_MAX; i++){
+        if(pjsua_handle_events(0) <= 0) break;
+    }
+}
+
+static int sip_poll_cb(const void* ptr, void* data, int remaining_calls){
+    (void)ptr;
+    (void)data;
+    (void)remaining_calls;
+    sip_pump();
+    return WEECHAT_RC_OK;
+}
+
+static int sip_fd_cb(const void* ptr, void* data, int fd){
+    (void)ptr;
+    (void)data;
+    (void)fd;
+    sip_pump();
+    return WEECHAT_RC_OK;
+}
+
+/* with SIP_THREADS 0 we create the UDP transport ourselves, since pjsua
+   doesn't tell us the socket of the ones it creates, and wake up as soon as
+   a packet arrives on it */
+static int udp_transport_create(void){
+    pjsip_transport* tp;
+    pj_sockaddr_in local;
+    pj_sockaddr_in_init(&local, NULL, 0);
+    pj_status_t pret = pjsip_udp_transport_start(pjsua_get_pjsip_endpt(),
+                                                 &local, NULL, 1, &tp);
+    if(pret != PJ_SUCCESS) return 1;
+    pret = pjsua_transport_register(tp, &gpj.tid);
+    if(pret != PJ_SUCCESS){
+        pjsip_transport_shutdown(tp);
+        return 1;
+    }
+    gpj.did_transport = true;
+
+    pj_sock_t sock = pjsip_udp_transport_get_socket(tp);
+    gpj.fd_hook = weechat_hook_fd((int)sock, 1, 0, 0, sip_fd_cb, NULL, NULL);
+    if(!gpj.fd_hook) return 1;
+    return 0;
+}
+
 int sip_setup(void){
     // set global_pj_state to default values
     global_pj_state_reset();
 
+    // pjsua has a compile-time limit on the number of accounts
+    if(voip_naccounts == 0 || voip_naccounts > PJSUA_MAX_ACC){
+        if(voip_buffer){
+            weechat_printf(voip_buffer, "voipms: between 1 and %d accounts "
+                           "are supported, got %zu", PJSUA_MAX_ACC,
+                           voip_naccounts);
+        }
+        return 1;
+    }
+
+    pjsip_transport_type_e type;
+    const char* uri_param;
+    if(transport_type(SIP_TRANSPORT, &type, &uri_param)){
+        if(voip_buffer){
+            weechat_printf(voip_buffer, "voipms: unknown SIP_TRANSPORT "
+                           "\"%s\" (use udp, tcp or tls)", SIP_TRANSPORT);
+        }
+        return 1;
+    }
+
+    /* pjsip's threads queue what they receive for the main loop, where it
+       can't interleave with the restore or anything else printing */
+    if(SIP_THREADS > 0){
+        if(pipe(gpj.inbound_pipe)) return 1;
+        fcntl(gpj.inbound_pipe[0], F_SETFL, O_NONBLOCK);
+        fcntl(gpj.inbound_pipe[1], F_SETFL, O_NONBLOCK);
+        gpj.inbound_hook = weechat_hook_fd(gpj.inbound_pipe[0], 1, 0, 0,
+                                           inbound_fd_cb, NULL, NULL);
+        if(!gpj.inbound_hook){
+            sip_teardown();
+            return 1;
+        }
+        gpj.queue_inbound = true;
+    }
+
     // CREATE
     pj_status_t pret = pjsua_create();
     if(pret != PJ_SUCCESS){
-        // TODO print error message
+        if(voip_buffer){
+            weechat_printf(voip_buffer, "voipms: unable to start pjsua "
+                           "(error %d)", pret);
+        }
+        // (the inbound pipe and its hook are already set up)
+        sip_teardown();
         return 1;
     }
     gpj.did_create = true;
@@ -77,7 +570,10 @@ int sip_setup(void){
     // INIT
     pjsua_config pc;
     pjsua_config_default(&pc);
-    pc.cb.on_pager = &pager_cb;
+    pc.thread_cnt = SIP_THREADS;
+    pc.cb.on_pager2 = &pager_cb;
+    pc.cb.on_pager_status = &pager_status_cb;
+    pc.cb.on_reg_state2 = &reg_state_cb;
     //pc.cb.on_incoming_call = &incoming_call_cb;
     //pc.cb.on_call_state = &on_call_state;
     //pc.cb.on_call_media_state = &on_call_media_state;
@@ -90,6 +586,11 @@ int sip_setup(void){
     // configure media
     pjsua_media_config mc;
     pjsua_media_config_default(&mc);
+    // we only do messages, so there's no media to work on
+    if(SIP_THREADS == 0){
+        mc.thread_cnt = 0;
+        mc.has_ioqueue = PJ_FALSE;
+    }
     // disable auto-closing of snd device
     //// mc.snd_auto_close_time = -1;
     pret = pjsua_init(&pc, &lc, &mc);
@@ -100,16 +601,46 @@ int sip_setup(void){
     }
 
     // TRANSPORT
+    /* for TCP and TLS, pjsip keeps one connection per destination open and
+       reuses it for REGISTER and every MESSAGE; keepalives stop NAT bindings
+       from expiring between messages */
+    pjsip_cfg()->tcp.keep_alive_interval = SIP_KEEPALIVE_SECS;
+    pjsip_cfg()->tls.keep_alive_interval = SIP_KEEPALIVE_SECS;
     pjsua_transport_config tc;
     pjsua_transport_config_default(&tc);
-    pjsip_transport_type_e type = PJSIP_TRANSPORT_UDP;
-    pret = pjsua_transport_create(type, &tc, &gpj.tid);
-    if(pret != PJ_SUCCESS){
-        // TODO print error message
-        sip_teardown();
-        return 10;
+    if(type == PJSIP_TRANSPORT_TLS){
+        // a CA file lets us talk to servers with self-signed certificates
+        if(*SIP_TLS_CA_FILE){
+            tc.tls_setting.ca_list_file = pj_str(SIP_TLS_CA_FILE);
+        }
+        tc.tls_setting.verify_server = SIP_TLS_VERIFY_SERVER;
+    }
+    if(SIP_THREADS == 0 && type == PJSIP_TRANSPORT_UDP){
+        if(udp_transport_create()){
+            // TODO print error message
+            sip_teardown();
+            return 10;
+        }
+    }else{
+        pret = pjsua_transport_create(type, &tc, &gpj.tid);
+        if(pret != PJ_SUCCESS){
+            // TODO print error message
+            sip_teardown();
+            return 10;
+        }
+        gpj.did_transport = true;
+    }
+
+    /* without threads, pjsip's timers (registration, retransmissions,
+       keepalives) and TCP/TLS connections are run from a weechat timer */
+    if(SIP_THREADS == 0){
+        gpj.poll_hook = weechat_hook_timer(SIP_POLL_MS, 0, 0, sip_poll_cb,
+                                           NULL, NULL);
+        if(!gpj.poll_hook){
+            sip_teardown();
+            return 11;
+        }
     }
-    gpj.did_transport = true;
 
     // START
     pret = pjsua_start();
@@ -120,27 +651,61 @@ int sip_setup(void){
     }
 
     // ACCOUNT ADD
-    pjsip_cred_info creds = {
-        .realm = pj_str(REALM),
-        .scheme = pj_str("digest"),
-        .username = pj_str(USERNAME),
-        .data_type = PJSIP_CRED_DATA_PLAIN_PASSWD,
-        .data = pj_str(PASSWORD),
-    };
-    pjsua_acc_config ac;
-    pjsua_acc_config_default(&ac);
-    ac.id = pj_str(ACCOUNT_ID);
-    ac.reg_uri = pj_str(REGISTER_URI);
-    ac.cred_info[0] = creds;
-    ac.cred_count = 1;
-    int make_default_account = 1;
-    pret = pjsua_acc_add(&ac, make_default_account, &gpj.aid);
-    if(pret != PJ_SUCCESS){
-        // TODO print error message
+    for(size_t i = 0; i < voip_naccounts; i++){
+        const voip_account_t* acct = &voip_accounts[i];
+        // this is for registering the account
+        char account_id[256];
+        char register_uri[256];
+        // all requests go through the registrar over the same connection
+        char proxy_uri[256];
+        snprintf(account_id, sizeof(account_id), "sip:%s@%s",
+                 acct->username, acct->realm);
+        snprintf(register_uri, sizeof(register_uri), "sip:%s%s",
+                 acct->realm, uri_param);
+        snprintf(proxy_uri, sizeof(proxy_uri), "sip:%s%s;lr",
+                 acct->realm, uri_param);
+
+        pjsip_cred_info creds = {
+            .realm = constify(acct->realm, strlen(acct->realm)),
+            .scheme = pj_str("digest"),
+            .username = constify(acct->username, strlen(acct->username)),
+            .data_type = PJSIP_CRED_DATA_PLAIN_PASSWD,
+            .data = constify(acct->password, strlen(acct->password)),
+        };
+        pjsua_acc_config ac;
+        pjsua_acc_config_default(&ac);
+        ac.id = pj_str(account_id);
+        ac.reg_uri = pj_str(register_uri);
+        ac.cred_info[0] = creds;
+        ac.cred_count = 1;
+        // every account shares the one transport
+        ac.transport_id = gpj.tid;
+        if(type != PJSIP_TRANSPORT_UDP){
+            ac.proxy[0] = pj_str(proxy_uri);
+            ac.proxy_cnt = 1;
+        }
+        // UDP keepalives (TCP and TLS are kept alive by the transport)
+        ac.ka_interval = SIP_KEEPALIVE_SECS;
+        // failed registrations are retried by our watchdog instead
+        ac.reg_retry_interval = 0;
+        int make_default_account = (i == 0);
+        pret = pjsua_acc_add(&ac, make_default_account, &gpj.aid[i]);
+        if(pret != PJ_SUCCESS){
+            // TODO print error message
+            sip_teardown();
+            return 30;
+        }
+        gpj.did_account[i] = true;
+    }
+
+    // watch the registrations from here on
+    srand((unsigned)time(NULL) ^ (unsigned)getpid());
+    gpj.watchdog_hook = weechat_hook_timer(1000, 0, 0, sip_watchdog_cb,
+                                           NULL, NULL);
+    if(!gpj.watchdog_hook){
         sip_teardown();
-        return 30;
+        return 31;
     }
-    gpj.did_account = true;
     return 0;
 }
 
@@ -148,13 +713,20 @@ int sip_teardown(){
     pj_status_t pret;
     int retval = 0;
 
+    if(gpj.watchdog_hook){
+        weechat_unhook(gpj.watchdog_hook);
+        gpj.watchdog_hook = NULL;
+    }
+
     // ACCOUNT DELETE
-    if(gpj.did_account){
-        pret = pjsua_acc_del(gpj.aid);
+    for(size_t i = 0; i < PJSUA_MAX_ACC; i++){
+        if(!gpj.did_account[i]) continue;
+        pret = pjsua_acc_del(gpj.aid[i]);
         if(pret != PJ_SUCCESS){
             // TODO print error message
             retval = 1;
         }
+        gpj.did_account[i] = false;
     }
 
     // TRANSPORT
@@ -166,6 +738,17 @@ int sip_teardown(){
         }
     }
 
+    /* stop pumping events from weechat; pjsua_destroy() handles the last of
+       them (e.g. unregistering) itself */
+    if(gpj.poll_hook){
+        weechat_unhook(gpj.poll_hook);
+        gpj.poll_hook = NULL;
+    }
+    if(gpj.fd_hook){
+        weechat_unhook(gpj.fd_hook);
+        gpj.fd_hook = NULL;
+    }
+
     // DESTROY
     if(gpj.did_create){
         pj_status_t pret = pjsua_destroy();
@@ -173,6 +756,19 @@ int sip_teardown(){
             // TODO log this
             retval = 3;
         }
+        gpj.did_create = false;
+    }
+
+    // pjsip's threads are gone; whatever they queued is handled now
+    if(gpj.inbound_hook){
+        weechat_unhook(gpj.inbound_hook);
+        gpj.inbound_hook = NULL;
+    }
+    inbound_drain();
+    gpj.queue_inbound = false;
+    for(int i = 0; i < 2; i++){
+        if(gpj.inbound_pipe[i] >= 0) close(gpj.inbound_pipe[i]);
+        gpj.inbound_pipe[i] = -1;
     }
 
     return retval;
@@ -1,6 +1,8 @@
 #ifndef SIP_CLIENT_H
 #define SIP_CLIENT_H
 
+#include <stdbool.h>
+
 #include <pjlib.h>
 #include <pjlib-util.h>
 #include <pjmedia.h>
@@ -10,9 +12,15 @@
 #include <pjsip_ua.h>
 #include <pjsua-lib/pjsua.h>
 
+#include "uri.h"
+
 int sip_setup();
 int sip_teardown();
 
-int sip_client_send_sms(const char* contact, const char* msg);
+// whether an account is registered (and so can send messages right now)
+bool sip_client_registered(size_t acct);
+
+int sip_client_send_sms(size_t acct, const sip_uri_t* uri, const char* msg,
+                        void* token);
 
 #endif // SIP_CLIENT_H
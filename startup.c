@@ -0,0 +1,99 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include "startup.h"
+#include "voipms.h"
+
+// most phases of weechat_plugin_init() to report
+#define STARTUP_PHASES 16
+
+typedef struct {
+    const char* name;
+    long ms;
+} startup_phase_t;
+
+struct startup {
+    struct timespec start;
+    // the end of the last phase
+    struct timespec last;
+    startup_phase_t phases[STARTUP_PHASES];
+    size_t nphases;
+    // milliseconds after start, or -1 while still running
+    long restore_ms;
+    long register_ms;
+    bool running;
+};
+
+struct startup startup;
+
+static long ms_between(const struct timespec* a, const struct timespec* b){
+    return (b->tv_sec - a->tv_sec) * 1000
+           + (b->tv_nsec - a->tv_nsec) / 1000000;
+}
+
+void startup_begin(void){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    startup = (struct startup){ .start = now, .last = now, .restore_ms = -1,
+                                .register_ms = -1, .running = true };
+}
+
+void startup_mark(const char* phase){
+    if(!startup.running) return;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if(startup.nphases < STARTUP_PHASES){
+        startup.phases[startup.nphases++] =
+            (startup_phase_t){ phase, ms_between(&startup.last, &now) };
+    }
+    startup.last = now;
+}
+
+static void startup_report(void){
+    if(!voip_buffer) return;
+    if(startup.restore_ms < 0 || startup.register_ms < 0){
+        bool restored = startup.restore_ms >= 0;
+        weechat_printf(voip_buffer, "voipms: %s after %ldms, waiting for %s",
+                       restored ? "history restored" : "registered",
+                       restored ? startup.restore_ms : startup.register_ms,
+                       restored ? "registration" : "the history");
+        return;
+    }
+    char setup[512];
+    size_t len = 0;
+    setup[0] = '\0';
+    for(size_t i = 0; i < startup.nphases && len < sizeof(setup); i++){
+        len += snprintf(setup + len, sizeof(setup) - len, "%s%s %ldms",
+                        i ? ", " : "", startup.phases[i].name,
+                        startup.phases[i].ms);
+    }
+    long ready = startup.restore_ms > startup.register_ms
+                 ? startup.restore_ms : startup.register_ms;
+    weechat_printf(voip_buffer, "voipms: ready in %ldms (setup: %s; "
+                   "history %ldms; registration %ldms)", ready, setup,
+                   startup.restore_ms, startup.register_ms);
+}
+
+// one of the two things running in the background finished at ms
+static void startup_done(long* ms, long long at_ms){
+    if(!startup.running || *ms >= 0) return;
+    long long start_ms = (long long)startup.start.tv_sec * 1000
+                         + startup.start.tv_nsec / 1000000;
+    *ms = at_ms > start_ms ? (long)(at_ms - start_ms) : 0;
+    startup_report();
+    if(startup.restore_ms >= 0 && startup.register_ms >= 0){
+        startup.running = false;
+    }
+}
+
+void startup_restored(void){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    startup_done(&startup.restore_ms,
+                 (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000);
+}
+
+void startup_registered(long long at_ms){
+    startup_done(&startup.register_ms, at_ms);
+}
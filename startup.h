@@ -0,0 +1,23 @@
+#ifndef STARTUP_H
+#define STARTUP_H
+
+/* How long the plugin takes to start.  weechat_plugin_init() marks the end
+   of each of its (synchronous) phases, then leaves two things running side
+   by side: the restore of the history and the registration of every
+   account.  Once both are done, voip_buffer gets one line with the time of
+   each; the plugin is ready after whichever of the two took longer. */
+
+// the plugin is starting: time everything from now
+void startup_begin(void);
+
+// a phase of weechat_plugin_init() just ended (phase must be a literal)
+void startup_mark(const char* phase);
+
+// the history is restored (or there was none to restore)
+void startup_restored(void);
+
+/* every account is registered, the last of them at at_ms (CLOCK_MONOTONIC
+   milliseconds) */
+void startup_registered(long long at_ms);
+
+#endif // STARTUP_H
@@ -1,8 +1,518 @@
+#include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <time.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <unistd.h>
 
 #include "history.h"
+#include "trace.h"
+#include "segment.h"
+#include "importer.h"
+#include "recent.h"
+
+/* replace a conversation, append to it, and replace it again with an older
+   message merged in; returns 0 if it comes back in order */
+static int test_writer(const char* backend){
+    const char* fname = "<sip:5550000001@test>writer";
+    const time_t times[] = {100, 300, 400, 200};
+    const char* msgs[] = {"a", "c", "d", "b"};
+    hist_writer_t *w;
+    hist_msg_t *msg = NULL;
+    hist_buf_t *hist = NULL;
+    int retval = 1;
+
+    if(hist_use_backend(backend)) return 1;
+    // the first replacement makes this work on top of an earlier run
+    if(hist_writer_open("testfiles", "writer", fname, true, &w)) goto fail;
+    hist_writer_add(w, msgs[0], 1, true, times[0]);
+    hist_writer_add(w, msgs[1], 1, false, times[1]);
+    if(hist_writer_close(w)) goto fail;
+    if(hist_writer_open("testfiles", "writer", fname, false, &w)) goto fail;
+    hist_writer_add(w, msgs[2], 1, true, times[2]);
+    if(hist_writer_close(w)) goto fail;
+    if(hist_writer_open("testfiles", "writer", fname, true, &w)) goto fail;
+    const int order[] = {0, 3, 1, 2};
+    for(size_t i = 0; i < 4; i++){
+        int j = order[i];
+        hist_writer_add(w, msgs[j], 1, j % 2 == 0, times[j]);
+    }
+    if(hist_writer_close(w)) goto fail;
+
+    if(get_hist_msg("testfiles", "writer", fname, &msg)) goto fail;
+    size_t n = 0;
+    for(hist_msg_t *mp = msg; mp; mp = mp->next, n++){
+        if(n >= 4 || mp->time != times[order[n]]) break;
+    }
+    if(n != 4){
+        printf("%s writer: messages out of order\n", backend);
+        goto fail;
+    }
+    if(list_hist_bufs("testfiles", "writer", &hist) || !hist
+            || hist->count != 4 || hist->last != 400){
+        printf("%s writer: the list doesn't match the messages\n", backend);
+        goto fail;
+    }
+    retval = 0;
+
+fail:
+    free_hist_msg(msg);
+    free_hist_buf(hist);
+    hist_close();
+    hist_use_backend("files");
+    return retval;
+}
+
+/* cache messages too big for the slab (with a NUL in them) and small ones,
+   in two conversations, then forget them; returns 0 if the cache shrinks
+   back to nothing and a cleared conversation has no messages left */
+static int test_recent(void){
+    static sip_contact_t a, b;
+    static char big[5000];
+    memset(big, 'x', sizeof(big));
+    big[10] = '\0';
+    for(int i = 0; i < 100; i++){
+        recent_add(&a, 1, false, big, sizeof(big));
+        recent_add(&b, 1, true, "small", 5);
+    }
+    if(a.message_count == 0 || a.messages->len != sizeof(big)){
+        printf("recent: big messages weren't kept whole\n");
+        return 1;
+    }
+    recent_clear(&a);
+    if(a.messages || a.last_message || a.message_count){
+        printf("recent: a cleared conversation still has messages\n");
+        return 1;
+    }
+    recent_clear(&b);
+    if(recent_bytes() != 0){
+        printf("recent: %zu bytes left after clearing\n", recent_bytes());
+        return 1;
+    }
+    recent_stop();
+    return 0;
+}
+
+/* write a file for the import test */
+static int put_file(const char* path, const char* contents){
+    FILE* f = fopen(path, "w");
+    if(!f) return 1;
+    fputs(contents, f);
+    return fclose(f) != 0;
+}
+
+/* the messages of the conversation with number in the history of shard
+   match the n in want; returns 0 if they do */
+static int check_conv(const char* shard, const char* number,
+                      const hist_msg_t* want, size_t n){
+    hist_buf_t *hist = NULL, *p;
+    hist_msg_t *msg = NULL, *mp = NULL;
+    size_t i = 0;
+    if(list_hist_bufs("testfiles", shard, &hist)) return 1;
+    for(p = hist; p && !strstr(p->sip_uri, number); p = p->next);
+    if(p && get_hist_msg("testfiles", shard, p->filename, &msg) == 0){
+        for(mp = msg; mp && i < n; mp = mp->next, i++){
+            if(mp->time != want[i].time || mp->me != want[i].me
+                    || mp->len != want[i].len
+                    || memcmp(mp->msg, want[i].msg, mp->len) != 0) break;
+        }
+    }
+    bool ok = p && !mp && i == n;
+    free_hist_msg(msg);
+    free_hist_buf(hist);
+    if(!ok) printf("import: %s has message %zu wrong\n", number, i);
+    return ok ? 0 : 1;
+}
+
+/* import a CSV and a JSON export (one batch per message), then the same
+   again, then a message moved by less than IMPORT_SLOP and one moved by
+   more; returns 0 if the history has the right messages each time */
+static int test_import(void){
+    const char* dir = "testfiles/voipms/history/import";
+    const char* csv = "testfiles/import.csv";
+    const char* json = "testfiles/import.json";
+    const char* moved = "testfiles/import-moved.json";
+    const char* const both[] = {csv, json};
+    import_opts_t opts = { .wc_dir = "testfiles", .shard = "import",
+                           .realm = "test", .batch = 64 };
+    import_stats_t st;
+    int retval = 1;
+
+    // start from an empty shard, and read dates as UTC
+    DIR* d = opendir(dir);
+    if(d){
+        struct dirent* e;
+        char path[512];
+        while( (e = readdir(d)) ){
+            if(e->d_name[0] == '.' && strcmp(e->d_name, ".manifest")) continue;
+            snprintf(path, sizeof(path), "%s/%s", dir, e->d_name);
+            unlink(path);
+        }
+        closedir(d);
+    }
+    setenv("TZ", "UTC", 1);
+    tzset();
+
+    if(put_file(csv,
+            "date,type,did,contact,message\r\n"
+            "1500000000,1,5550000000,15551230001,\"hello, \"\"world\"\"\"\r\n"
+            "2017-07-14 02:45:00,0,5550000000,(555) 123-0001,\"two\n"
+            "lines\"\r\n"
+            "\r\n"
+            "1500000600,1,5550000000,5551230002,plain\r\n")) goto fail;
+    // (the second message repeats the CSV's first exactly)
+    if(put_file(json,
+            "{\"status\":\"success\",\"sms\":[\n"
+            " {\"id\":\"7\",\"date\":\"2017-07-14 02:51:40\",\"type\":\"0\","
+            "\"did\":\"5550000000\",\"contact\":\"5551230002\","
+            "\"message\":\"caf\\u00e9 \\ud83d\\ude00 \\\"q\\\" a\\/b\\tc\"},\n"
+            " {\"date\":\"1500000000\",\"type\":\"1\",\"did\":null,"
+            "\"contact\":\"5551230001\",\"message\":\"hello, \\\"world\\\"\"}\n"
+            "]}\n")) goto fail;
+    if(put_file(moved,
+            "[{\"date\":1500000060,\"type\":1,\"contact\":\"5551230001\","
+            "\"message\":\"hello, \\\"world\\\"\"},\n"
+            " {\"date\":1500001000,\"type\":0,\"contact\":\"5551230001\","
+            "\"message\":\"two\\nlines\"}]\n")) goto fail;
+
+    const char* emoji = "caf\xc3\xa9 \xf0\x9f\x98\x80 \"q\" a/b\tc";
+    hist_msg_t one[] = {
+        { .time = 1500000000, .me = false, .msg = "hello, \"world\"",
+          .len = 14 },
+        { .time = 1500000300, .me = true, .msg = "two\nlines", .len = 9 },
+        { .time = 1500001000, .me = true, .msg = "two\nlines", .len = 9 },
+    };
+    hist_msg_t two[] = {
+        { .time = 1500000600, .me = false, .msg = "plain", .len = 5 },
+        { .time = 1500000700, .me = true, .msg = (char*)emoji,
+          .len = strlen(emoji) },
+    };
+
+    for(int pass = 0; pass < 2; pass++){
+        if(import_files(&opts, both, 2, &st)) goto fail;
+        size_t added = pass ? 0 : 4, dups = pass ? 4 : 0;
+        if(st.read != 5 || st.bad || st.repeated != 1 || st.added != added
+                || st.dups != dups || st.convs != 2 || st.runs < 1){
+            printf("import pass %d: %zu read, %zu added, %zu already there, "
+                   "%zu repeated, %zu batches\n", pass, st.read, st.added,
+                   st.dups, st.repeated, st.runs + 1);
+            goto fail;
+        }
+        if(check_conv("import", "5551230001", one, 2)) goto fail;
+        if(check_conv("import", "5551230002", two, 2)) goto fail;
+    }
+
+    const char* const late[] = {moved};
+    if(import_files(&opts, late, 1, &st)) goto fail;
+    if(st.added != 1 || st.dups != 1){
+        printf("import moved: %zu added, %zu already there\n", st.added,
+               st.dups);
+        goto fail;
+    }
+    if(check_conv("import", "5551230001", one, 3)) goto fail;
+    retval = 0;
+
+fail:
+    unsetenv("TZ");
+    tzset();
+    return retval;
+}
+
+// the number of messages in the file fname of the rename shard, or -1
+static long count_msgs(const char* fname){
+    hist_msg_t *msg;
+    if(get_hist_msg("testfiles", "rename", fname, &msg)) return -1;
+    long n = 0;
+    for(hist_msg_t *mp = msg; mp; mp = mp->next) n++;
+    free_hist_msg(msg);
+    return n;
+}
+
+/* give a conversation new names: from one of our appends, after something
+   else renamed its file, and after a list; returns 0 if each time the file
+   took the new name and kept the messages */
+static int test_rename(void){
+    const char* dir = "testfiles/voipms/history/rename";
+    const char* names[] = {"<5550000005@test>old", "<5550000005@test>new",
+                           "<5550000005@test>other", "<5550000005@test>last"};
+    char path[256], path2[256];
+    hist_buf_t *hist = NULL;
+
+    mkdir(dir, 0777);
+    for(size_t i = 0; i < 4; i++){
+        snprintf(path, sizeof(path), "%s/%s", dir, names[i]);
+        unlink(path);
+    }
+    int ret = hist_add_msg("testfiles", "rename", names[0], "a", 1, true,
+                           NULL);
+    ret |= hist_add_msg("testfiles", "rename", names[1], "b", 1, true, NULL);
+    // behind our back, so the index of names is out of date
+    snprintf(path, sizeof(path), "%s/%s", dir, names[1]);
+    snprintf(path2, sizeof(path2), "%s/%s", dir, names[2]);
+    ret |= rename(path, path2);
+    ret |= hist_add_msg("testfiles", "rename", names[1], "c", 1, true, NULL);
+    ret |= list_hist_bufs("testfiles", "rename", &hist);
+    free_hist_buf(hist);
+    ret |= hist_add_msg("testfiles", "rename", names[3], "d", 1, true, NULL);
+    if(ret) return 1;
+
+    long counts[4];
+    for(size_t i = 0; i < 4; i++){
+        snprintf(path, sizeof(path), "%s/%s", dir, names[i]);
+        counts[i] = access(path, F_OK) ? 0 : count_msgs(names[i]);
+    }
+    if(counts[0] || counts[1] || counts[2] || counts[3] != 4){
+        printf("rename: %ld, %ld, %ld and %ld messages\n", counts[0],
+               counts[1], counts[2], counts[3]);
+        return 1;
+    }
+    return 0;
+}
+
+/* list a conversation, append to its file behind the manifest's back (which
+   leaves the directory's mtime alone), and list it twice more; returns 0 if
+   both lists see the new message */
+static int test_manifest_append(void){
+    const char* dir = "testfiles/voipms/history/append";
+    const char* fname = "<5550000004@test>append";
+    const char* recs[] = {"100:0:1:a\n", "200:1:1:b\n"};
+    char path[256];
+    hist_buf_t *hist = NULL;
+
+    mkdir(dir, 0777);
+    snprintf(path, sizeof(path), "%s/%s", dir, fname);
+    for(size_t i = 0; i < 2; i++){
+        FILE* f = fopen(path, i ? "a" : "w");
+        if(!f) return 1;
+        fputs(recs[i], f);
+        fclose(f);
+        for(size_t pass = 0; pass < 1 + i; pass++){
+            if(list_hist_bufs("testfiles", "append", &hist)) return 1;
+            bool ok = hist && !hist->next && hist->count == i + 1
+                      && hist->last == (time_t)(100 * (i + 1));
+            free_hist_buf(hist);
+            hist = NULL;
+            if(!ok){
+                printf("manifest: append %zu not listed on pass %zu\n", i,
+                       pass);
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+/* merge a good file with one that goes bad after its first message; returns
+   0 if the error names the bad file and the good one is still merged */
+static int test_merge_error(void){
+    const char* dir = "testfiles/voipms/history/merge";
+    const char* names[] = {"<5550000002@test>good", "<5550000003@test>bad"};
+    const char* contents[] = {"100:0:1:a\n300:0:1:c\n",
+                              "200:1:1:b\nx1:0:1:z\n"};
+    const time_t expect[] = {100, 200, 300};
+    char path[256];
+    hist_merge_t *merge = NULL;
+    hist_msg_t *mm;
+    void *tag;
+    size_t n = 0, errors = 0;
+    int ret;
+
+    mkdir(dir, 0777);
+    for(size_t i = 0; i < 2; i++){
+        snprintf(path, sizeof(path), "%s/%s", dir, names[i]);
+        FILE* f = fopen(path, "w");
+        if(!f) return 1;
+        fputs(contents[i], f);
+        fclose(f);
+    }
+    if(hist_merge_new(&merge)) return 1;
+    for(size_t i = 0; i < 2; i++){
+        if(hist_merge_add_file(merge, "testfiles", "merge", names[i], 0,
+                               (void*)names[i])){
+            hist_merge_free(merge);
+            return 1;
+        }
+    }
+    while( (ret = hist_merge_next(merge, &mm, &tag)) != 1 ){
+        if(ret){
+            if(tag != names[1]) break;
+            errors++;
+            continue;
+        }
+        if(n >= 3 || mm->time != expect[n]) break;
+        n++;
+    }
+    hist_merge_free(merge);
+    if(ret != 1 || n != 3 || errors != 1){
+        printf("merge: %zu messages and %zu errors before %d\n", n, errors,
+               ret);
+        return 1;
+    }
+    return 0;
+}
+
+/* merge from since in a file several reader chunks long, whose bodies have
+   newlines and text that looks like records; returns 0 if exactly the
+   messages since come out, for a since before, inside and after the file */
+static int test_merge_since(void){
+    const char* dir = "testfiles/voipms/history/since";
+    const char* name = "<5550000004@test>since";
+    const size_t count = 4000;
+    const time_t sinces[] = {1, 2500, 3999, 5000};
+    char path[256];
+    hist_merge_t *merge = NULL;
+    hist_msg_t *mm;
+    void *tag;
+    int ret;
+
+    mkdir(dir, 0777);
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    FILE* f = fopen(path, "w");
+    if(!f) return 1;
+    for(size_t i = 1; i <= count; i++){
+        char body[64];
+        int len = snprintf(body, sizeof(body), "%zu\n1:0:2:zz\n%zu:0:", i, i);
+        fprintf(f, "%zu:%d:%d:%s\n", i, (int)(i & 1), len, body);
+    }
+    fclose(f);
+
+    for(size_t i = 0; i < sizeof(sinces) / sizeof(*sinces); i++){
+        size_t n = 0;
+        time_t first = 0;
+        if(hist_merge_new(&merge)) return 1;
+        if(hist_merge_add_file(merge, "testfiles", "since", name, sinces[i],
+                               NULL)){
+            hist_merge_free(merge);
+            return 1;
+        }
+        while( (ret = hist_merge_next(merge, &mm, &tag)) == 0 ){
+            if(!n) first = mm->time;
+            n++;
+        }
+        hist_merge_free(merge);
+        size_t want = sinces[i] > (time_t)count ? 0
+                      : count - (size_t)sinces[i] + 1;
+        if(ret != 1 || n != want || (n && first != sinces[i])){
+            printf("merge since %ld: %zu messages from %ld, expected %zu\n",
+                   (long)sinces[i], n, (long)first, want);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* record a few events (one with a body larger than a varint byte can say,
+   one out of clock order) and read them back; returns 0 if they match */
+static int test_trace(void){
+    const char* path = "testfiles/trace";
+    char big[300];
+    memset(big, 'x', sizeof(big));
+    const trace_event_t evs[] = {
+        { .kind = TRACE_RX, .acct = 1, .usec = 1000000,
+          .from = "<sip:1@t>", .flen = 9, .to = "<sip:2@t>", .tlen = 9,
+          .mime = "text/plain", .mlen = 10, .body = "hi", .blen = 2 },
+        { .kind = TRACE_TX, .acct = 0, .usec = 1000250,
+          .from = "", .to = "<sip:1@t>", .tlen = 9,
+          .mime = "text/plain", .mlen = 10, .body = big, .blen = sizeof(big) },
+        { .kind = TRACE_RX, .acct = 0, .usec = 999000,
+          .from = "<sip:1@t>", .flen = 9, .to = "", .mime = "image/png",
+          .mlen = 9, .body = "\0png", .blen = 4 },
+    };
+    const int64_t expect[] = {1000000, 1000250, 1000250};
+    trace_reader_t *r;
+    trace_event_t ev;
+    size_t n = 0;
+    int ret;
+
+    if(trace_open(path)) return 1;
+    for(size_t i = 0; i < 3; i++) trace_record(&evs[i]);
+    trace_close();
+    if(trace_reader_open(path, &r)) return 1;
+    while( (ret = trace_reader_next(r, &ev)) == 0 ){
+        if(n >= 3) break;
+        const trace_event_t* e = &evs[n];
+        if(ev.kind != e->kind || ev.acct != e->acct || ev.usec != expect[n]
+                || ev.flen != e->flen || memcmp(ev.from, e->from, e->flen)
+                || ev.tlen != e->tlen || memcmp(ev.to, e->to, e->tlen)
+                || ev.mlen != e->mlen || memcmp(ev.mime, e->mime, e->mlen)
+                || ev.blen != e->blen || memcmp(ev.body, e->body, e->blen)){
+            break;
+        }
+        n++;
+    }
+    trace_reader_close(r);
+    if(ret != 1 || n != 3){
+        printf("trace: event %zu didn't come back (%d)\n", n, ret);
+        return 1;
+    }
+    return 0;
+}
+
+/* split a long message without spaces, one with them, and one of two-byte
+   characters; returns 0 if the segments are the right size and add back up
+   to the message */
+static int test_segment(void){
+    char msg[401];
+    const char* fills[] = {"a", "word ", "\xc3\xa9"};
+    for(size_t f = 0; f < 3; f++){
+        size_t flen = strlen(fills[f]);
+        size_t len = 0;
+        while(len + flen < sizeof(msg)){
+            memcpy(msg + len, fills[f], flen);
+            len += flen;
+        }
+        msg[len] = '\0';
+        char joined[sizeof(msg)];
+        size_t off = 0;
+        while(off < len){
+            size_t seg = segment_next(msg + off, len - off, 160);
+            size_t chars = 0;
+            for(size_t i = 0; i < seg; i++){
+                if((msg[off + i] & 0xc0) != 0x80) chars++;
+            }
+            if(seg == 0 || chars > 160 || (msg[off + seg] & 0xc0) == 0x80
+                    || (f == 1 && off + seg < len && msg[off + seg - 1] != ' ')){
+                printf("segment: bad segment at %zu of fill %zu\n", off, f);
+                return 1;
+            }
+            memcpy(joined + off, msg + off, seg);
+            off += seg;
+        }
+        if(memcmp(joined, msg, len)){
+            printf("segment: fill %zu doesn't add back up\n", f);
+            return 1;
+        }
+    }
+    if(segment_next("short", 5, 160) != 5){
+        printf("segment: a short message was split\n");
+        return 1;
+    }
+    /* exactly 153 ascii characters, or 67 others, may be part of something
+       longer; longer messages (which weren't split) and shorter ones aren't */
+    memset(msg, 'a', 200);
+    if(!segment_maybe_partial(msg, 153) || segment_maybe_partial(msg, 152)
+            || segment_maybe_partial(msg, 154)
+            || segment_maybe_partial(msg, 200)){
+        printf("segment: wrong guess for ascii\n");
+        return 1;
+    }
+    // one accented letter makes it ucs-2
+    memcpy(msg, "\xc3\xa9", 2);
+    if(!segment_maybe_partial(msg, 68) || segment_maybe_partial(msg, 67)
+            || segment_maybe_partial(msg, 101)){
+        printf("segment: wrong guess for ucs-2\n");
+        return 1;
+    }
+    for(size_t i = 0; i < 100; i++) memcpy(msg + 2 * i, "\xc3\xa9", 2);
+    if(!segment_maybe_partial(msg, 134) || segment_maybe_partial(msg, 200)){
+        printf("segment: wrong guess for ucs-2\n");
+        return 1;
+    }
+    return 0;
+}
 
 int main(){
     int retval = 1;
@@ -10,23 +520,44 @@ int main(){
     hist_msg_t *msg = NULL;
 
     // add a message to a file
-    int ret = hist_add_msg("testfiles", "123456789", "name", "my added msg", 12, true);
+    int ret = hist_add_msg("testfiles", NULL, "<123456789>name", "my added msg", 12, true, NULL);
     if(ret){
         perror("hist_add_msg");
         printf("ret %d\n", ret);
         goto fail;
     }
 
-    ret = hist_add_msg("testfiles", "123456789", "name", "their added msg", 15, false);
+    ret = hist_add_msg("testfiles", NULL, "<123456789>name", "their added msg", 15, false, NULL);
     if(ret){
         perror("hist_add_msg");
         printf("ret %d\n", ret);
         goto fail;
     }
 
+    // a per-account shard should be separate from the unsharded history
+    ret = hist_add_msg("testfiles", "shard", "<123456789>name", "sharded msg", 11, true, NULL);
+    if(ret){
+        perror("hist_add_msg (shard)");
+        printf("ret %d\n", ret);
+        goto fail;
+    }
+
+    ret = list_hist_bufs("testfiles", "shard", &hist);
+    if(ret){
+        perror("list_hist_bufs (shard)");
+        printf("ret %d\n", ret);
+        goto fail;
+    }
+    if(!hist || hist->next || strcmp(hist->sip_uri, "123456789") != 0){
+        printf("unexpected history files in shard\n");
+        goto fail;
+    }
+    free_hist_buf(hist);
+    hist = NULL;
+
 
     // get all history buffers
-    ret = list_hist_bufs("testfiles", &hist);
+    ret = list_hist_bufs("testfiles", NULL, &hist);
     if(ret){
         perror("list_hist_bufs");
         printf("ret %d\n", ret);
@@ -39,17 +570,26 @@ int main(){
         printf("  <%s>%s\n", p->sip_uri, p->name);
         // get all messages in this buffer
         hist_msg_t *msg;
-        ret = get_hist_msg("testfiles", p->filename, &msg);
+        ret = get_hist_msg("testfiles", NULL, p->filename, &msg);
         if(ret){
             printf("%d\n", ret);
             perror("get_hist_msg");
             goto fail;
         }
+        size_t count = 0;
         hist_msg_t *mp, *mnext = msg;
         while( (mp = mnext) ){
             printf("    %lu:%u:%zu:%*s\n", mp->time, mp->me, mp->len,
                                            (int)mp->len, mp->msg);
             mnext = mp->next;
+            count++;
+        }
+        // the manifest should agree with the file
+        if(count != p->count){
+            printf("manifest says %zu messages, file has %zu\n",
+                   p->count, count);
+            free_hist_msg(msg);
+            goto fail;
         }
         // done with this message history
         free_hist_msg(msg);
@@ -57,6 +597,149 @@ int main(){
         next = p->next;
     }
 
+    // merge every file in time order, plus one pushed message at the end
+    hist_merge_t *merge = NULL;
+    ret = hist_merge_new(&merge);
+    if(ret) goto fail;
+    size_t total = 0;
+    for(p = hist; p; p = p->next){
+        total += p->count;
+        ret = hist_merge_add_file(merge, "testfiles", NULL, p->filename, 0, p);
+        if(ret){
+            printf("hist_merge_add_file returned %d\n", ret);
+            hist_merge_free(merge);
+            goto fail;
+        }
+    }
+    ret = hist_merge_push(merge, time(NULL) + 1, true, "pushed", 6, NULL);
+    if(ret){
+        hist_merge_free(merge);
+        goto fail;
+    }
+    printf("timeline:\n");
+    size_t merged = 0;
+    time_t prev = 0;
+    hist_msg_t *mm;
+    void *tag;
+    while( (ret = hist_merge_next(merge, &mm, &tag)) == 0 ){
+        if(mm->time < prev){
+            printf("timeline out of order\n");
+            hist_merge_free(merge);
+            goto fail;
+        }
+        prev = mm->time;
+        merged++;
+        printf("  %lu:%s:%s\n", mm->time,
+               tag ? ((hist_buf_t*)tag)->name : "(pushed)", mm->msg);
+    }
+    hist_merge_free(merge);
+    if(ret != 1 || merged != total + 1 || tag != NULL){
+        printf("timeline has %zu messages, expected %zu\n", merged, total + 1);
+        goto fail;
+    }
+
+    // every header parser this cpu supports should agree
+    const char* parsers[] = {"scalar", "sse2", "avx2"};
+    for(size_t i = 0; i < sizeof(parsers) / sizeof(*parsers); i++){
+        if(hist_use_parser(parsers[i])) continue;
+        for(p = hist; p; p = p->next){
+            ret = get_hist_msg("testfiles", NULL, p->filename, &msg);
+            if(ret){
+                printf("%s parser: get_hist_msg returned %d\n", parsers[i],
+                       ret);
+                goto fail;
+            }
+            size_t count = 0;
+            for(hist_msg_t *mp = msg; mp; mp = mp->next) count++;
+            free_hist_msg(msg);
+            msg = NULL;
+            if(count != p->count){
+                printf("%s parser: %zu messages, expected %zu\n",
+                       parsers[i], count, p->count);
+                goto fail;
+            }
+        }
+    }
+
+    // bulk writers, on both backends
+    if(test_writer("files") || test_writer("sqlite")) goto fail;
+
+    // a manifest which something else appended behind
+    if(test_manifest_append()) goto fail;
+
+    // conversations which change their names
+    if(test_rename()) goto fail;
+
+    // a merge which loses one of its files
+    if(test_merge_error()) goto fail;
+
+    // a merge which starts part way through a long file
+    if(test_merge_since()) goto fail;
+
+    // traces for /sms -replay
+    if(test_trace()) goto fail;
+
+    // splitting long messages, and spotting the segments of received ones
+    if(test_segment()) goto fail;
+
+    // the cache of recent messages
+    if(test_recent()) goto fail;
+
+    // importing exports, twice over
+    if(test_import()) goto fail;
+
+    // the sqlite backend, in its own shard so the database starts out empty
+    ret = hist_use_backend("sqlite");
+    if(ret) goto fail;
+    free_hist_buf(hist);
+    hist = NULL;
+    char dbpath[] = "testfiles/voipms/history/sqlite/history.db";
+    unlink(dbpath);
+    hist_pos_t pos;
+    ret = hist_add_msg("testfiles", "sqlite", "<123456789>old", "first", 5,
+                       true, &pos);
+    ret |= hist_add_msg("testfiles", "sqlite", "<123456789>old", "second", 6,
+                        false, NULL);
+    // a new name renames the conversation
+    ret |= hist_add_msg("testfiles", "sqlite", "<123456789>new", "third", 5,
+                        true, NULL);
+    if(ret){
+        printf("sqlite: hist_add_msg failed\n");
+        goto fail;
+    }
+    ret = list_hist_bufs("testfiles", "sqlite", &hist);
+    if(ret || !hist || hist->next || hist->count != 3
+            || strcmp(hist->filename, "<123456789>new") != 0){
+        printf("sqlite: unexpected conversations\n");
+        goto fail;
+    }
+    // a range query for the second the messages were added in
+    ret = hist_range_msg("testfiles", "sqlite", hist->filename, hist->last,
+                         hist->last + 1, &msg);
+    if(ret || !msg){
+        printf("sqlite: hist_range_msg returned %d\n", ret);
+        goto fail;
+    }
+    free_hist_msg(msg);
+    msg = NULL;
+    hist_reader_t *r;
+    ret = hist_reader_open("testfiles", "sqlite", hist->filename, pos.end, &r);
+    if(ret) goto fail;
+    hist_msg_t *rm;
+    size_t nread = 0;
+    while(hist_reader_next(r, &rm) == 0){
+        printf("  sqlite: %s\n", rm->msg);
+        nread++;
+    }
+    hist_reader_close(r);
+    if(nread != 2){
+        printf("sqlite: read %zu messages after the first, expected 2\n",
+               nread);
+        goto fail;
+    }
+    hist_close();
+    hist_use_backend("files");
+
     // success!
     retval = 0;
 
@@ -0,0 +1,167 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "timeline.h"
+#include "voipms.h"
+#include "history.h"
+#include "accounts.h"
+#include "restore.h"
+
+// defaults for the settings in config.h
+#ifndef TIMELINE_HOURS
+#define TIMELINE_HOURS 0
+#endif
+
+struct timeline {
+    struct t_gui_buffer* buffer;
+    // the merge of every conversation, while it is being printed
+    hist_merge_t* merge;
+    struct t_hook* timer;
+    /* conversation names, used as the merge tags; they are only needed
+       while the merge is running */
+    char** names;
+    size_t nnames;
+    size_t maxnames;
+};
+
+struct timeline timeline;
+
+// keep a copy of a name for as long as the merge runs
+static char* timeline_name(const char* name){
+    if(timeline.nnames == timeline.maxnames){
+        size_t max = timeline.maxnames ? 2 * timeline.maxnames : 32;
+        char** names = realloc(timeline.names, max * sizeof(*names));
+        if(!names) return NULL;
+        timeline.names = names;
+        timeline.maxnames = max;
+    }
+    char* dup = strdup(name);
+    if(!dup) return NULL;
+    timeline.names[timeline.nnames++] = dup;
+    return dup;
+}
+
+// done merging; new messages are printed directly from now on
+static void timeline_merge_done(void){
+    if(timeline.timer) weechat_unhook(timeline.timer);
+    timeline.timer = NULL;
+    hist_merge_free(timeline.merge);
+    timeline.merge = NULL;
+    for(size_t i = 0; i < timeline.nnames; i++){
+        free(timeline.names[i]);
+    }
+    if(timeline.names) free(timeline.names);
+    timeline.names = NULL;
+    timeline.nnames = 0;
+    timeline.maxnames = 0;
+}
+
+static void timeline_print(const char* name, time_t t, bool me,
+                           const char* msg, size_t len){
+    if(me){
+        weechat_printf_date_tags(timeline.buffer, t, "self_msg",
+                                 "me → %s\t%.*s", name, (int)len, msg);
+    }else{
+        weechat_printf_date_tags(timeline.buffer, t, "", "%s\t%s%.*s", name,
+                                 weechat_color("green"), (int)len, msg);
+    }
+}
+
+static int timeline_timer_cb(const void* ptr, void* data, int remaining){
+    (void)ptr;
+    (void)data;
+    (void)remaining;
+
+    for(size_t n = 0; n < RESTORE_SLICE; n++){
+        hist_msg_t* msg;
+        void* tag;
+        int ret = hist_merge_next(timeline.merge, &msg, &tag);
+        if(ret == 1){
+            timeline_merge_done();
+            break;
+        }
+        // only that conversation is lost; the rest go on
+        if(ret){
+            weechat_printf(timeline.buffer, "voipms: error %d reading the "
+                           "history of %s for the timeline", ret,
+                           (const char*)tag);
+            continue;
+        }
+        timeline_print((const char*)tag, msg->time, msg->me, msg->msg,
+                       msg->len);
+    }
+    return WEECHAT_RC_OK;
+}
+
+static int timeline_close_cb(const void* ptr, void* data,
+                             struct t_gui_buffer* buffer){
+    (void)ptr;
+    (void)data;
+    (void)buffer;
+    timeline_merge_done();
+    timeline.buffer = NULL;
+    return WEECHAT_RC_OK;
+}
+
+int timeline_start(void){
+    if(TIMELINE_HOURS <= 0) return 0;
+
+    timeline.buffer = weechat_buffer_new("timeline", NULL, NULL, NULL,
+                                         timeline_close_cb, NULL, NULL);
+    if(!timeline.buffer) return 1;
+    weechat_buffer_set(timeline.buffer, "title",
+                       "voipms: all conversations");
+
+    if(hist_merge_new(&timeline.merge)) goto fail;
+
+    // every conversation with messages since the start of the timeline
+    time_t since = time(NULL) - (time_t)TIMELINE_HOURS * 60 * 60;
+    for(size_t i = 0; i < voip_naccounts; i++){
+        const char* shard = voip_accounts[i].label;
+        hist_buf_t* hist = NULL;
+        if(list_hist_bufs(wc_dir, shard, &hist)) continue;
+        // the list is sorted by recency, so stop at the first old one
+        for(hist_buf_t* p = hist; p && p->last >= since; p = p->next){
+            char* name = timeline_name(p->name);
+            if(!name) break;
+            int ret = hist_merge_add_file(timeline.merge, wc_dir, shard,
+                                          p->filename, since, name);
+            if(ret){
+                weechat_printf(timeline.buffer, "voipms: error %d reading the "
+                               "history of %s for the timeline", ret, name);
+            }
+        }
+        free_hist_buf(hist);
+    }
+
+    // print it from the main loop, a slice at a time
+    timeline.timer = weechat_hook_timer(1, 0, 0, timeline_timer_cb,
+                                        NULL, NULL);
+    if(!timeline.timer) goto fail;
+    return 0;
+
+fail:
+    timeline_stop();
+    return 1;
+}
+
+void timeline_add(const char* name, time_t t, bool me, const char* msg,
+                  size_t len){
+    if(!timeline.buffer) return;
+    if(timeline.merge){
+        // still printing the history; this goes after it, in order
+        const char* tag = timeline_name(name);
+        if(tag) hist_merge_push(timeline.merge, t, me, msg, len, (void*)tag);
+        return;
+    }
+    timeline_print(name, t, me, msg, len);
+}
+
+void timeline_stop(void){
+    timeline_merge_done();
+    if(timeline.buffer){
+        struct t_gui_buffer* buffer = timeline.buffer;
+        timeline.buffer = NULL;
+        weechat_buffer_close(buffer);
+    }
+}
@@ -0,0 +1,21 @@
+#ifndef TIMELINE_H
+#define TIMELINE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
+
+/* The optional "timeline" buffer shows the messages of every conversation
+   from the last TIMELINE_HOURS hours, in time order. */
+
+// open the timeline buffer (if enabled); returns 0 on success
+int timeline_start(void);
+
+// add a new message from the conversation named name to the timeline
+void timeline_add(const char* name, time_t t, bool me, const char* msg,
+                  size_t len);
+
+// close the timeline (on plugin unload)
+void timeline_stop(void);
+
+#endif // TIMELINE_H
@@ -0,0 +1,150 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "trace.h"
+
+static struct {
+    FILE* f;
+    // time of the last event written
+    int64_t last;
+} rec;
+
+struct trace_reader_t {
+    FILE* f;
+    int64_t last;
+    // holds the strings of the last event
+    char* buf;
+    size_t cap;
+};
+
+static int64_t now_usec(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void put_varint(FILE* f, uint64_t v){
+    while(v >= 0x80){
+        putc_unlocked((int)(v & 0x7f) | 0x80, f);
+        v >>= 7;
+    }
+    putc_unlocked((int)v, f);
+}
+
+// returns 0 on success, 1 at EOF before the first byte, -1 if truncated
+static int get_varint(FILE* f, uint64_t* out){
+    uint64_t v = 0;
+    for(unsigned shift = 0; shift < 64; shift += 7){
+        int c = getc(f);
+        if(c == EOF) return shift ? -1 : 1;
+        v |= (uint64_t)(c & 0x7f) << shift;
+        if(!(c & 0x80)){
+            *out = v;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+int trace_open(const char* path){
+    trace_close();
+    rec.f = fopen(path, "w");
+    if(!rec.f) return 1;
+    rec.last = 0;
+    if(fputs(TRACE_MAGIC, rec.f) == EOF || fflush(rec.f)){
+        trace_close();
+        return 1;
+    }
+    return 0;
+}
+
+bool trace_enabled(void){
+    return rec.f != NULL;
+}
+
+void trace_record(const trace_event_t* ev){
+    if(!rec.f) return;
+    // one event at a time, even from pjsip's threads
+    flockfile(rec.f);
+    int64_t usec = ev->usec ? ev->usec : now_usec();
+    // the clock may step back; keep the deltas positive
+    int64_t delta = usec > rec.last ? usec - rec.last : 0;
+    rec.last += delta;
+    put_varint(rec.f, ev->kind);
+    put_varint(rec.f, ev->acct);
+    put_varint(rec.f, (uint64_t)delta);
+    put_varint(rec.f, ev->flen);
+    put_varint(rec.f, ev->tlen);
+    put_varint(rec.f, ev->mlen);
+    put_varint(rec.f, ev->blen);
+    fwrite(ev->from, 1, ev->flen, rec.f);
+    fwrite(ev->to, 1, ev->tlen, rec.f);
+    fwrite(ev->mime, 1, ev->mlen, rec.f);
+    fwrite(ev->body, 1, ev->blen, rec.f);
+    // what's there survives a crash, which is when it's wanted most
+    fflush(rec.f);
+    funlockfile(rec.f);
+}
+
+void trace_close(void){
+    if(rec.f) fclose(rec.f);
+    rec.f = NULL;
+}
+
+int trace_reader_open(const char* path, trace_reader_t** out){
+    trace_reader_t* r = calloc(1, sizeof(*r));
+    if(!r) return 1;
+    r->f = fopen(path, "r");
+    if(!r->f){
+        free(r);
+        return 2;
+    }
+    char magic[sizeof(TRACE_MAGIC) - 1];
+    if(fread(magic, 1, sizeof(magic), r->f) != sizeof(magic)
+            || memcmp(magic, TRACE_MAGIC, sizeof(magic))){
+        trace_reader_close(r);
+        return 3;
+    }
+    *out = r;
+    return 0;
+}
+
+int trace_reader_next(trace_reader_t* r, trace_event_t* ev){
+    uint64_t v[7];
+    for(int i = 0; i < 7; i++){
+        int ret = get_varint(r->f, &v[i]);
+        // a clean end is only possible before an event
+        if(ret) return ret == 1 && i == 0 ? 1 : -1;
+    }
+    if(v[0] != TRACE_RX && v[0] != TRACE_TX) return -1;
+    uint64_t total = v[3] + v[4] + v[5] + v[6];
+    if(total < v[3] || total > SIZE_MAX - 1) return -1;
+    if(total + 1 > r->cap){
+        char* new = realloc(r->buf, total + 1);
+        if(!new) return -1;
+        r->buf = new;
+        r->cap = total + 1;
+    }
+    if(fread(r->buf, 1, total, r->f) != total) return -1;
+    r->buf[total] = '\0';
+    r->last += (int64_t)v[2];
+
+    *ev = (trace_event_t){ .kind = (trace_kind_t)v[0], .acct = v[1],
+                           .usec = r->last,
+                           .flen = v[3], .tlen = v[4], .mlen = v[5],
+                           .blen = v[6] };
+    ev->from = r->buf;
+    ev->to = ev->from + ev->flen;
+    ev->mime = ev->to + ev->tlen;
+    ev->body = ev->mime + ev->mlen;
+    return 0;
+}
+
+void trace_reader_close(trace_reader_t* r){
+    if(!r) return;
+    if(r->f) fclose(r->f);
+    if(r->buf) free(r->buf);
+    free(r);
+}
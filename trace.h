@@ -0,0 +1,50 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* A trace is a record of the messages that went through the SIP client, for
+   replaying the same workload later (see replay.h).  It starts with
+   TRACE_MAGIC, then each event is a list of varints:
+       kind acct usec_delta from_len to_len mime_len body_len
+   followed by the from, to, mime and body bytes.  usec_delta is the time
+   since the previous event (since the epoch, for the first one). */
+#define TRACE_MAGIC "VMSTRC1\n"
+
+typedef enum {
+    // a MESSAGE we received
+    TRACE_RX = 1,
+    // a MESSAGE we sent
+    TRACE_TX = 2,
+} trace_kind_t;
+
+typedef struct {
+    trace_kind_t kind;
+    size_t acct;
+    // microseconds since the epoch
+    int64_t usec;
+    const char *from, *to, *mime, *body;
+    size_t flen, tlen, mlen, blen;
+} trace_event_t;
+
+typedef struct trace_reader_t trace_reader_t;
+
+/* start recording to path (truncating it); returns 0 on success.  Events
+   may be recorded from any thread. */
+int trace_open(const char* path);
+// whether trace_open() succeeded, so callers can skip building events
+bool trace_enabled(void);
+// record one event; ev->usec is filled in if it's 0
+void trace_record(const trace_event_t* ev);
+void trace_close(void);
+
+// returns 0 on success, or nonzero if path isn't a trace
+int trace_reader_open(const char* path, trace_reader_t** out);
+/* read the next event; its strings are valid until the next call.  Returns
+   0 on success, 1 at the end of the trace, or -1 if the trace is corrupt */
+int trace_reader_next(trace_reader_t* r, trace_event_t* ev);
+void trace_reader_close(trace_reader_t* r);
+
+#endif // TRACE_H
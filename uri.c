@@ -0,0 +1,164 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <ctype.h>
+#include <sys/types.h>
+
+#include "uri.h"
+
+// a chained hash table of every interned uri
+static struct {
+    sip_uri_t** slots;
+    size_t cap;
+    size_t len;
+} uris;
+
+static size_t hash_uri(const char* s, size_t len){
+    // FNV-1a
+    size_t h = 14695981039346656037ULL;
+    for(size_t i = 0; i < len; i++){
+        h ^= (unsigned char)s[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static int uris_grow(void){
+    size_t cap = uris.cap ? 2 * uris.cap : 256;
+    sip_uri_t** slots = calloc(cap, sizeof(*slots));
+    if(!slots) return 1;
+    for(size_t i = 0; i < uris.cap; i++){
+        sip_uri_t *u, *next = uris.slots[i];
+        while( (u = next) ){
+            next = u->next;
+            u->next = slots[u->hash & (cap - 1)];
+            slots[u->hash & (cap - 1)] = u;
+        }
+    }
+    if(uris.slots) free(uris.slots);
+    uris.slots = slots;
+    uris.cap = cap;
+    return 0;
+}
+
+/* the 10-digit number in "sip:5551234567@realm", the way the regex
+   "sip:([0-9]{10})@[-a-zA-Z0-9]" would find it; returns its offset or -1 */
+static ssize_t find_number(const char* s, size_t len){
+    for(size_t i = 0; i + 4 + 10 + 2 <= len; i++){
+        if(memcmp(s + i, "sip:", 4) != 0) continue;
+        const char* c = s + i + 4;
+        size_t n = 0;
+        while(n < 10 && isdigit((unsigned char)c[n])) n++;
+        if(n == 10 && c[10] == '@'
+                && (isalnum((unsigned char)c[11]) || c[11] == '-')){
+            return (ssize_t)(i + 4);
+        }
+    }
+    return -1;
+}
+
+sip_uri_t* sip_uri_intern(const char* uri, size_t len){
+    size_t hash = hash_uri(uri, len);
+    if(uris.cap){
+        for(sip_uri_t* u = uris.slots[hash & (uris.cap - 1)]; u; u = u->next){
+            if(u->hash == hash && u->len == len
+                    && memcmp(u->str, uri, len) == 0) return u;
+        }
+    }
+    if(uris.len >= uris.cap && uris_grow()) return NULL;
+
+    // the uri and its number share one allocation with the entry
+    ssize_t num = find_number(uri, len);
+    size_t num_len = num < 0 ? len : 10;
+    sip_uri_t* u = malloc(sizeof(*u) + len + 1 + num_len + 1);
+    if(!u) return NULL;
+    char* str = (char*)(u + 1);
+    memcpy(str, uri, len);
+    str[len] = '\0';
+    char* number = str + len + 1;
+    memcpy(number, num < 0 ? uri : uri + num, num_len);
+    number[num_len] = '\0';
+    *u = (sip_uri_t){ .str = str, .len = len, .hash = hash,
+                      .number = number };
+
+    u->next = uris.slots[hash & (uris.cap - 1)];
+    uris.slots[hash & (uris.cap - 1)] = u;
+    uris.len++;
+    return u;
+}
+
+static bool is_host_char(char c){
+    return isalnum((unsigned char)c) || c == '-' || c == '.';
+}
+
+sip_uri_t* sip_uri_from_header(const char* from, size_t len){
+    // "sip:" then a user part, "@", and a host
+    for(size_t i = 0; i + 4 <= len; i++){
+        if(memcmp(from + i, "sip:", 4) != 0) continue;
+        size_t j = i + 4;
+        while(j < len && from[j] != '@' && from[j] != '>'
+                && !isspace((unsigned char)from[j])) j++;
+        if(j == len || from[j] != '@') continue;
+        j++;
+        while(j < len && is_host_char(from[j])) j++;
+        return sip_uri_intern(from + i, j - i);
+    }
+    // if it can't do it, use the whole thing
+    return sip_uri_intern(from, len);
+}
+
+sip_uri_t* sip_uri_from_number(const char* number, size_t len,
+                               const char* realm){
+    // sip: @ and \0
+    size_t max = len + strlen(realm) + 6;
+    char buf[256];
+    char* out = max <= sizeof(buf) ? buf : malloc(max);
+    if(!out) return NULL;
+    size_t n = sprintf(out, "sip:");
+    size_t digits = 0;
+    for(size_t i = 0; i < len; i++){
+        if(isdigit((unsigned char)number[i])){
+            out[n++] = number[i];
+            digits++;
+        }
+    }
+    sip_uri_t* u = NULL;
+    if(digits){
+        n += sprintf(out + n, "@%s", realm);
+        u = sip_uri_intern(out, n);
+    }
+    if(out != buf) free(out);
+    return u;
+}
+
+const char* sip_uri_filename(sip_uri_t* uri, const char* name){
+    if(uri->name && strcmp(uri->name, name) == 0) return uri->filename;
+    // history is kept in "<sip_uri>name"
+    size_t name_len = strlen(name);
+    char* mem = malloc(uri->len + 2 * name_len + 4);
+    if(!mem) return NULL;
+    char* filename = mem + name_len + 1;
+    memcpy(mem, name, name_len + 1);
+    sprintf(filename, "<%s>%s", uri->str, name);
+    // name and filename share an allocation
+    if(uri->name) free(uri->name);
+    uri->name = mem;
+    uri->filename = filename;
+    return filename;
+}
+
+void sip_uri_free_all(void){
+    for(size_t i = 0; i < uris.cap; i++){
+        sip_uri_t *u, *next = uris.slots[i];
+        while( (u = next) ){
+            next = u->next;
+            if(u->name) free(u->name);
+            free(u);
+        }
+    }
+    if(uris.slots) free(uris.slots);
+    uris.slots = NULL;
+    uris.cap = 0;
+    uris.len = 0;
+}
@@ -0,0 +1,41 @@
+#ifndef URI_H
+#define URI_H
+
+#include <stddef.h>
+
+/* Every SIP uri we deal with is interned: there is one sip_uri_t per
+   distinct uri, which lives until sip_uri_free_all(), so uris can be
+   compared by pointer and passed around without copying. */
+typedef struct sip_uri_t {
+    // "sip:5551234567@realm", and its length and hash
+    const char* str;
+    size_t len;
+    size_t hash;
+    // the 10-digit phone number, or the whole uri if it doesn't have one
+    const char* number;
+    // the history filename ("<str>name") for the name it was last used with
+    char* name;
+    char* filename;
+    struct sip_uri_t* next;
+} sip_uri_t;
+
+// the interned copy of a sip uri; NULL if out of memory
+sip_uri_t* sip_uri_intern(const char* uri, size_t len);
+
+/* the interned sip uri from a From/To header value, e.g.
+   "Name" <sip:5551234567@realm>;tag=x.  Without a sip uri in it, the whole
+   value is used.  Nothing is allocated for a uri that has been seen before */
+sip_uri_t* sip_uri_from_header(const char* from, size_t len);
+
+/* "sip:<number>@<realm>" from a phone number as it was typed, ignoring any
+   non-digit characters.  NULL if there were no digits at all */
+sip_uri_t* sip_uri_from_number(const char* number, size_t len,
+                               const char* realm);
+
+/* the history filename of uri in a buffer called name; NULL if out of
+   memory.  It's only valid until the next call with a different name */
+const char* sip_uri_filename(sip_uri_t* uri, const char* name);
+
+void sip_uri_free_all(void);
+
+#endif // URI_H
@@ -1,7 +1,11 @@
+#include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 #include <fcntl.h>
 #include <ctype.h>
+#include <stdbool.h>
+#include <time.h>
 
 #include <weechat/weechat-plugin.h>
 
@@ -9,6 +13,21 @@
 #include "buffers.h"
 #include "sip_client.h"
 #include "history.h"
+#include "accounts.h"
+#include "restore.h"
+#include "timeline.h"
+#include "watch.h"
+#include "fanout.h"
+#include "complete.h"
+#include "outbox.h"
+#include "trace.h"
+#include "replay.h"
+#include "script.h"
+#include "burst.h"
+#include "latency.h"
+#include "recent.h"
+#include "startup.h"
+#include "reassemble.h"
 
 WEECHAT_PLUGIN_NAME("voipms")
 WEECHAT_PLUGIN_DESCRIPTION("send and receive sms from your voip.ms account")
@@ -19,6 +38,14 @@ WEECHAT_PLUGIN_LICENSE("UNLICENSE")
 // optional
 WEECHAT_PLUGIN_PRIORITY(1000)
 
+// defaults for the settings in config.h
+#ifndef HIST_BACKEND
+#define HIST_BACKEND "files"
+#endif
+#ifndef TRACE_FILE
+#define TRACE_FILE ""
+#endif
+
 // global variables
 struct t_weechat_plugin *weechat_plugin;
 struct t_gui_buffer* voip_buffer;
@@ -29,47 +56,208 @@ static int do_sms(const void* ptr, void* data, struct t_gui_buffer* cmd_buffer,
     (void)ptr;
     (void)data;
 
-    if(argc < 3){
+    // default to the account of the buffer we were called from, if any
+    size_t acct = 0;
+    const sip_contact_t* cmd_contact = sip_buffers_contact(cmd_buffer);
+    if(cmd_contact) acct = cmd_contact->acct;
+
+    // options come before the number
+    int arg = 1;
+    bool open_only = false;
+    const char* to = NULL;
+    const char* to_file = NULL;
+    while(arg < argc && argv[arg][0] == '-'){
+        if(strcmp(argv[arg], "-a") == 0){
+            // "-a LABEL" picks an account explicitly
+            if(arg + 1 >= argc){
+                weechat_printf(cmd_buffer, "/sms -a needs an account label");
+                return WEECHAT_RC_ERROR;
+            }
+            int found = voip_account_find(argv[arg + 1]);
+            if(found < 0){
+                weechat_printf(cmd_buffer, "/sms: no account labeled \"%s\"",
+                               argv[arg + 1]);
+                return WEECHAT_RC_ERROR;
+            }
+            acct = (size_t)found;
+            arg += 2;
+        }else if(strcmp(argv[arg], "-open") == 0){
+            // "-open" opens the conversation without sending anything
+            open_only = true;
+            arg += 1;
+        }else if(strcmp(argv[arg], "-latency") == 0){
+            // "-latency [number]" shows how long the server takes to answer
+            const sip_uri_t* uri = NULL;
+            if(arg + 1 < argc){
+                uri = sip_uri_from_number(argv[arg + 1], strlen(argv[arg + 1]),
+                                          voip_accounts[acct].realm);
+                if(!uri){
+                    const sip_contact_t* named = complete_find(argv[arg + 1]);
+                    if(!named){
+                        weechat_printf(cmd_buffer, "/sms: \"%s\" is not a "
+                                       "number or the name of a conversation",
+                                       argv[arg + 1]);
+                        return WEECHAT_RC_ERROR;
+                    }
+                    uri = named->uri;
+                }
+            }
+            latency_print(cmd_buffer, uri);
+            return WEECHAT_RC_OK;
+        }else if(strcmp(argv[arg], "-replay") == 0){
+            // "-replay PATH [SPEED]" feeds a trace back through the handlers
+            if(arg + 1 >= argc){
+                weechat_printf(cmd_buffer, "/sms -replay needs a trace file");
+                return WEECHAT_RC_ERROR;
+            }
+            double speed = 1;
+            // (0 means as fast as possible, which only "max" asks for)
+            if(arg + 2 < argc && strcmp(argv[arg + 2], "max") == 0){
+                speed = 0;
+            }else if(arg + 2 < argc){
+                char* end;
+                speed = strtod(argv[arg + 2], &end);
+                if(end == argv[arg + 2] || *end || !(speed > 0)){
+                    weechat_printf(cmd_buffer, "/sms: \"%s\" is not a speed",
+                                   argv[arg + 2]);
+                    return WEECHAT_RC_ERROR;
+                }
+            }
+            return replay_start(cmd_buffer, argv[arg + 1], speed)
+                 ? WEECHAT_RC_ERROR : WEECHAT_RC_OK;
+        }else if(strcmp(argv[arg], "-to") == 0
+                || strcmp(argv[arg], "-file") == 0){
+            // "-to a,b,c" or "-file PATH" sends to many numbers at once
+            if(arg + 1 >= argc){
+                weechat_printf(cmd_buffer, "/sms %s needs an argument",
+                               argv[arg]);
+                return WEECHAT_RC_ERROR;
+            }
+            if(argv[arg][1] == 't') to = argv[arg + 1];
+            else to_file = argv[arg + 1];
+            arg += 2;
+        }else{
+            weechat_printf(cmd_buffer, "/sms: unknown option %s", argv[arg]);
+            return WEECHAT_RC_ERROR;
+        }
+    }
+
+    if(to || to_file){
+        if(open_only || argc < arg + 1){
+            weechat_printf(cmd_buffer, "/sms needs a message");
+            return WEECHAT_RC_ERROR;
+        }
+        int ret = to ? fanout_send(cmd_buffer, acct, to, argv_eol[arg])
+                     : fanout_send_file(cmd_buffer, acct, to_file,
+                                        argv_eol[arg]);
+        return ret ? WEECHAT_RC_ERROR : WEECHAT_RC_OK;
+    }
+
+    if(argc < arg + (open_only ? 1 : 2)){
         weechat_printf(cmd_buffer, "/sms needs a number and a message");
         return WEECHAT_RC_ERROR;
     }
 
     // build a SIP uri from the phone number that was given
-    char sip_uri[256];
-    size_t max_num_len = sizeof(sip_uri) - strlen(REALM) - 5; // sip: @ and \0
-    size_t len = 0;
-    len += sprintf(sip_uri, "sip:");
-    // copy the sip_uri, but ignoring any non-digit characters
-    for(char *c = argv[1]; *c != '\0' && len < max_num_len; c++){
-        if(isdigit(*c)) sip_uri[len++] = *c;
+    sip_uri_t* uri = sip_uri_from_number(argv[arg], strlen(argv[arg]),
+                                         voip_accounts[acct].realm);
+    if(!uri){
+        // or it's the name of a conversation (as tab completion offers)
+        const sip_contact_t* named = complete_find(argv[arg]);
+        if(!named){
+            weechat_printf(cmd_buffer, "/sms: \"%s\" is not a number or "
+                           "the name of a conversation", argv[arg]);
+            return WEECHAT_RC_ERROR;
+        }
+        acct = named->acct;
+        uri = named->uri;
     }
-    len += sprintf(sip_uri + len, "@" REALM);
 
     // ignore what buffer this was called from
-    struct t_gui_buffer* buffer = sip_buffers_get(sip_uri, len);
+    struct t_gui_buffer* buffer = sip_buffers_open(acct, uri, true);
     if(!buffer) return WEECHAT_RC_ERROR;
 
-    return voip_plugin_send_sms(buffer, sip_uri, argv_eol[2]);
+    if(open_only){
+        weechat_buffer_set(buffer, "display", "1");
+        return WEECHAT_RC_OK;
+    }
+
+    return voip_plugin_send_sms(buffer, sip_buffers_contact(buffer),
+                                argv_eol[arg + 1], NULL);
 }
 
-int voip_plugin_send_sms(struct t_gui_buffer* buffer, const char* sip_uri,
-                         const char* msg){
+/* token is passed back to voip_plugin_sms_status(), on the main loop, with
+   the final status of the MESSAGE, unless it is NULL */
+int voip_plugin_send_sms(struct t_gui_buffer* buffer,
+                         const sip_contact_t* contact, const char* msg,
+                         void* token){
+    // the history, and what was received before, go above anything new
+    reassemble_flush(contact->acct, contact->uri);
+    restore_flush(buffer);
+    burst_flush(buffer);
+
     // echo the input data for the user
     weechat_printf_date_tags (buffer, 0, "self_msg", "me:\t%s", msg);
+    recent_add(contact, 0, true, msg, strlen(msg));
 
     // get the buffer name
     const char *name = weechat_buffer_get_string(buffer, "name");
 
     // add the message to the history buffer
-    hist_add_msg(wc_dir, sip_uri, name, msg, strlen(msg), true);
+    const char* fname = sip_uri_filename(contact->uri, name);
+    if(fname){
+        hist_pos_t pos;
+        int ret = hist_add_msg(wc_dir, voip_accounts[contact->acct].label,
+                               fname, msg, strlen(msg), true, &pos);
+        if(!ret) watch_own_append(contact->acct, contact->uri, fname, &pos);
+    }
+    timeline_add(name, time(NULL), true, msg, strlen(msg));
+
+    // wait for registration, and behind anything already waiting
+    if(!sip_client_registered(contact->acct) || outbox_pending(contact->acct)){
+        if(outbox_add(contact->acct, contact->uri, msg, token)){
+            weechat_printf(buffer, "%sunable to queue the message",
+                           weechat_prefix("error"));
+            return WEECHAT_RC_ERROR;
+        }
+        if(sip_client_registered(contact->acct)){
+            outbox_flush(contact->acct);
+        }else{
+            weechat_printf(buffer, "voipms: not registered, the message will "
+                           "be sent once registered");
+        }
+        return WEECHAT_RC_OK;
+    }
 
     // send via sip
-    sip_client_send_sms(sip_uri, msg);
-    // TODO: error handling
+    if(sip_client_send_sms(contact->acct, contact->uri, msg, token)){
+        if(outbox_add(contact->acct, contact->uri, msg, token)){
+            weechat_printf(buffer, "%sunable to send the message",
+                           weechat_prefix("error"));
+            return WEECHAT_RC_ERROR;
+        }
+        weechat_printf(buffer, "voipms: unable to send the message, it will "
+                       "be retried once registered");
+    }
 
     return WEECHAT_RC_OK;
 }
 
+// an account is registered: send what was waiting for it
+void voip_plugin_sip_ready(size_t acct){
+    size_t sent = outbox_flush(acct);
+    if(sent && voip_buffer){
+        weechat_printf(voip_buffer, "voipms: sent %zu queued messages for "
+                       "account \"%s\"", sent, voip_accounts[acct].label);
+    }
+}
+
+// the final status of a message sent with a token
+void voip_plugin_sms_status(void* token, int code, const char* reason,
+                            size_t rlen){
+    fanout_status(token, code, reason, rlen);
+}
+
 int voip_buffer_close_cb(const void* ptr, void* data,
                          struct t_gui_buffer* buffer){
     // don't try to print to voip_buffer any more
@@ -77,35 +265,53 @@ int voip_buffer_close_cb(const void* ptr, void* data,
     return WEECHAT_RC_OK;
 }
 
-int voip_plugin_handle_sms(const char* from, size_t flen,
+int voip_plugin_handle_sms(size_t acct, const char* from, size_t flen,
                            const char* body, size_t blen){
+    // the sip uri of the sender; only its first message allocates anything
+    sip_uri_t* uri = sip_uri_from_header(from, flen);
+    // segments of a long SMS are put back together first
+    return reassemble_add(acct, uri, body, blen);
+}
+
+// a whole message was received
+int voip_plugin_deliver_sms(size_t acct, sip_uri_t* uri, const char* body,
+                            size_t blen){
     // print to the appropriate weechat buffer
-    struct t_gui_buffer* buffer = sip_buffers_get(from, flen);
+    struct t_gui_buffer* buffer = sip_buffers_open(acct, uri, true);
     if(!buffer) return WEECHAT_RC_ERROR;
-    weechat_printf_date_tags(buffer, 0, "notify_highlight", "%s%.*s",
-                             weechat_color("green"), (int)blen, body);
+    // printed along with the rest of its burst
+    burst_add(buffer, body, blen);
 
     // get the buffer name
     const char *name = weechat_buffer_get_string(buffer, "name");
 
-    // get the sip_uri info from the "from" field
-    char* sip_uri = dup_only_sip_uri(from, flen);
-    if(sip_uri){
-        // add the message to the history buffer
-        hist_add_msg(wc_dir, sip_uri, name, body, blen, false);
-        free(sip_uri);
+    // add the message to the history buffer
+    const char* fname = sip_uri_filename(uri, name);
+    if(fname){
+        hist_pos_t pos;
+        int ret = hist_add_msg(wc_dir, voip_accounts[acct].label, fname,
+                               body, blen, false, &pos);
+        if(!ret) watch_own_append(acct, uri, fname, &pos);
     }
+    timeline_add(name, time(NULL), false, body, blen);
 
     return WEECHAT_RC_OK;
 }
 
 // we are mime-stoopid for now
-int voip_plugin_handle_mms(const char* from, size_t flen,
+int voip_plugin_handle_mms(size_t acct, const char* from, size_t flen,
                            const char* mime, size_t mlen,
                            const char* body, size_t blen){
+    sip_uri_t* uri = sip_uri_from_header(from, flen);
+    if(!uri) return WEECHAT_RC_ERROR;
+    // the rest of a long SMS sent just before it goes above it
+    reassemble_flush(acct, uri);
     // get the appropriate weechat buffer
-    struct t_gui_buffer* buffer = sip_buffers_get(from, flen);
+    struct t_gui_buffer* buffer = sip_buffers_open(acct, uri, true);
     if(!buffer) return WEECHAT_RC_ERROR;
+    // the history goes above anything new
+    restore_flush(buffer);
+    burst_flush(buffer);
     // save to a unique filename based on the time
     char d[128];
     time_t epoch = time(NULL);
@@ -124,52 +330,53 @@ int voip_plugin_handle_mms(const char* from, size_t flen,
     return WEECHAT_RC_OK;
 }
 
-void voip_plugin_restore_history(void){
-    hist_buf_t *hist = NULL;
-    hist_msg_t *msg = NULL;
+static void print_msg(struct t_gui_buffer* buffer, time_t t, bool me,
+                      const char* msg){
+    if(me){
+        weechat_printf_date_tags(buffer, t, "self_msg", "me:\t%s", msg);
+    }else{
+        weechat_printf_date_tags(buffer, t, "", "%s%s",
+                                 weechat_color("green"), msg);
+    }
+}
 
-    // get all history buffers
-    int ret = list_hist_bufs(wc_dir, &hist);
-    if(ret) goto fail;
-
-    // recreate all the buffers
-    hist_buf_t *p, *next = hist;
-    while( (p = next) ){
-        // open the new buffer
-        struct t_gui_buffer* buffer;
-        buffer =  sip_buffers_get(p->sip_uri, strlen(p->sip_uri));
-
-        weechat_printf_date_tags (buffer, 0, NULL, "%s", p->sip_uri);
-
-        // set the name of the buffer
-        if(p->name) weechat_buffer_set(buffer, "name", p->name);
-
-        // get all messages in this buffer
-        hist_msg_t *msg;
-        ret = get_hist_msg(wc_dir, p->filename, &msg);
-        if(ret) goto fail;
-        hist_msg_t *mp, *mnext = msg;
-        while( (mp = mnext) ){
-            // add message to the weechat buffer
-            if(mp->me){
-                weechat_printf_date_tags(buffer, mp->time, "self_msg",
-                                         "me:\t%s", mp->msg);
-            }else{
-                weechat_printf_date_tags(buffer, mp->time, "", "%s%s",
-                                         weechat_color("green"), mp->msg);
-             }
-            mnext = mp->next;
-        }
-        // done with this message history
-        free_hist_msg(msg);
-        msg = NULL;
-        next = p->next;
+// print one message from the history
+void voip_plugin_print_hist_msg(struct t_gui_buffer* buffer,
+                                const hist_msg_t* mp){
+    print_msg(buffer, mp->time, mp->me, mp->msg);
+    recent_add(sip_buffers_contact(buffer), mp->time, mp->me, mp->msg,
+               mp->len);
+}
+
+// print the end of a conversation's history from memory into its new buffer
+void voip_plugin_print_recent(struct t_gui_buffer* buffer,
+                              const sip_contact_t* contact){
+    weechat_printf_date_tags(buffer, 0, NULL, "%s", contact->uri->str);
+    for(const sip_recent_t* m = contact->messages; m; m = m->next){
+        print_msg(buffer, m->time, m->me, m->msg);
     }
+}
+
+// print the history of a conversation into its (new) buffer
+void voip_plugin_load_history(size_t acct, struct t_gui_buffer* buffer,
+                              const sip_uri_t* uri, const char* filename){
+    hist_msg_t *msg = NULL;
 
-fail:
+    weechat_printf_date_tags (buffer, 0, NULL, "%s", uri->str);
+
+    // get all messages in this buffer
+    int ret = get_hist_msg(wc_dir, voip_accounts[acct].label, filename, &msg);
+    if(ret) return;
+    hist_msg_t *mp, *mnext = msg;
+    while( (mp = mnext) ){
+        // add message to the weechat buffer
+        voip_plugin_print_hist_msg(buffer, mp);
+        // anything appended after this is picked up by the watch
+        if(!mp->next) watch_seen(acct, filename, mp->end);
+        mnext = mp->next;
+    }
+    // done with this message history
     free_hist_msg(msg);
-    free_hist_buf(hist);
-    return;
 }
 
 void voip_plugin_init(void){
@@ -179,22 +386,66 @@ void voip_plugin_init(void){
 }
 
 void voip_plugin_cleanup(void){
+    replay_stop();
+    /* first, so the last messages pjsip received still go through the
+       buffers, the history and the timeline */
     sip_teardown();
+    reassemble_stop();
+    burst_stop();
+    watch_stop();
+    timeline_stop();
+    restore_stop();
+    // queued messages stay on disk; their tokens go with fanout_stop()
+    outbox_stop();
+    // nothing else can be recorded or answered
+    trace_close();
+    latency_stop();
+    // no more message statuses can arrive
+    fanout_stop();
+    script_stop();
     sip_buffers_free();
+    complete_stop();
+    hist_close();
 }
 
 int weechat_plugin_init (struct t_weechat_plugin *plugin,
                          int argc, char *argv[]){
     weechat_plugin = plugin;
+    startup_begin();
     voip_plugin_init();
 
     // create a "/sms" command
     weechat_hook_command("sms",
                          "send an sms message",
-                         "number message...",
-                         "number: a 10-digit phone number\n"
+                         "[-a account] number message..."
+                         " || [-a account] -open number"
+                         " || [-a account] -to number,number... message..."
+                         " || [-a account] -file path message..."
+                         " || -latency [number]"
+                         " || -replay trace [speed]",
+                         "account: label of the account to send from "
+                         "(default: the current buffer's account, or the "
+                         "first account)\n"
+                         "  -open: open the conversation without sending\n"
+                         "    -to: send to several numbers (separated by "
+                         "commas) at once\n"
+                         "  -file: send to the numbers in a file, one per "
+                         "line\n"
+                         "-latency: how long the server takes to answer our "
+                         "messages (p50/p95/p99), overall and for the slowest "
+                         "numbers, or for one number\n"
+                         "-replay: feed the received messages of a trace (see "
+                         "TRACE_FILE) back in, at speed times the recorded "
+                         "rate (default 1, or \"max\")\n"
+                         " number: a 10-digit phone number\n"
                          "message: the message to send",
-                         NULL,
+                         "%(voipms_contacts)"
+                         " || -open %(voipms_contacts)"
+                         " || -to %(voipms_contacts)"
+                         " || -file %(filename)"
+                         " || -latency %(voipms_contacts)"
+                         " || -replay %(filename)"
+                         " || -a",
                          do_sms, NULL, NULL);
 
     // open the VOIP buffer
@@ -207,20 +458,91 @@ int weechat_plugin_init (struct t_weechat_plugin *plugin,
         return WEECHAT_RC_ERROR;
     }
 
+    // two accounts with one label would share a history and buffer names
+    int dup = voip_accounts_duplicate();
+    if(dup >= 0){
+        weechat_printf(voip_buffer, "voipms: accounts %d and %d both have "
+                       "the label \"%s\"; labels must be unique",
+                       voip_account_find(voip_accounts[dup].label) + 1,
+                       dup + 1, voip_accounts[dup].label);
+        voip_plugin_cleanup();
+        return WEECHAT_RC_ERROR;
+    }
+
+    // pick where the history is kept before anything reads it
+    if(hist_use_backend(HIST_BACKEND)){
+        weechat_printf(voip_buffer, "voipms: unknown HIST_BACKEND \"%s\" "
+                       "(use files or sqlite)", HIST_BACKEND);
+        voip_plugin_cleanup();
+        return WEECHAT_RC_ERROR;
+    }
+
     // allocate sip_buffers
     if(sip_buffers_allocate()){
         voip_plugin_cleanup();
         return WEECHAT_RC_ERROR;
     }
+    startup_mark("buffers");
 
-    // restore the history
-    voip_plugin_restore_history();
+    // let scripts see the conversations
+    if(script_start()){
+        weechat_printf(voip_buffer, "voipms: unable to hook hdata/infolists");
+    }
 
-    // launch the pjsip client
+    // tab completion of numbers and names, filled in as buffers are added
+    if(complete_start()){
+        weechat_printf(voip_buffer, "voipms: unable to hook /sms completion");
+    }
+    startup_mark("scripts");
+
+    // what couldn't be sent last time is sent once registered
+    if(outbox_start()){
+        weechat_printf(voip_buffer, "voipms: unable to load the outbox");
+    }
+
+    // record every message in and out, for /sms -replay
+    if(*TRACE_FILE){
+        char path[4096];
+        snprintf(path, sizeof(path), "%s%s%s", *TRACE_FILE == '/' ? "" : wc_dir,
+                 *TRACE_FILE == '/' ? "" : "/", TRACE_FILE);
+        if(trace_open(path)){
+            weechat_printf(voip_buffer, "voipms: unable to record a trace "
+                           "to %s", path);
+        }
+    }
+
+    // how long the server takes to answer, including in earlier sessions
+    if(latency_start()){
+        weechat_printf(voip_buffer, "voipms: unable to track latency");
+    }
+    startup_mark("outbox");
+
+    /* launch the pjsip client, so registration runs alongside the restore;
+       messages arriving meanwhile wait for their conversation's history */
     if(sip_setup()){
         voip_plugin_cleanup();
         return WEECHAT_RC_ERROR;
     }
+    startup_mark("pjsip");
+
+    // restore the history, a slice at a time from the main loop
+    if(restore_start()){
+        weechat_printf(voip_buffer, "voipms: unable to restore history");
+        startup_restored();
+    }
+    startup_mark("manifests");
+
+    // pick up messages other programs add to the history
+    if(watch_start()){
+        weechat_printf(voip_buffer, "voipms: unable to watch the history "
+                       "directory");
+    }
+
+    // the timeline of every conversation, if it's enabled
+    if(timeline_start()){
+        weechat_printf(voip_buffer, "voipms: unable to open the timeline");
+    }
+    startup_mark("watch");
 
     return WEECHAT_RC_OK;
 }
@@ -235,17 +557,19 @@ int weechat_plugin_end (struct t_weechat_plugin *plugin){
 int sip_buffer_input_cb(const void* ptr, void* data,
                         struct t_gui_buffer* buffer, const char* input_data){
     (void)data;
-    // dereference the sip_uri associated with this buffer
-    const char* sip_uri = (const char*)ptr;
-    return voip_plugin_send_sms(buffer, sip_uri, input_data);
+    // dereference the contact associated with this buffer
+    const sip_contact_t* contact = (const sip_contact_t*)ptr;
+    return voip_plugin_send_sms(buffer, contact, input_data, NULL);
 }
 
 int sip_buffer_close_cb(const void* ptr, void* data,
                         struct t_gui_buffer* buffer){
     (void)data;
-    // dereference the sip_uri associated with this buffer
-    const char* sip_uri = (const char*)ptr;
-    // delete this buffer from our list
-    sip_buffers_delete(sip_uri);
+    // dereference the contact associated with this buffer
+    const sip_contact_t* contact = (const sip_contact_t*)ptr;
+    // forget this buffer, but keep the conversation
+    restore_closed(buffer);
+    burst_closed(buffer);
+    sip_buffers_closed(contact, buffer);
     return WEECHAT_RC_OK;
 }
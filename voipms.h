@@ -4,19 +4,33 @@
 #include <weechat/weechat-plugin.h>
 
 #include "config.h"
+#include "buffers.h"
+#include "history.h"
 
 extern struct t_weechat_plugin *weechat_plugin;
 extern struct t_gui_buffer* voip_buffer;
 // name of .weechat dir
 extern const char *wc_dir;
 
-int voip_plugin_send_sms(struct t_gui_buffer* buffer, const char* contact,
-                         const char* msg);
-int voip_plugin_handle_sms(const char* from, size_t flen,
+int voip_plugin_send_sms(struct t_gui_buffer* buffer,
+                         const sip_contact_t* contact, const char* msg,
+                         void* token);
+void voip_plugin_sms_status(void* token, int code, const char* reason,
+                            size_t rlen);
+void voip_plugin_sip_ready(size_t acct);
+int voip_plugin_handle_sms(size_t acct, const char* from, size_t flen,
                            const char* body, size_t blen);
-int voip_plugin_handle_mms(const char* from, size_t flen,
+int voip_plugin_deliver_sms(size_t acct, sip_uri_t* uri, const char* body,
+                            size_t blen);
+int voip_plugin_handle_mms(size_t acct, const char* from, size_t flen,
                            const char* mime, size_t mlen,
                            const char* body, size_t blen);
+void voip_plugin_print_hist_msg(struct t_gui_buffer* buffer,
+                                const hist_msg_t* mp);
+void voip_plugin_print_recent(struct t_gui_buffer* buffer,
+                              const sip_contact_t* contact);
+void voip_plugin_load_history(size_t acct, struct t_gui_buffer* buffer,
+                              const sip_uri_t* uri, const char* filename);
 int sip_buffer_input_cb(const void* ptr, void* data,
                         struct t_gui_buffer* buffer, const char* input_data);
 int sip_buffer_close_cb(const void* ptr, void* data,
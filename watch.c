@@ -0,0 +1,195 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+
+#include "watch.h"
+#include "voipms.h"
+#include "buffers.h"
+#include "restore.h"
+#include "timeline.h"
+#include "burst.h"
+#include "recent.h"
+#include "accounts.h"
+
+// how far into a history file we've shown
+typedef struct {
+    size_t acct;
+    char* fname;
+    size_t offset;
+} watch_file_t;
+
+struct watch {
+    int fd;
+    struct t_hook* hook;
+    // inotify watch descriptor of each account's history directory
+    int* wds;
+    // files we've shown some of
+    watch_file_t* files;
+    size_t nfiles;
+    size_t maxfiles;
+};
+
+struct watch watch = { .fd = -1 };
+
+static watch_file_t* watch_find(size_t acct, const char* fname){
+    for(size_t i = 0; i < watch.nfiles; i++){
+        watch_file_t* f = &watch.files[i];
+        if(f->acct == acct && strcmp(f->fname, fname) == 0) return f;
+    }
+    return NULL;
+}
+
+static watch_file_t* watch_add(size_t acct, const char* fname){
+    if(watch.nfiles == watch.maxfiles){
+        size_t max = watch.maxfiles ? 2 * watch.maxfiles : 32;
+        watch_file_t* files = realloc(watch.files, max * sizeof(*files));
+        if(!files) return NULL;
+        watch.files = files;
+        watch.maxfiles = max;
+    }
+    char* dup = strdup(fname);
+    if(!dup) return NULL;
+    watch_file_t* f = &watch.files[watch.nfiles++];
+    *f = (watch_file_t){ .acct = acct, .fname = dup, .offset = 0 };
+    return f;
+}
+
+void watch_seen(size_t acct, const char* fname, size_t offset){
+    if(watch.fd < 0) return;
+    watch_file_t* f = watch_find(acct, fname);
+    if(!f) f = watch_add(acct, fname);
+    if(f) f->offset = offset;
+}
+
+/* show the messages in f from its offset up to limit (or the end of the file
+   if limit is 0) */
+static void watch_pickup(watch_file_t* f, struct t_gui_buffer* buffer,
+                         size_t limit){
+    hist_reader_t* r = NULL;
+    const char* shard = voip_accounts[f->acct].label;
+    if(hist_reader_open(wc_dir, shard, f->fname, f->offset, &r)) return;
+
+    // after what we received ourselves, if it's still held back
+    burst_flush(buffer);
+    const char* name = weechat_buffer_get_string(buffer, "name");
+    hist_msg_t* msg;
+    while(hist_reader_next(r, &msg) == 0){
+        if(limit && msg->end > limit) break;
+        voip_plugin_print_hist_msg(buffer, msg);
+        timeline_add(name, msg->time, msg->me, msg->msg, msg->len);
+        f->offset = msg->end;
+    }
+    hist_reader_close(r);
+}
+
+// something changed fname in the history directory of acct
+static void watch_changed(size_t acct, const char* fname){
+    size_t uri_len;
+    if(!hist_split_fname(fname, &uri_len)) return;
+    sip_uri_t* uri = sip_uri_intern(fname + 1, uri_len);
+    if(!uri) return;
+
+    struct t_gui_buffer* buffer = sip_buffers_lookup(acct, uri);
+    if(!buffer){
+        /* a conversation without a buffer gets one, like a new message
+           would; opening it shows the whole history, new messages included */
+        sip_buffers_add_closed(acct, uri, fname + uri_len + 2, fname);
+        /* its cached messages are from before the change, and would be
+           printed instead of the history (which also moves our offset) */
+        const sip_contact_t* contact = sip_buffers_conversation(acct, uri);
+        if(contact) recent_clear(contact);
+        sip_buffers_open(acct, uri, true);
+        return;
+    }
+
+    // finish restoring the history first, so this goes after it
+    restore_flush(buffer);
+
+    watch_file_t* f = watch_find(acct, fname);
+    // an open buffer without any history shown yet started with none
+    if(!f) f = watch_add(acct, fname);
+    if(!f) return;
+    watch_pickup(f, buffer, 0);
+}
+
+void watch_own_append(size_t acct, const sip_uri_t* uri, const char* fname,
+                      const hist_pos_t* pos){
+    if(watch.fd < 0 || pos->end == 0) return;
+    watch_file_t* f = watch_find(acct, fname);
+    if(!f){
+        // a new (or renamed) file; there's nothing older to show
+        watch_seen(acct, fname, pos->end);
+        return;
+    }
+    struct t_gui_buffer* buffer = sip_buffers_lookup(acct, uri);
+    if(buffer && f->offset < pos->start){
+        watch_pickup(f, buffer, pos->start);
+    }
+    f->offset = pos->end;
+}
+
+static int watch_fd_cb(const void* ptr, void* data, int fd){
+    (void)ptr;
+    (void)data;
+    // inotify events are aligned to struct inotify_event
+    char buf[16384] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t len;
+    while( (len = read(fd, buf, sizeof(buf))) > 0 ){
+        char* p = buf;
+        while(p < buf + len){
+            struct inotify_event* ev = (struct inotify_event*)p;
+            p += sizeof(*ev) + ev->len;
+            if(!ev->len || (ev->mask & IN_ISDIR)) continue;
+            for(size_t i = 0; i < voip_naccounts; i++){
+                if(watch.wds[i] == ev->wd){
+                    watch_changed(i, ev->name);
+                    break;
+                }
+            }
+        }
+    }
+    return WEECHAT_RC_OK;
+}
+
+int watch_start(void){
+    // other programs can only append to plain history files
+    if(strcmp(hist_backend(), "files") != 0) return 0;
+
+    watch.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if(watch.fd < 0) goto fail;
+
+    watch.wds = malloc(voip_naccounts * sizeof(*watch.wds));
+    if(!watch.wds) goto fail;
+    for(size_t i = 0; i < voip_naccounts; i++){
+        const char* label = voip_accounts[i].label;
+        char path[4096];
+        snprintf(path, sizeof(path), "%s/voipms/history%s%s", wc_dir,
+                 *label ? "/" : "", label);
+        // finished writes, and files renamed into place (as sync tools do)
+        watch.wds[i] = inotify_add_watch(watch.fd, path,
+                                         IN_CLOSE_WRITE | IN_MODIFY
+                                         | IN_MOVED_TO);
+    }
+
+    watch.hook = weechat_hook_fd(watch.fd, 1, 0, 0, watch_fd_cb, NULL, NULL);
+    if(!watch.hook) goto fail;
+    return 0;
+
+fail:
+    watch_stop();
+    return 1;
+}
+
+void watch_stop(void){
+    if(watch.hook) weechat_unhook(watch.hook);
+    if(watch.fd >= 0) close(watch.fd);
+    if(watch.wds) free(watch.wds);
+    for(size_t i = 0; i < watch.nfiles; i++){
+        free(watch.files[i].fname);
+    }
+    if(watch.files) free(watch.files);
+    watch = (struct watch){ .fd = -1 };
+}
@@ -0,0 +1,26 @@
+#ifndef WATCH_H
+#define WATCH_H
+
+#include <stddef.h>
+
+#include "history.h"
+#include "uri.h"
+
+/* Watch the history directories with inotify, and show messages which other
+   programs (e.g. another instance, via a synced directory) append to them.
+   Only the bytes past what we've already shown are read. */
+
+// start watching every account's history directory; returns 0 on success
+int watch_start(void);
+
+// the history in fname has been shown up to offset
+void watch_seen(size_t acct, const char* fname, size_t offset);
+
+/* we appended a message to the history of uri (in file fname) at pos;
+   anything before it that we haven't seen yet is shown first */
+void watch_own_append(size_t acct, const sip_uri_t* uri, const char* fname,
+                      const hist_pos_t* pos);
+
+void watch_stop(void);
+
+#endif // WATCH_H